@@ -0,0 +1,486 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pbwtutil.h"
+
+/* Accumulator fed by the current matching sweep */
+static accum_t *acc = NULL;
+
+int mark_rows(accum_t *, const pbwt_t *, const char *);
+void join_units(accum_t *, const size_t, const size_t, const double);
+void prune_pending(accum_t *);
+
+accum_t *accum_init(const pbwt_t *b, const cmd_t *c, const int flags, const size_t ref0)
+{
+    size_t u = 0;
+    size_t ncell = 0;
+    accum_t *a = NULL;
+
+    a = (accum_t *)calloc(1, sizeof(accum_t));
+    if (a == NULL)
+    {
+        return NULL;
+    }
+
+    a->flags = flags;
+
+    /* Diploid matrices are indexed by individual rather than haplotype */
+    a->shift = c->out_diploid ? 1 : 0;
+    a->n = b->nsam >> a->shift;
+    a->nrow = a->n;
+    a->ncol = a->n;
+
+    /* A trailing haplotype without a partner would index unit n */
+    if (b->nsam & a->shift)
+    {
+        fputs("pbwtutil [ERROR]: --diploid needs an even number of haplotypes\n", stderr);
+        accum_destroy(a);
+        return NULL;
+    }
+
+    /* A reference panel or sample subset turns the square packed matrix
+     * into a dense (rows x columns) block */
+    if (ref0)
+    {
+        if (ref0 & a->shift)
+        {
+            fputs("pbwtutil [ERROR]: target panel has an odd number of haplotypes\n", stderr);
+            accum_destroy(a);
+            return NULL;
+        }
+        a->col0 = ref0 >> a->shift;
+        a->nrow = a->col0;
+        a->ncol = a->n - a->col0;
+        a->row_of = (size_t *)calloc(a->n, sizeof(size_t));
+        if (a->row_of == NULL)
+        {
+            accum_destroy(a);
+            return NULL;
+        }
+        for (u = 0; u < a->nrow; ++u)
+        {
+            a->row_of[u] = u + 1;
+        }
+        ncell = a->nrow * a->ncol;
+    }
+    else if (c->samples_file)
+    {
+        if (mark_rows(a, b, c->samples_file) < 0)
+        {
+            accum_destroy(a);
+            return NULL;
+        }
+        ncell = a->nrow * a->ncol;
+    }
+    else
+    {
+        ncell = a->n * (a->n + 1) / 2;
+    }
+
+    /* Length bins stack one matrix per bin in the same allocation */
+    a->ncell = ncell;
+    a->nbin = c->nbins > 0 ? c->nbins : 1;
+    a->bin_lo = c->minlen_bins;
+
+    /* Resolve the adjacency list format once rather than per match */
+    a->report = c->print_sites ? report_adjlist_with_sites : report_adjlist;
+
+    /* Allocate every requested matrix up front */
+    if (flags & ACC_COUNT)
+    {
+        a->count = (size_t *)calloc(a->nbin * ncell, sizeof(size_t));
+        if (a->count == NULL)
+        {
+            accum_destroy(a);
+            return NULL;
+        }
+    }
+    if (flags & ACC_LENGTH)
+    {
+        a->length = (double *)calloc(a->nbin * ncell, sizeof(double));
+        if (a->length == NULL)
+        {
+            accum_destroy(a);
+            return NULL;
+        }
+    }
+
+    /* Union-find over units; pairs below the length threshold wait in a
+     * hash until their total crosses it or they are joined another way */
+    if (flags & ACC_COMPONENT)
+    {
+        a->parent = (size_t *)malloc(a->n * sizeof(size_t));
+        a->csize = (size_t *)malloc(a->n * sizeof(size_t));
+        if (a->parent == NULL || a->csize == NULL)
+        {
+            accum_destroy(a);
+            return NULL;
+        }
+        for (u = 0; u < a->n; ++u)
+        {
+            a->parent[u] = u;
+            a->csize[u] = 1;
+        }
+        a->comp_min = c->comp_min;
+        if (a->comp_min > 0.0)
+        {
+            a->pending = kh_init(pairlen);
+            a->pending_cap = a->n;
+        }
+    }
+
+    /* A fixed-size min-heap of matches per unit; match only prints the
+     * query's heap, so there only query units get one */
+    if (flags & ACC_TOPK)
+    {
+        a->topk = (size_t)c->top_k;
+        a->topk_hi = a->n;
+        if (c->mode == MATCH)
+        {
+            a->topk_lo = a->n;
+            a->topk_hi = 0;
+            for (u = 0; u < b->nsam; ++u)
+            {
+                if (b->is_query[u])
+                {
+                    a->topk_lo = (u >> a->shift) < a->topk_lo ? u >> a->shift : a->topk_lo;
+                    a->topk_hi = (u >> a->shift) + 1;
+                }
+            }
+            if (a->topk_hi < a->topk_lo)
+            {
+                a->topk_hi = a->topk_lo;
+            }
+        }
+        a->topk_n = (size_t *)calloc(a->topk_hi - a->topk_lo + 1, sizeof(size_t));
+        a->topk_heap = (topk_rec_t *)malloc((a->topk_hi - a->topk_lo) * a->topk * sizeof(topk_rec_t) + 1);
+        if (a->topk_n == NULL || a->topk_heap == NULL)
+        {
+            accum_destroy(a);
+            return NULL;
+        }
+    }
+
+    /* Linear-size totals and a partner sketch per unit */
+    if (flags & ACC_SAMPLE)
+    {
+        a->samp_length = (double *)calloc(a->n, sizeof(double));
+        a->samp_count = (size_t *)calloc(a->n, sizeof(size_t));
+        a->hll = (uint8_t *)calloc(a->n, 1 << HLL_BITS);
+        if (a->samp_length == NULL || a->samp_count == NULL || a->hll == NULL)
+        {
+            accum_destroy(a);
+            return NULL;
+        }
+    }
+
+    /* Binary segments go to an indexed BGZF file */
+    if (flags & ACC_SEGMENT)
+    {
+        a->seg = seg_open(c->segfile, b);
+        if (a->seg == NULL)
+        {
+            accum_destroy(a);
+            return NULL;
+        }
+    }
+
+    acc = a;
+
+    return a;
+}
+
+int accum_destroy(accum_t *a)
+{
+    int v = 0;
+
+    if (a == NULL)
+    {
+        return 0;
+    }
+    if (acc == a)
+    {
+        acc = NULL;
+    }
+    /* The segment file is only complete once its last run is flushed */
+    v = seg_close(a->seg);
+    free(a->row_of);
+    free(a->parent);
+    free(a->csize);
+    free(a->topk_n);
+    free(a->topk_heap);
+    free(a->samp_length);
+    free(a->samp_count);
+    free(a->hll);
+    if (a->pending)
+    {
+        kh_destroy(pairlen, a->pending);
+    }
+    free(a->count);
+    free(a->length);
+    free(a);
+
+    return v;
+}
+
+match_sweep_t get_sweep(const cmd_t *c)
+{
+    /* Query-based modes only report matches involving marked haplotypes */
+    const int query = c->mode == MATCH || c->mode == PILEUP;
+    match_sweep_t native = engine_sweep(c, query);
+
+    if (native)
+    {
+        return native;
+    }
+    if (query)
+    {
+        return c->set_match ? pbwt_set_query_match : pbwt_all_query_match;
+    }
+
+    return c->set_match ? pbwt_set_match : pbwt_all_match;
+}
+
+static inline void accumulate_cell(accum_t *a, const size_t cell, const double length)
+{
+    if (a->flags & ACC_COUNT)
+    {
+        a->count[cell]++;
+    }
+    if (a->flags & ACC_LENGTH)
+    {
+        a->length[cell] += length;
+    }
+}
+
+void accumulate(pbwt_t *b, const size_t first, const size_t second, const size_t begin, const size_t end)
+{
+    const size_t i = first >> acc->shift;
+    const size_t j = second >> acc->shift;
+    size_t ri = 0;
+    size_t rj = 0;
+
+    /* A dense block only takes matches from a row to a column */
+    if (acc->row_of)
+    {
+        ri = j >= acc->col0 ? acc->row_of[i] : 0;
+        rj = i != j && i >= acc->col0 ? acc->row_of[j] : 0;
+        if (ri == 0 && rj == 0)
+        {
+            return;
+        }
+    }
+
+    if (acc->flags & ACC_ADJLIST)
+    {
+        (*acc->report)(b, first, second, begin, end);
+    }
+    if (acc->flags & (ACC_COUNT | ACC_LENGTH))
+    {
+        const double length = b->cm[end] - b->cm[begin];
+        size_t base = 0;
+
+        /* The sweep ran at the lowest bin, so only the upper bounds
+         * need checking */
+        if (acc->nbin > 1)
+        {
+            size_t k = acc->nbin - 1;
+            while (k > 0 && length < acc->bin_lo[k])
+            {
+                --k;
+            }
+            base = k * acc->ncell;
+        }
+        if (acc->row_of == NULL)
+        {
+            if (acc->flags & ACC_COUNT)
+            {
+                acc->count[base + PACKED(i, j)]++;
+            }
+            if (acc->flags & ACC_LENGTH)
+            {
+                acc->length[base + PACKED(i, j)] += length;
+            }
+        }
+        else
+        {
+            /* Rows are 1-based so zero means unmarked */
+            if (ri)
+            {
+                accumulate_cell(acc, base + (ri - 1) * acc->ncol + j - acc->col0, length);
+            }
+            if (rj)
+            {
+                accumulate_cell(acc, base + (rj - 1) * acc->ncol + i - acc->col0, length);
+            }
+        }
+    }
+    if (acc->flags & ACC_COMPONENT)
+    {
+        join_units(acc, i, j, b->cm[end] - b->cm[begin]);
+    }
+    if (acc->flags & ACC_TOPK)
+    {
+        const double length = b->cm[end] - b->cm[begin];
+
+        /* Each side keeps the match in its own heap, rows only in a
+         * dense block, and a unit matching itself keeps it once */
+        if (acc->row_of == NULL || ri)
+        {
+            topk_add(acc, i, first, second, begin, end, length);
+        }
+        if (i != j && (acc->row_of == NULL || rj))
+        {
+            topk_add(acc, j, second, first, begin, end, length);
+        }
+    }
+    if (acc->flags & ACC_SAMPLE)
+    {
+        const double length = b->cm[end] - b->cm[begin];
+
+        /* Same sides as the top-K heaps */
+        if (acc->row_of == NULL || ri)
+        {
+            sample_add(acc, i, j, length);
+        }
+        if (i != j && (acc->row_of == NULL || rj))
+        {
+            sample_add(acc, j, i, length);
+        }
+    }
+    if (acc->flags & ACC_REGION)
+    {
+        add_region(b, first, second, begin, end);
+    }
+    if (acc->flags & ACC_SEGMENT)
+    {
+        seg_add(acc->seg, first, second, begin, end);
+    }
+}
+
+size_t find_root(size_t *parent, size_t u)
+{
+    /* Path halving keeps trees shallow without recursion */
+    while (parent[u] != u)
+    {
+        parent[u] = parent[parent[u]];
+        u = parent[u];
+    }
+
+    return u;
+}
+
+void join_units(accum_t *a, const size_t i, const size_t j, const double length)
+{
+    int r = 0;
+    size_t x = 0;
+    size_t y = 0;
+    khint_t k = 0;
+
+    x = find_root(a->parent, i);
+    y = find_root(a->parent, j);
+    if (x == y)
+    {
+        return;
+    }
+
+    /* Below the threshold the pair's running total decides */
+    if (a->pending)
+    {
+        const uint64_t key = i < j ? (uint64_t)i << 32 | j : (uint64_t)j << 32 | i;
+        k = kh_put(pairlen, a->pending, key, &r);
+        if (r != 0)
+        {
+            kh_value(a->pending, k) = 0.0;
+        }
+        kh_value(a->pending, k) += length;
+        if (kh_value(a->pending, k) < a->comp_min)
+        {
+            if (kh_size(a->pending) >= a->pending_cap)
+            {
+                prune_pending(a);
+            }
+            return;
+        }
+        kh_del(pairlen, a->pending, k);
+    }
+
+    /* Union by size */
+    if (a->csize[x] < a->csize[y])
+    {
+        const size_t t = x;
+        x = y;
+        y = t;
+    }
+    a->parent[y] = x;
+    a->csize[x] += a->csize[y];
+}
+
+void prune_pending(accum_t *a)
+{
+    khint_t k = 0;
+
+    /* Totals of pairs already connected through other matches are dead.
+     * Sweeping whenever the live count doubles keeps the cost amortised
+     * O(1) per match and the table no larger than twice the number of
+     * pairs still waiting on the threshold */
+    for (k = kh_begin(a->pending); k != kh_end(a->pending); ++k)
+    {
+        if (kh_exist(a->pending, k))
+        {
+            const uint64_t key = kh_key(a->pending, k);
+            if (find_root(a->parent, (size_t)(key >> 32)) == find_root(a->parent, (size_t)(key & 0xffffffff)))
+            {
+                kh_del(pairlen, a->pending, k);
+            }
+        }
+    }
+    a->pending_cap = 2 * kh_size(a->pending) > a->n ? 2 * kh_size(a->pending) : a->n;
+}
+
+int mark_rows(accum_t *a, const pbwt_t *b, const char *infile)
+{
+    size_t h = 0;
+    size_t u = 0;
+    khash_t(integer) *ids = NULL;
+
+    ids = read_id_list(infile);
+    if (ids == NULL)
+    {
+        return -1;
+    }
+
+    a->row_of = (size_t *)calloc(a->n, sizeof(size_t));
+    if (a->row_of == NULL)
+    {
+        free_id_list(ids);
+        return -1;
+    }
+
+    /* A unit is marked if any of its haplotypes carries a listed ID */
+    for (h = 0; h < b->nsam; ++h)
+    {
+        if (kh_get(integer, ids, b->sid[h]) != kh_end(ids))
+        {
+            a->row_of[h >> a->shift] = 1;
+        }
+    }
+    free_id_list(ids);
+
+    /* Number marked rows in panel order */
+    a->nrow = 0;
+    for (u = 0; u < a->n; ++u)
+    {
+        if (a->row_of[u])
+        {
+            a->row_of[u] = ++a->nrow;
+        }
+    }
+    if (a->nrow == 0)
+    {
+        fprintf(stderr, "pbwtutil [ERROR]: no samples from %s found in panel\n", infile);
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,478 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "pbwtutil.h"
+
+/* Size of each read when spooling standard input */
+#define STDIN_CHUNK (1 << 22)
+
+pbwt_t *read_input(const cmd_t *);
+pbwt_t *import_panel(const cmd_t *);
+pbwt_t *merge_panels(const pbwt_t *, const pbwt_t *);
+int filter_sites(pbwt_t *, const cmd_t *);
+int count_alleles(const pbwt_t *, size_t *);
+
+pbwt_t *load_pbwt(const cmd_t *c)
+{
+    pbwt_t *b = NULL;
+
+    b = read_input(c);
+    if (b == NULL)
+    {
+        return NULL;
+    }
+
+    /* Drop sites before any sweep sees them */
+    if (c->min_maf > 0.0 || c->thin_cm > 0.0 || c->sites_file || c->exclude_sites)
+    {
+        if (filter_sites(b, c) < 0)
+        {
+            pbwt_destroy(b);
+            return NULL;
+        }
+    }
+
+    return b;
+}
+
+pbwt_t *load_pbwt_ref(const cmd_t *c, size_t *ref0)
+{
+    pbwt_t *t = NULL;
+    pbwt_t *r = NULL;
+    pbwt_t *b = NULL;
+
+    t = read_input(c);
+    if (t == NULL)
+    {
+        return NULL;
+    }
+    r = read_panel(c->ref_file, c->nthreads);
+    if (r == NULL)
+    {
+        pbwt_destroy(t);
+        return NULL;
+    }
+
+    /* Target haplotypes come first, reference haplotypes after */
+    b = merge_panels(t, r);
+    *ref0 = t->nsam;
+    pbwt_destroy(t);
+    pbwt_destroy(r);
+    if (b == NULL)
+    {
+        return NULL;
+    }
+
+    /* Filters see the union so both panels keep the same sites */
+    if (c->min_maf > 0.0 || c->thin_cm > 0.0 || c->sites_file || c->exclude_sites)
+    {
+        if (filter_sites(b, c) < 0)
+        {
+            pbwt_destroy(b);
+            return NULL;
+        }
+    }
+
+    return b;
+}
+
+pbwt_t *read_input(const cmd_t *c)
+{
+    /* A VCF given with --vcf stands in for the PBWT file */
+    if (c->vcf_file)
+    {
+        return import_panel(c);
+    }
+
+    return read_panel(c->instub, c->nthreads);
+}
+
+pbwt_t *read_panel(const char *infile, const int nthreads)
+{
+    /* Read in the pbwt file from disk or standard input, uncompressed */
+    return read_pbwt(infile, 1, NULL, nthreads);
+}
+
+pbwt_t *import_panel(const cmd_t *c)
+{
+    int v = 0;
+    pbwt_t *b = NULL;
+
+    /* Import straight into memory; nothing is read back from disk */
+    b = pbwt_import_vcf(c->vcf_file, c->popmap);
+    if (b == NULL)
+    {
+        fputs("pbwtutil [ERROR]: problem importing VCF data\n", stderr);
+        return NULL;
+    }
+
+    /* The import leaves the haplotypes compressed, as convert stores them */
+    if (c->save_file)
+    {
+        v = pbwt_write(c->save_file, b);
+        if (v != 0)
+        {
+            fprintf(stderr, "pbwtutil [ERROR]: cannot write PBWT to %s\n", c->save_file);
+            pbwt_destroy(b);
+            return NULL;
+        }
+        if (sidecar_build(b, c->save_file) < 0)
+        {
+            pbwt_destroy(b);
+            return NULL;
+        }
+    }
+
+    v = pbwt_uncompress(b);
+    if (v < 0)
+    {
+        fputs("pbwtutil [ERROR]: error uncompressing haplotype data\n", stderr);
+        pbwt_destroy(b);
+        return NULL;
+    }
+
+    return b;
+}
+
+pbwt_t *read_pbwt(const char *infile, const int with_data, size_t *packed, const int nthreads)
+{
+    int fd = -1;
+    ssize_t nr = 0;
+    char path[64];
+    char *buf = NULL;
+    const char *name = infile;
+    pbwt_t *b = NULL;
+
+    if (is_stdin(infile))
+    {
+        /* libpbwt only reads from a path, so the stream is spooled once in
+         * large chunks into an anonymous memory-backed file and read from
+         * there; nothing touches the disk */
+        fd = memfd_create("pbwtutil-stdin", 0);
+        buf = (char *)malloc(STDIN_CHUNK);
+        if (fd < 0 || buf == NULL)
+        {
+            fputs("pbwtutil [ERROR]: cannot buffer standard input\n", stderr);
+            return NULL;
+        }
+        while ((nr = read(STDIN_FILENO, buf, STDIN_CHUNK)) > 0)
+        {
+            ssize_t off = 0;
+            while (off < nr)
+            {
+                ssize_t nw = write(fd, buf + off, (size_t)(nr - off));
+                if (nw < 0)
+                {
+                    fputs("pbwtutil [ERROR]: cannot buffer standard input\n", stderr);
+                    close(fd);
+                    free(buf);
+                    return NULL;
+                }
+                off += nw;
+            }
+        }
+        free(buf);
+        if (nr < 0 || lseek(fd, 0, SEEK_SET) != 0)
+        {
+            fputs("pbwtutil [ERROR]: error reading standard input\n", stderr);
+            close(fd);
+            return NULL;
+        }
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+        infile = path;
+        name = "standard input";
+    }
+
+    /* Block-compressed files are inflated here, in parallel; anything
+     * else is left to libpbwt */
+    if (block_probe(infile))
+    {
+        b = block_read(infile, with_data, packed, nthreads);
+    }
+    else
+    {
+        b = pbwt_read(infile);
+        if (b && packed)
+        {
+            *packed = b->datasize;
+        }
+        if (b && with_data && pbwt_uncompress(b) < 0)
+        {
+            fputs("pbwtutil [ERROR]: error uncompressing haplotype data\n", stderr);
+            pbwt_destroy(b);
+            b = NULL;
+            name = NULL;
+        }
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    if (b == NULL && name)
+    {
+        fprintf(stderr, "pbwtutil [ERROR]: cannot read data from %s\n", name);
+    }
+
+    return b;
+}
+
+pbwt_t *merge_panels(const pbwt_t *t, const pbwt_t *r)
+{
+    size_t i = 0;
+    size_t j = 0;
+    pbwt_t *b = NULL;
+
+    /* Panels must be on the same sites in the same order */
+    if (t->nsite != r->nsite)
+    {
+        fprintf(stderr, "pbwtutil [ERROR]: target has %zu sites but reference has %zu\n",
+                t->nsite, r->nsite);
+        return NULL;
+    }
+    for (j = 0; j < t->nsite; ++j)
+    {
+        if (strcmp(t->chr[j], r->chr[j]) != 0 || strcmp(t->rsid[j], r->rsid[j]) != 0)
+        {
+            fprintf(stderr, "pbwtutil [ERROR]: site %zu differs between panels (%s:%s vs %s:%s)\n",
+                    j, t->chr[j], t->rsid[j], r->chr[j], r->rsid[j]);
+            return NULL;
+        }
+    }
+
+    b = pbwt_init(t->nsite, t->nsam + r->nsam);
+    if (b == NULL)
+    {
+        fputs("pbwtutil [ERROR]: memory allocation failure\n", stderr);
+        return NULL;
+    }
+
+    /* Site metadata is taken from the target */
+    for (j = 0; j < t->nsite; ++j)
+    {
+        b->chr[j] = strdup(t->chr[j]);
+        b->rsid[j] = strdup(t->rsid[j]);
+        b->cm[j] = t->cm[j];
+    }
+
+    /* Rows are contiguous so each panel is a single copy */
+    memcpy(b->data, t->data, t->nsam * t->nsite);
+    memcpy(b->data + TWODCORD(t->nsam, t->nsite, 0), r->data, r->nsam * r->nsite);
+    for (i = 0; i < t->nsam; ++i)
+    {
+        b->sid[i] = strdup(t->sid[i]);
+        b->reg[i] = strdup(t->reg[i]);
+    }
+    for (i = 0; i < r->nsam; ++i)
+    {
+        b->sid[t->nsam + i] = strdup(r->sid[i]);
+        b->reg[t->nsam + i] = strdup(r->reg[i]);
+    }
+
+    return b;
+}
+
+int filter_sites(pbwt_t *b, const cmd_t *c)
+{
+    size_t i = 0;
+    size_t j = 0;
+    size_t nkeep = 0;
+    size_t *count = NULL;
+    char *keep = NULL;
+    double last_cm = 0.0;
+    const char *last_chr = NULL;
+    khash_t(integer) *include = NULL;
+    khash_t(integer) *exclude = NULL;
+
+    keep = (char *)malloc(b->nsite);
+    if (keep == NULL)
+    {
+        fputs("pbwtutil [ERROR]: memory allocation failure\n", stderr);
+        return -1;
+    }
+    memset(keep, 1, b->nsite);
+
+    /* Site lists are matched against rsid */
+    if (c->sites_file)
+    {
+        include = read_id_list(c->sites_file);
+        if (include == NULL)
+        {
+            return -1;
+        }
+        for (j = 0; j < b->nsite; ++j)
+        {
+            if (kh_get(integer, include, b->rsid[j]) == kh_end(include))
+            {
+                keep[j] = 0;
+            }
+        }
+    }
+    if (c->exclude_sites)
+    {
+        exclude = read_id_list(c->exclude_sites);
+        if (exclude == NULL)
+        {
+            return -1;
+        }
+        for (j = 0; j < b->nsite; ++j)
+        {
+            if (kh_get(integer, exclude, b->rsid[j]) != kh_end(exclude))
+            {
+                keep[j] = 0;
+            }
+        }
+    }
+
+    /* Minor allele frequency from a single pass over the haplotypes */
+    if (c->min_maf > 0.0)
+    {
+        count = (size_t *)calloc(b->nsite, sizeof(size_t));
+        if (count == NULL)
+        {
+            fputs("pbwtutil [ERROR]: memory allocation failure\n", stderr);
+            return -1;
+        }
+        count_alleles(b, count);
+        for (j = 0; j < b->nsite; ++j)
+        {
+            double p = (double)count[j] / b->nsam;
+            if ((p < 0.5 ? p : 1.0 - p) < c->min_maf)
+            {
+                keep[j] = 0;
+            }
+        }
+        free(count);
+    }
+
+    /* Thin surviving sites to a minimum genetic spacing per chromosome */
+    if (c->thin_cm > 0.0)
+    {
+        for (j = 0; j < b->nsite; ++j)
+        {
+            if (keep[j] == 0)
+            {
+                continue;
+            }
+            if (last_chr && strcmp(last_chr, b->chr[j]) == 0 && b->cm[j] - last_cm < c->thin_cm)
+            {
+                keep[j] = 0;
+                continue;
+            }
+            last_chr = b->chr[j];
+            last_cm = b->cm[j];
+        }
+    }
+
+    /* Compact site metadata */
+    for (j = 0; j < b->nsite; ++j)
+    {
+        if (keep[j])
+        {
+            b->cm[nkeep] = b->cm[j];
+            b->rsid[nkeep] = b->rsid[j];
+            b->chr[nkeep] = b->chr[j];
+            ++nkeep;
+        }
+        else
+        {
+            free(b->rsid[j]);
+            free(b->chr[j]);
+        }
+    }
+
+    if (nkeep == 0)
+    {
+        fputs("pbwtutil [ERROR]: no sites left after filtering\n", stderr);
+        return -1;
+    }
+
+    /* Compact haplotype rows in place; rows only ever move backwards */
+    for (i = 0; i < b->nsam; ++i)
+    {
+        const unsigned char *src = b->data + TWODCORD(i, b->nsite, 0);
+        unsigned char *dst = b->data + TWODCORD(i, nkeep, 0);
+        size_t k = 0;
+        for (j = 0; j < b->nsite; ++j)
+        {
+            dst[k] = src[j];
+            k += keep[j];
+        }
+    }
+
+    b->nsite = nkeep;
+    b->datasize = b->nsam * nkeep;
+
+    /* Clean up allocated memory */
+    free(keep);
+    free_id_list(include);
+    free_id_list(exclude);
+
+    return 0;
+}
+
+int count_alleles(const pbwt_t *b, size_t *count)
+{
+    size_t i = 0;
+    size_t j = 0;
+    const size_t nsite = b->nsite;
+
+    /* Alleles are stored as characters whose low bit is the allele.
+     * Row-wise accumulation keeps the inner loop contiguous so the
+     * compiler can vectorise it */
+    for (i = 0; i < b->nsam; ++i)
+    {
+        const unsigned char *restrict row = b->data + TWODCORD(i, nsite, 0);
+        size_t *restrict n = count;
+        for (j = 0; j < nsite; ++j)
+        {
+            n[j] += row[j] & 1;
+        }
+    }
+
+    return 0;
+}
+
+khash_t(integer) *read_id_list(const char *infile)
+{
+    int a = 0;
+    char buf[1024];
+    FILE *fin = NULL;
+    khash_t(integer) *h = NULL;
+
+    fin = fopen(infile, "r");
+    if (fin == NULL)
+    {
+        fprintf(stderr, "pbwtutil [ERROR]: cannot open identifier list %s\n", infile);
+        return NULL;
+    }
+
+    h = kh_init(integer);
+    while (fscanf(fin, "%1023s%*[^\n]", buf) == 1)
+    {
+        kh_put(integer, h, strdup(buf), &a);
+    }
+    fclose(fin);
+
+    return h;
+}
+
+void free_id_list(khash_t(integer) *h)
+{
+    khint_t k = 0;
+
+    if (h == NULL)
+    {
+        return;
+    }
+    for (k = kh_begin(h); k != kh_end(h); ++k)
+    {
+        if (kh_exist(h, k))
+        {
+            free((char *)kh_key(h, k));
+        }
+    }
+    kh_destroy(integer, h);
+}
@@ -0,0 +1,383 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "pbwtutil.h"
+
+/* A match cache (.pbwt.mcache) stores every maximal match found at some
+ * base length, in CSR form by haplotype: an offset table followed by each
+ * haplotype's records sorted by partner and start site. Every match is
+ * stored under both of its haplotypes. Any later sweep with the same or a
+ * longer minimum length, and no set-maximal restriction, is answered by
+ * walking the mapped records instead of running libpbwt. Like the sample
+ * index, the cache records the size and mtime of its .pbwt. */
+
+#define MCACHE_MAGIC "PBWTMCH1"
+#define MCACHE_FIRST 0x1
+
+typedef struct mcache_hdr
+{
+    char magic[8];
+    uint64_t nsam;
+    uint64_t nsite;
+    uint64_t nrec;
+    uint64_t pbwt_size;
+    int64_t pbwt_mtime;
+    double minlen;
+} mcache_hdr_t;
+
+typedef struct mcache_rec
+{
+    uint32_t other;
+    uint32_t begin;
+    uint32_t end;
+    uint32_t flags;
+} mcache_rec_t;
+
+typedef struct raw_match
+{
+    uint32_t first;
+    uint32_t second;
+    uint32_t begin;
+    uint32_t end;
+} raw_match_t;
+
+#define MCACHE_BUFSIZE (1 << 20)
+
+/* Matches collected by the indexing sweep. Degrees are counted as matches
+ * arrive; full buffers spill to a temporary file so the raw list is never
+ * held next to the CSR records */
+static raw_match_t *raw = NULL;
+static size_t nraw = 0;
+static uint64_t nmatch = 0;
+static uint64_t *deg = NULL;
+static char *spillname = NULL;
+static FILE *spill = NULL;
+static int collect_err = 0;
+
+void collect_match(pbwt_t *, const size_t, const size_t, const size_t, const size_t);
+int spill_raw(void);
+void scatter_raw(mcache_rec_t *, uint64_t *, const size_t);
+int compare_mcache_rec(const void *, const void *);
+char *mcache_name(const char *);
+
+int pbwt_index_matches(const cmd_t *c)
+{
+    int v = 0;
+    size_t h = 0;
+    size_t n = 0;
+    uint64_t *fill = NULL;
+    char *outfile = NULL;
+    mcache_rec_t *rec = NULL;
+    mcache_hdr_t hdr;
+    struct stat st;
+    FILE *fp = NULL;
+    pbwt_t *b = NULL;
+
+    if (c == NULL)
+    {
+        return -1;
+    }
+
+    b = load_pbwt(c);
+    if (b == NULL)
+    {
+        return -1;
+    }
+
+    outfile = mcache_name(c->instub);
+    raw = (raw_match_t *)malloc(MCACHE_BUFSIZE * sizeof(raw_match_t));
+    deg = (uint64_t *)calloc(b->nsam + 1, sizeof(uint64_t));
+    spillname = outfile ? (char *)malloc(strlen(outfile) + 5) : NULL;
+    if (outfile == NULL || raw == NULL || deg == NULL || spillname == NULL)
+    {
+        fputs("pbwtutil [ERROR]: memory allocation failure\n", stderr);
+        return -1;
+    }
+    sprintf(spillname, "%s.tmp", outfile);
+
+    /* Every match at the base length, not only set-maximal ones */
+    v = (*get_sweep(c))(b, c->minlen, collect_match);
+    if (v < 0)
+    {
+        fputs("pbwtutil [ERROR]: error retrieving matches\n", stderr);
+        return -1;
+    }
+    if (collect_err == 0 && spill != NULL)
+    {
+        collect_err = spill_raw();
+    }
+    if (collect_err < 0)
+    {
+        fprintf(stderr, "pbwtutil [ERROR]: error writing %s\n", spillname);
+        return -1;
+    }
+
+    /* Degrees are known, so scatter both orientations straight into place */
+    fill = (uint64_t *)malloc(b->nsam * sizeof(uint64_t));
+    rec = (mcache_rec_t *)malloc(2 * nmatch * sizeof(mcache_rec_t) + 1);
+    if (fill == NULL || rec == NULL)
+    {
+        fputs("pbwtutil [ERROR]: memory allocation failure\n", stderr);
+        return -1;
+    }
+    for (h = 0; h < b->nsam; ++h)
+    {
+        deg[h+1] += deg[h];
+        fill[h] = deg[h];
+    }
+    if (spill == NULL)
+    {
+        scatter_raw(rec, fill, nraw);
+    }
+    else
+    {
+        rewind(spill);
+        while ((n = fread(raw, sizeof(raw_match_t), MCACHE_BUFSIZE, spill)) > 0)
+        {
+            scatter_raw(rec, fill, n);
+        }
+        if (ferror(spill))
+        {
+            fprintf(stderr, "pbwtutil [ERROR]: error reading %s\n", spillname);
+            return -1;
+        }
+        fclose(spill);
+        spill = NULL;
+    }
+    free(raw);
+    raw = NULL;
+    free(spillname);
+    spillname = NULL;
+    for (h = 0; h < b->nsam; ++h)
+    {
+        qsort(rec + deg[h], deg[h+1] - deg[h], sizeof(mcache_rec_t), compare_mcache_rec);
+    }
+
+    if (stat(c->instub, &st) != 0)
+    {
+        fprintf(stderr, "pbwtutil [ERROR]: cannot stat %s\n", c->instub);
+        return -1;
+    }
+    memset(&hdr, 0, sizeof(mcache_hdr_t));
+    memcpy(hdr.magic, MCACHE_MAGIC, 8);
+    hdr.nsam = b->nsam;
+    hdr.nsite = b->nsite;
+    hdr.nrec = deg[b->nsam];
+    hdr.pbwt_size = (uint64_t)st.st_size;
+    hdr.pbwt_mtime = (int64_t)st.st_mtime;
+    hdr.minlen = c->minlen;
+
+    fp = fopen(outfile, "wb");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "pbwtutil [ERROR]: cannot open match cache for writing\n");
+        return -1;
+    }
+    if (fwrite(&hdr, sizeof(mcache_hdr_t), 1, fp) != 1 ||
+        fwrite(deg, sizeof(uint64_t), b->nsam + 1, fp) != b->nsam + 1 ||
+        fwrite(rec, sizeof(mcache_rec_t), hdr.nrec, fp) != hdr.nrec)
+    {
+        v = -1;
+    }
+    if (fclose(fp) != 0 || v < 0)
+    {
+        fprintf(stderr, "pbwtutil [ERROR]: error writing %s\n", outfile);
+        return -1;
+    }
+
+    /* Clean up allocated memory */
+    free(outfile);
+    free(deg);
+    deg = NULL;
+    free(fill);
+    free(rec);
+    pbwt_destroy(b);
+
+    return 0;
+}
+
+void collect_match(pbwt_t *b, const size_t first, const size_t second, const size_t begin, const size_t end)
+{
+    /* Called from the sweep: a failed spill stops collection and is
+     * reported once the sweep returns */
+    if (collect_err < 0)
+    {
+        return;
+    }
+    if (nraw == MCACHE_BUFSIZE && spill_raw() < 0)
+    {
+        collect_err = -1;
+        return;
+    }
+    raw[nraw].first = (uint32_t)first;
+    raw[nraw].second = (uint32_t)second;
+    raw[nraw].begin = (uint32_t)begin;
+    raw[nraw].end = (uint32_t)end;
+    deg[first+1]++;
+    deg[second+1]++;
+    ++nraw;
+    ++nmatch;
+}
+
+int spill_raw(void)
+{
+    if (spill == NULL)
+    {
+        spill = fopen(spillname, "w+b");
+        if (spill == NULL)
+        {
+            return -1;
+        }
+        /* Nothing else opens it, so it goes away with the handle */
+        unlink(spillname);
+    }
+    if (fwrite(raw, sizeof(raw_match_t), nraw, spill) != nraw)
+    {
+        return -1;
+    }
+    nraw = 0;
+
+    return 0;
+}
+
+void scatter_raw(mcache_rec_t *rec, uint64_t *fill, const size_t n)
+{
+    size_t i = 0;
+
+    for (i = 0; i < n; ++i)
+    {
+        mcache_rec_t *r = rec + fill[raw[i].first]++;
+        r->other = raw[i].second;
+        r->begin = raw[i].begin;
+        r->end = raw[i].end;
+        r->flags = MCACHE_FIRST;
+        r = rec + fill[raw[i].second]++;
+        r->other = raw[i].first;
+        r->begin = raw[i].begin;
+        r->end = raw[i].end;
+        r->flags = 0;
+    }
+}
+
+int sweep_matches(pbwt_t *b, const cmd_t *c, const double minlen, match_report_t report)
+{
+    int fd = -1;
+    size_t h = 0;
+    size_t size = 0;
+    uint64_t k = 0;
+    char *cachefile = NULL;
+    void *base = NULL;
+    const mcache_hdr_t *hdr = NULL;
+    const uint64_t *off = NULL;
+    const mcache_rec_t *rec = NULL;
+    const int query = c->mode == MATCH || c->mode == PILEUP;
+    struct stat st;
+    struct stat cst;
+
+    /* The cache indexes the panel exactly as stored on disk */
+    if (c->set_match || c->ref_file || c->min_maf > 0.0 || c->thin_cm > 0.0 ||
+        c->sites_file || c->exclude_sites || c->vcf_file || is_stdin(c->instub) ||
+        c->engine == ENGINE_CHECK)
+    {
+        return (*get_sweep(c))(b, minlen, report);
+    }
+
+    cachefile = mcache_name(c->instub);
+    fd = cachefile ? open(cachefile, O_RDONLY) : -1;
+    free(cachefile);
+    if (fd < 0)
+    {
+        return (*get_sweep(c))(b, minlen, report);
+    }
+    if (fstat(fd, &cst) != 0 || stat(c->instub, &st) != 0 || (size_t)cst.st_size < sizeof(mcache_hdr_t))
+    {
+        close(fd);
+        return (*get_sweep(c))(b, minlen, report);
+    }
+    size = (size_t)cst.st_size;
+    base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        return (*get_sweep(c))(b, minlen, report);
+    }
+
+    hdr = (const mcache_hdr_t *)base;
+    if (memcmp(hdr->magic, MCACHE_MAGIC, 8) != 0 || hdr->nsam != b->nsam || hdr->nsite != b->nsite ||
+        hdr->pbwt_size != (uint64_t)st.st_size || hdr->pbwt_mtime != (int64_t)st.st_mtime ||
+        sizeof(mcache_hdr_t) + (hdr->nsam + 1) * sizeof(uint64_t) + hdr->nrec * sizeof(mcache_rec_t) > size)
+    {
+        fprintf(stderr, "pbwtutil [WARNING]: ignoring stale match cache for %s\n", c->instub);
+        munmap(base, size);
+        return (*get_sweep(c))(b, minlen, report);
+    }
+    if (minlen < hdr->minlen)
+    {
+        munmap(base, size);
+        return (*get_sweep(c))(b, minlen, report);
+    }
+
+    off = (const uint64_t *)((const char *)base + sizeof(mcache_hdr_t));
+    rec = (const mcache_rec_t *)(off + hdr->nsam + 1);
+
+    /* Each match is reported once, from the lower haplotype, or from the
+     * query haplotype in query modes */
+    for (h = 0; h < b->nsam; ++h)
+    {
+        if (query && !b->is_query[h])
+        {
+            continue;
+        }
+        for (k = off[h]; k < off[h+1]; ++k)
+        {
+            const mcache_rec_t *r = rec + k;
+            const int other_query = query && b->is_query[r->other];
+            if ((query ? other_query && r->other < h : r->other < h) ||
+                b->cm[r->end] - b->cm[r->begin] < minlen)
+            {
+                continue;
+            }
+            if (r->flags & MCACHE_FIRST)
+            {
+                (*report)(b, h, r->other, r->begin, r->end);
+            }
+            else
+            {
+                (*report)(b, r->other, h, r->begin, r->end);
+            }
+        }
+    }
+
+    munmap(base, size);
+
+    return 0;
+}
+
+int compare_mcache_rec(const void *a, const void *b)
+{
+    const mcache_rec_t *x = (const mcache_rec_t *)a;
+    const mcache_rec_t *y = (const mcache_rec_t *)b;
+
+    if (x->other != y->other)
+    {
+        return x->other < y->other ? -1 : 1;
+    }
+    return (x->begin > y->begin) - (x->begin < y->begin);
+}
+
+char *mcache_name(const char *pbwtfile)
+{
+    char *cachefile = NULL;
+
+    cachefile = (char *)malloc(strlen(pbwtfile) + 8);
+    if (cachefile)
+    {
+        sprintf(cachefile, "%s.mcache", pbwtfile);
+    }
+
+    return cachefile;
+}
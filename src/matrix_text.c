@@ -0,0 +1,280 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "pbwtutil.h"
+
+/* Text output of the count and length matrices. Rows are formatted in
+ * blocks by parallel workers, each into its own buffer, and the buffers
+ * are written in row order with one large write each. The workers are
+ * started once and woken for every round of blocks, so a wide matrix
+ * with one row per block does not pay for a thread start per row. Cells use integer
+ * formatters that match "%zu" and "%1.4lf" byte for byte; a length that
+ * lies too close to a rounding tie, or is out of range, is handed to
+ * snprintf so the output never depends on which path was taken. */
+
+#define FORMAT_BLOCK_BYTES (1 << 20)
+#define FORMAT_CELL_MAX 400
+
+typedef struct format_pool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    size_t round;
+    int pending;
+    int quit;
+} format_pool_t;
+
+typedef struct format_job
+{
+    format_pool_t *pool;
+    const accum_t *acc;
+    int length;
+    int status;
+    size_t base;
+    size_t lo;
+    size_t hi;
+    size_t len;
+    size_t cap;
+    char *buf;
+} format_job_t;
+
+void *format_worker(void *);
+void *pool_worker(void *);
+size_t format_count(char *, size_t);
+size_t format_length(char *, const double);
+
+int print_matrix(out_t *fp, const accum_t *acc, const int length, const size_t bin, const int nthreads)
+{
+    int v = 0;
+    int nt = nthreads > 1 ? nthreads : 1;
+    int nrun = 1;
+    int k = 0;
+    size_t i = 0;
+    size_t rows = 0;
+    pthread_t *tid = NULL;
+    format_job_t *job = NULL;
+    format_pool_t pool;
+
+    /* Rows per job so that each buffer is about a megabyte, but no more
+     * than an even share of the matrix so a small one still uses every
+     * worker */
+    rows = FORMAT_BLOCK_BYTES / (acc->ncol * 8 + 1);
+    if (rows > (acc->nrow + nt - 1) / nt)
+    {
+        rows = (acc->nrow + nt - 1) / nt;
+    }
+    rows = rows > 0 ? rows : 1;
+
+    tid = (pthread_t *)malloc(nt * sizeof(pthread_t));
+    job = (format_job_t *)calloc(nt, sizeof(format_job_t));
+    if (tid == NULL || job == NULL)
+    {
+        fputs("pbwtutil [ERROR]: memory allocation failure\n", stderr);
+        return -1;
+    }
+
+    memset(&pool, 0, sizeof(format_pool_t));
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.start, NULL);
+    pthread_cond_init(&pool.done, NULL);
+    for (k = 0; k < nt; ++k)
+    {
+        job[k].pool = &pool;
+        job[k].acc = acc;
+        job[k].length = length;
+        job[k].base = bin * acc->ncell;
+    }
+    for (nrun = 1; nrun < nt; ++nrun)
+    {
+        if (pthread_create(&tid[nrun], NULL, pool_worker, &job[nrun]) != 0)
+        {
+            fputs("pbwtutil [ERROR]: cannot start worker thread\n", stderr);
+            v = -1;
+            break;
+        }
+    }
+
+    for (i = 0; i < acc->nrow && v == 0; i += rows * nt)
+    {
+        for (k = 0; k < nt; ++k)
+        {
+            job[k].lo = i + k * rows < acc->nrow ? i + k * rows : acc->nrow;
+            job[k].hi = job[k].lo + rows < acc->nrow ? job[k].lo + rows : acc->nrow;
+            job[k].len = 0;
+        }
+
+        /* Wake the pool for this round and wait until every block is done */
+        pthread_mutex_lock(&pool.lock);
+        pool.pending = nt - 1;
+        ++pool.round;
+        pthread_cond_broadcast(&pool.start);
+        pthread_mutex_unlock(&pool.lock);
+        format_worker(&job[0]);
+        pthread_mutex_lock(&pool.lock);
+        while (pool.pending > 0)
+        {
+            pthread_cond_wait(&pool.done, &pool.lock);
+        }
+        pthread_mutex_unlock(&pool.lock);
+
+        /* Blocks go out in row order */
+        for (k = 0; k < nt; ++k)
+        {
+            if (job[k].status < 0 || out_write(fp, job[k].buf, job[k].len) < 0)
+            {
+                v = -1;
+                break;
+            }
+        }
+    }
+
+    /* Only the workers that started are stopped and joined */
+    pthread_mutex_lock(&pool.lock);
+    pool.quit = 1;
+    pthread_cond_broadcast(&pool.start);
+    pthread_mutex_unlock(&pool.lock);
+    for (k = 1; k < nrun; ++k)
+    {
+        pthread_join(tid[k], NULL);
+    }
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.start);
+    pthread_cond_destroy(&pool.done);
+
+    /* Clean up allocated memory */
+    for (k = 0; k < nt; ++k)
+    {
+        free(job[k].buf);
+    }
+    free(job);
+    free(tid);
+
+    return v;
+}
+
+void *format_worker(void *arg)
+{
+    size_t i = 0;
+    size_t j = 0;
+    format_job_t *m = (format_job_t *)arg;
+    const accum_t *acc = m->acc;
+    const size_t n = acc->ncol;
+    const int dense = acc->row_of != NULL;
+
+    for (i = m->lo; i < m->hi; ++i)
+    {
+        for (j = 0; j < n; ++j)
+        {
+            const size_t x = m->base + (dense ? i * n + j : PACKED(i, j));
+
+            /* Room for the widest cell and its separator */
+            if (m->cap - m->len < FORMAT_CELL_MAX + 1)
+            {
+                size_t cap = m->cap ? 2 * m->cap : FORMAT_BLOCK_BYTES + FORMAT_CELL_MAX;
+                char *buf = (char *)realloc(m->buf, cap);
+                if (buf == NULL)
+                {
+                    m->status = -1;
+                    return NULL;
+                }
+                m->buf = buf;
+                m->cap = cap;
+            }
+            if (m->length)
+            {
+                m->len += format_length(m->buf + m->len, acc->length[x]);
+            }
+            else
+            {
+                m->len += format_count(m->buf + m->len, acc->count[x]);
+            }
+            m->buf[m->len++] = j < n - 1 ? '\t' : '\n';
+        }
+    }
+
+    return NULL;
+}
+
+void *pool_worker(void *arg)
+{
+    size_t seen = 0;
+    format_job_t *m = (format_job_t *)arg;
+    format_pool_t *p = m->pool;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&p->lock);
+        while (p->round == seen && !p->quit)
+        {
+            pthread_cond_wait(&p->start, &p->lock);
+        }
+        if (p->quit)
+        {
+            pthread_mutex_unlock(&p->lock);
+            break;
+        }
+        seen = p->round;
+        pthread_mutex_unlock(&p->lock);
+
+        format_worker(m);
+
+        pthread_mutex_lock(&p->lock);
+        if (--p->pending == 0)
+        {
+            pthread_cond_signal(&p->done);
+        }
+        pthread_mutex_unlock(&p->lock);
+    }
+
+    return NULL;
+}
+
+size_t format_count(char *s, size_t x)
+{
+    size_t k = 0;
+    size_t n = 0;
+    char tmp[24];
+
+    do
+    {
+        tmp[n++] = (char)('0' + x % 10);
+        x /= 10;
+    } while (x);
+    for (k = 0; k < n; ++k)
+    {
+        s[k] = tmp[n-1-k];
+    }
+
+    return n;
+}
+
+size_t format_length(char *s, const double x)
+{
+    size_t n = 0;
+    uint64_t r = 0;
+    double scaled = 0.0;
+    double frac = 0.0;
+
+    /* Below 2^40 the product x * 1e4 is off by far less than the margin
+     * kept around ties, so rounding it agrees with printf */
+    scaled = x * 10000.0;
+    frac = scaled - floor(scaled);
+    if (!(x >= 0.0) || signbit(x) || scaled >= 1099511627776.0 || fabs(frac - 0.5) < 1e-3)
+    {
+        return (size_t)snprintf(s, FORMAT_CELL_MAX, "%1.4lf", x);
+    }
+
+    r = (uint64_t)(scaled + 0.5);
+    n = format_count(s, (size_t)(r / 10000));
+    r %= 10000;
+    s[n++] = '.';
+    s[n++] = (char)('0' + r / 1000);
+    s[n++] = (char)('0' + r / 100 % 10);
+    s[n++] = (char)('0' + r / 10 % 10);
+    s[n++] = (char)('0' + r % 10);
+
+    return n;
+}
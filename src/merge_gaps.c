@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pbwtutil.h"
+
+/* Matches for the same pair separated by a short gap (typically one
+ * genotype error) are stitched before the length filter sees them. The
+ * sweep is run with a lower seed length so the pieces are reported at
+ * all; each pair's open segment waits in a hash until a later piece
+ * extends it or the sweep ends. The hash is capped: once full, the
+ * half with the oldest ends is emitted as is. */
+
+#define MERGE_CAPACITY (1 << 22)
+
+typedef struct open_seg
+{
+    uint32_t first;
+    uint32_t second;
+    uint32_t begin;
+    uint32_t end;
+} open_seg_t;
+
+KHASH_MAP_INIT_INT64(openseg, open_seg_t)
+
+typedef struct merger
+{
+    int err;
+    double gap;
+    double minlen;
+    match_report_t report;
+    khash_t(openseg) *open;
+} merger_t;
+
+/* Merge state for the current sweep */
+static merger_t merge;
+
+void merge_report(pbwt_t *, const size_t, const size_t, const size_t, const size_t);
+void emit_segment(pbwt_t *, const open_seg_t *);
+int evict_oldest(pbwt_t *);
+int compare_u32(const void *, const void *);
+
+int run_sweep(pbwt_t *b, const cmd_t *c, match_report_t report)
+{
+    int v = 0;
+    khint_t k = 0;
+
+    if (c->merge_gap <= 0.0)
+    {
+        return sweep_matches(b, c, c->minlen, report);
+    }
+
+    merge.err = 0;
+    merge.gap = c->merge_gap;
+    merge.minlen = c->minlen;
+    merge.report = report;
+    merge.open = kh_init(openseg);
+
+    /* Pieces as short as half the final length are candidates */
+    v = sweep_matches(b, c, c->minlen / 2.0, merge_report);
+    if (merge.err < 0)
+    {
+        fputs("pbwtutil [ERROR]: memory allocation failure\n", stderr);
+        v = -1;
+    }
+
+    /* Whatever is still open is complete */
+    for (k = kh_begin(merge.open); v == 0 && k != kh_end(merge.open); ++k)
+    {
+        if (kh_exist(merge.open, k))
+        {
+            emit_segment(b, &kh_value(merge.open, k));
+        }
+    }
+    kh_destroy(openseg, merge.open);
+    merge.open = NULL;
+
+    return v;
+}
+
+void merge_report(pbwt_t *b, const size_t first, const size_t second, const size_t begin, const size_t end)
+{
+    int r = 0;
+    khint_t k = 0;
+    open_seg_t *s = NULL;
+    const uint64_t key = first < second ? (uint64_t)first << 32 | second : (uint64_t)second << 32 | first;
+
+    /* Without room the cap cannot hold; stop and fail the sweep */
+    if (merge.err < 0)
+    {
+        return;
+    }
+    if (kh_size(merge.open) >= MERGE_CAPACITY && evict_oldest(b) < 0)
+    {
+        merge.err = -1;
+        return;
+    }
+
+    k = kh_put(openseg, merge.open, key, &r);
+    if (r < 0)
+    {
+        merge.err = -1;
+        return;
+    }
+    s = &kh_value(merge.open, k);
+
+    /* Extend the open segment across a short gap on the same
+     * chromosome, otherwise close it */
+    if (r == 0)
+    {
+        if (begin > s->end && b->cm[begin] - b->cm[s->end] <= merge.gap &&
+            strcmp(b->chr[begin], b->chr[s->end]) == 0)
+        {
+            s->end = (uint32_t)end;
+            return;
+        }
+        emit_segment(b, s);
+    }
+
+    s->first = (uint32_t)first;
+    s->second = (uint32_t)second;
+    s->begin = (uint32_t)begin;
+    s->end = (uint32_t)end;
+}
+
+void emit_segment(pbwt_t *b, const open_seg_t *s)
+{
+    /* The length filter applies to the stitched segment */
+    if (b->cm[s->end] - b->cm[s->begin] >= merge.minlen)
+    {
+        (*merge.report)(b, s->first, s->second, s->begin, s->end);
+    }
+}
+
+int evict_oldest(pbwt_t *b)
+{
+    size_t n = 0;
+    uint32_t cutoff = 0;
+    uint32_t *ends = NULL;
+    khint_t k = 0;
+
+    ends = (uint32_t *)malloc(kh_size(merge.open) * sizeof(uint32_t));
+    if (ends == NULL)
+    {
+        return -1;
+    }
+    for (k = kh_begin(merge.open); k != kh_end(merge.open); ++k)
+    {
+        if (kh_exist(merge.open, k))
+        {
+            ends[n++] = kh_value(merge.open, k).end;
+        }
+    }
+    qsort(ends, n, sizeof(uint32_t), compare_u32);
+    cutoff = ends[n / 2];
+    free(ends);
+
+    for (k = kh_begin(merge.open); k != kh_end(merge.open); ++k)
+    {
+        if (kh_exist(merge.open, k) && kh_value(merge.open, k).end <= cutoff)
+        {
+            emit_segment(b, &kh_value(merge.open, k));
+            kh_del(openseg, merge.open, k);
+        }
+    }
+
+    return 0;
+}
+
+int compare_u32(const void *a, const void *b)
+{
+    const uint32_t x = *(const uint32_t *)a;
+    const uint32_t y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
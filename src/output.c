@@ -0,0 +1,254 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include "pbwtutil.h"
+
+/* Text output goes either to a plain stream or, for names ending in .gz,
+ * to a BGZF file compressed by htslib's thread pool. BGZF output is
+ * staged in a local buffer so formatting never waits on compression. */
+
+#define OUT_BUFSIZE (1 << 16)
+
+int out_vprintf(out_t *, const char *, va_list);
+int out_flush(out_t *);
+int has_gz_suffix(const char *);
+
+out_t *out_open(const char *path, const int nthreads)
+{
+    out_t *o = NULL;
+
+    o = (out_t *)calloc(1, sizeof(out_t));
+    if (o == NULL)
+    {
+        return NULL;
+    }
+
+    if (path == NULL)
+    {
+        o->fp = stdout;
+        return o;
+    }
+
+    if (has_gz_suffix(path))
+    {
+        o->buf = (char *)malloc(OUT_BUFSIZE);
+        o->bgzf = bgzf_open(path, "w");
+        if (o->buf == NULL || o->bgzf == NULL)
+        {
+            fprintf(stderr, "pbwtutil [ERROR]: cannot open %s for writing\n", path);
+            free(o->buf);
+            free(o);
+            return NULL;
+        }
+        if (nthreads > 1 && bgzf_mt(o->bgzf, nthreads, 256) < 0)
+        {
+            fputs("pbwtutil [WARNING]: cannot start compression threads\n", stderr);
+        }
+    }
+    else
+    {
+        o->fp = fopen(path, "w");
+        if (o->fp == NULL)
+        {
+            fprintf(stderr, "pbwtutil [ERROR]: cannot open %s for writing\n", path);
+            free(o);
+            return NULL;
+        }
+    }
+
+    return o;
+}
+
+out_t *open_output(const cmd_t *c, const char *ext)
+{
+    size_t length = 0;
+    char *outfile = NULL;
+    out_t *o = NULL;
+
+    /* Without an output name everything goes to STDOUT */
+    if (c->outfile == NULL)
+    {
+        return out_open(NULL, c->nthreads);
+    }
+    if (ext == NULL)
+    {
+        return out_open(c->outfile, c->nthreads);
+    }
+
+    /* Insert the extension ahead of any .gz suffix */
+    length = strlen(c->outfile);
+    outfile = (char *)malloc(length + strlen(ext) + 2);
+    if (outfile == NULL)
+    {
+        fputs("pbwtutil [ERROR]: memory allocation failure\n", stderr);
+        return NULL;
+    }
+    if (has_gz_suffix(c->outfile))
+    {
+        sprintf(outfile, "%.*s.%s.gz", (int)(length - 3), c->outfile, ext);
+    }
+    else
+    {
+        sprintf(outfile, "%s.%s", c->outfile, ext);
+    }
+
+    o = out_open(outfile, c->nthreads);
+    free(outfile);
+
+    return o;
+}
+
+int out_printf(out_t *o, const char *fmt, ...)
+{
+    int n = 0;
+    va_list ap;
+
+    va_start(ap, fmt);
+    n = out_vprintf(o, fmt, ap);
+    va_end(ap);
+
+    /* A failed write is kept so out_close can still report it */
+    if (n < 0)
+    {
+        o->err = -1;
+    }
+
+    return n;
+}
+
+int out_vprintf(out_t *o, const char *fmt, va_list ap)
+{
+    int n = 0;
+    va_list aq;
+
+    if (o->bgzf == NULL)
+    {
+        return vfprintf(o->fp, fmt, ap);
+    }
+
+    va_copy(aq, ap);
+    n = vsnprintf(o->buf + o->len, OUT_BUFSIZE - o->len, fmt, aq);
+    va_end(aq);
+    if (n < 0)
+    {
+        return -1;
+    }
+
+    /* Did not fit: flush the staged text and format again */
+    if ((size_t)n >= OUT_BUFSIZE - o->len)
+    {
+        if (out_flush(o) < 0)
+        {
+            return -1;
+        }
+        if (n >= OUT_BUFSIZE)
+        {
+            char *line = (char *)malloc((size_t)n + 1);
+            if (line == NULL)
+            {
+                return -1;
+            }
+            vsnprintf(line, (size_t)n + 1, fmt, ap);
+            n = bgzf_write(o->bgzf, line, (size_t)n) < 0 ? -1 : n;
+            free(line);
+            return n;
+        }
+        n = vsnprintf(o->buf, OUT_BUFSIZE, fmt, ap);
+    }
+    o->len += (size_t)n;
+
+    return n;
+}
+
+int out_write(out_t *o, const void *data, const size_t length)
+{
+    int v = 0;
+
+    if (o->bgzf == NULL)
+    {
+        v = fwrite(data, 1, length, o->fp) == length ? 0 : -1;
+    }
+    else if (o->len + length > OUT_BUFSIZE)
+    {
+        v = out_flush(o);
+        if (v == 0 && length > OUT_BUFSIZE)
+        {
+            v = bgzf_write(o->bgzf, data, length) < 0 ? -1 : 0;
+        }
+        else if (v == 0)
+        {
+            memcpy(o->buf, data, length);
+            o->len = length;
+        }
+    }
+    else
+    {
+        memcpy(o->buf + o->len, data, length);
+        o->len += length;
+    }
+    if (v < 0)
+    {
+        o->err = -1;
+    }
+
+    return v;
+}
+
+int out_close(out_t *o)
+{
+    int v = 0;
+
+    if (o == NULL)
+    {
+        return 0;
+    }
+
+    /* Earlier failed writes count as well as the final flush */
+    if (o->bgzf)
+    {
+        v = out_flush(o);
+        if (bgzf_close(o->bgzf) < 0)
+        {
+            v = -1;
+        }
+        free(o->buf);
+    }
+    else if (o->fp == stdout)
+    {
+        v = fflush(stdout) != 0 || ferror(stdout) ? -1 : 0;
+    }
+    else
+    {
+        v = ferror(o->fp) ? -1 : 0;
+        if (fclose(o->fp) != 0)
+        {
+            v = -1;
+        }
+    }
+    if (o->err < 0)
+    {
+        v = -1;
+    }
+    free(o);
+
+    return v;
+}
+
+int out_flush(out_t *o)
+{
+    if (o->len > 0 && bgzf_write(o->bgzf, o->buf, o->len) < 0)
+    {
+        return -1;
+    }
+    o->len = 0;
+
+    return 0;
+}
+
+int has_gz_suffix(const char *path)
+{
+    size_t length = strlen(path);
+
+    return length > 3 && strcmp(path + length - 3, ".gz") == 0;
+}
@@ -16,20 +16,31 @@ extern int opterr, optopt, optind;
 extern char *optarg;
 
 /* Local function prototypes */
+int parse_boundaries(int, char **, cmd_t *);
 int parse_coancestry(int, char **, cmd_t *);
 int parse_convert(int, char **, cmd_t *);
+int parse_index(int, char **, cmd_t *);
+int parse_index_matches(int, char **, cmd_t *);
+int parse_recompress(int, char **, cmd_t *);
 int parse_match(int, char **, cmd_t *);
+int parse_paint(int, char **, cmd_t *);
 int parse_pileup(int, char **, cmd_t *);
 int parse_summary(int, char **, cmd_t *);
 int parse_view(int, char **, cmd_t *);
 int print_main_usage(const char *);
+int print_boundaries_usage(const char *);
 int print_coancestry_usage(const char *);
 int print_convert_usage(const char *);
+int print_index_usage(const char *);
+int print_index_matches_usage(const char *);
+int print_recompress_usage(const char *);
 int print_match_usage(const char *);
+int print_paint_usage(const char *);
 int print_pileup_usage(const char *);
 int print_summary_usage(const char *);
 int print_view_usage(const char *);
 void print_version(void);
+int parse_minlen_bins(const char *, cmd_t *);
 
 cmd_t *parse_args(int argc, char *argv[])
 {
@@ -54,13 +65,44 @@ cmd_t *parse_args(int argc, char *argv[])
     c->match_all = 0;
     c->nohaps = 0;
     c->minlen = 0.5;
+    c->min_maf = 0.0;
+    c->thin_cm = 0.0;
+    c->sites_file = NULL;
+    c->exclude_sites = NULL;
+    c->samples_file = NULL;
+    c->ref_file = NULL;
     c->only_sites = 0;
     c->print_sites = 0;
     c->count_only = 0;
+    c->out_length = 0;
     c->reg_count = 0;
     c->adjlist = 0;
     c->set_match = 0;
+    c->nthreads = 1;
+    c->pca = 0;
+    c->components = 0;
+    c->top_k = 0;
+    c->per_sample = 0;
+    c->codec = CODEC_LEGACY;
+    c->engine = ENGINE_LIBPBWT;
+    c->comp_min = 0.0;
+    c->merge_gap = 0.0;
+    c->bin_cm = 0.0;
+    c->nbins = 0;
+    c->minlen_bins = NULL;
     c->out_diploid = 0;
+    c->popmap = NULL;
+    c->vcf_file = NULL;
+    c->save_file = NULL;
+    c->outfile = NULL;
+    c->segfile = NULL;
+    c->export_fmt = NULL;
+    c->query = NULL;
+    c->only_segments = 0;
+    c->only_track = 0;
+    c->bedgraph = 0;
+    c->cm_coords = 0;
+    c->trackfile = NULL;
 
     /* Get mode argument */
     if (argv[1])
@@ -78,7 +120,13 @@ cmd_t *parse_args(int argc, char *argv[])
     argv++;
 
     /* Determine run-time mode */
-    if (strcmp(mode, "coancestry") == 0)
+    if (strcmp(mode, "boundaries") == 0)
+    {
+        c->mode = BOUNDARIES;
+        c->mode_func = &pbwt_boundaries;
+        parse_func = &parse_boundaries;
+    }
+    else if (strcmp(mode, "coancestry") == 0)
     {
         c->mode = COANCESTRY;
         c->mode_func = &pbwt_coancestry;
@@ -89,18 +137,42 @@ cmd_t *parse_args(int argc, char *argv[])
         c->mode = CONVERT;
         parse_func = &parse_convert;
     }
+    else if (strcmp(mode, "index") == 0)
+    {
+        c->mode = INDEX;
+        c->mode_func = &pbwt_index;
+        parse_func = &parse_index;
+    }
+    else if (strcmp(mode, "index-matches") == 0)
+    {
+        c->mode = INDEX_MATCHES;
+        c->mode_func = &pbwt_index_matches;
+        parse_func = &parse_index_matches;
+    }
     else if (strcmp(mode, "match") == 0)
     {
         c->mode = MATCH;
         c->mode_func = &pbwt_match;
         parse_func = &parse_match;
     }
+    else if (strcmp(mode, "paint") == 0)
+    {
+        c->mode = PAINT;
+        c->mode_func = &pbwt_paint;
+        parse_func = &parse_paint;
+    }
     else if (strcmp(mode, "pileup") == 0)
     {
         c->mode = PILEUP;
         c->mode_func = &pbwt_pileup;
         parse_func = &parse_pileup;
     }
+    else if (strcmp(mode, "recompress") == 0)
+    {
+        c->mode = RECOMPRESS;
+        c->mode_func = &pbwt_recompress;
+        parse_func = &parse_recompress;
+    }
     else if (strcmp(mode, "summary") == 0)
     {
         c->mode = SUMMARY;
@@ -139,7 +211,11 @@ cmd_t *parse_args(int argc, char *argv[])
 
     if (strcmp(mode, "convert") == 0)
     {
-        if (c->with_vcf == 0)
+        if (c->export_fmt)
+        {
+            c->mode_func = &pbwt_export_vcf;
+        }
+        else if (c->with_vcf == 0)
         {
             c->mode_func = &pbwt_convert_plink;
         }
@@ -155,6 +231,121 @@ cmd_t *parse_args(int argc, char *argv[])
     return c;
 }
 
+int parse_boundaries(int argc, char *argv[], cmd_t *c)
+{
+    int g = 0;
+    char msg[100];
+
+    while (1)
+    {
+        int option_index = 0;
+
+        /* Declare the option table */
+        static struct option long_options[] =
+        {
+            { "minlen",  required_argument, NULL, 'm' },
+            { "set",     no_argument,       NULL, 's' },
+            { "bin-cm",  required_argument, NULL, 'B' },
+            { "out",     required_argument, NULL, 'o' },
+            { "threads", required_argument, NULL, 't' },
+            { "merge-gap-cm",  required_argument, NULL, 'G' },
+            { "min-maf",       required_argument, NULL, 'F' },
+            { "thin-cm",       required_argument, NULL, 'T' },
+            { "sites-file",    required_argument, NULL, 'S' },
+            { "exclude-sites", required_argument, NULL, 'X' },
+            { "engine",  required_argument, NULL, 'E' },
+            { "version", no_argument,       NULL, 'v' },
+            { "help",    no_argument,       NULL, 'h' },
+            {0, 0, 0, 0}
+        };
+
+        /* Parse the option */
+        g = getopt_long(argc, argv, "svhm:B:o:t:G:F:T:S:X:E:", long_options, &option_index);
+
+        /* We are at the end of the options */
+        if (g == -1)
+        {
+            break;
+        }
+
+        /* Assign the option to variables */
+        switch(g)
+        {
+            case 'm':
+                c->minlen = atof(optarg);
+                break;
+            case 's':
+                c->set_match = 1;
+                break;
+            case 'B':
+                c->bin_cm = atof(optarg);
+                break;
+            case 'o':
+                c->outfile = strdup(optarg);
+                break;
+            case 't':
+                c->nthreads = atoi(optarg);
+                break;
+            case 'G':
+                c->merge_gap = atof(optarg);
+                break;
+            case 'F':
+                c->min_maf = atof(optarg);
+                break;
+            case 'T':
+                c->thin_cm = atof(optarg);
+                break;
+            case 'S':
+                c->sites_file = strdup(optarg);
+                break;
+            case 'X':
+                c->exclude_sites = strdup(optarg);
+                break;
+            case 'E':
+                c->engine = engine_id(optarg);
+                if (c->engine < 0)
+                {
+                    print_boundaries_usage("pbwtutil [ERROR]: --engine must be libpbwt, native or check");
+                    return -1;
+                }
+                break;
+            case 'v':
+                print_version();
+                return -1;
+            case 'h':
+                print_boundaries_usage(NULL);
+                return -1;
+            case '?':
+                sprintf(msg, "pbwtutil [ERROR]: unknown option \"-%c\".\n", optopt);
+                print_boundaries_usage(msg);
+                return -1;
+            default:
+                print_boundaries_usage(NULL);
+                return -1;
+        }
+    }
+
+    /* Parse non-optioned arguments */
+    if (optind != argc - 1)
+    {
+        print_boundaries_usage("pbwtutil [ERROR]: need input file name as mandatory argument");
+        return -1;
+    }
+    else
+    {
+        c->instub = strdup(argv[optind]);
+    }
+
+    /* Set-maximal matching is only provided by libpbwt */
+    if (c->set_match && c->engine != ENGINE_LIBPBWT)
+    {
+        print_boundaries_usage("pbwtutil [ERROR]: --set requires --engine libpbwt");
+        return -1;
+    }
+
+    return 0;
+}
+
 int parse_coancestry(int argc, char *argv[], cmd_t *c)
 {
     int g = 0;
@@ -172,14 +363,35 @@ int parse_coancestry(int argc, char *argv[], cmd_t *c)
             { "set",     no_argument,       NULL, 's' },
             { "sites",   no_argument,       NULL, 'p' },
             { "count",   no_argument,       NULL, 'c' },
+            { "length",  no_argument,       NULL, 'l' },
             { "minlen",  required_argument, NULL, 'm' },
+            { "minlen-bins",   required_argument, NULL, 'L' },
+            { "out",     required_argument, NULL, 'o' },
+            { "segfile", required_argument, NULL, 'b' },
+            { "threads", required_argument, NULL, 't' },
+            { "samples", required_argument, NULL, 'I' },
+            { "ref",     required_argument, NULL, 'R' },
+            { "pca",     required_argument, NULL, 'K' },
+            { "components",    no_argument,       NULL, 'C' },
+            { "component-min", required_argument, NULL, 'M' },
+            { "merge-gap-cm",  required_argument, NULL, 'G' },
+            { "min-maf",       required_argument, NULL, 'F' },
+            { "thin-cm",       required_argument, NULL, 'T' },
+            { "sites-file",    required_argument, NULL, 'S' },
+            { "exclude-sites", required_argument, NULL, 'X' },
+            { "top-k",   required_argument, NULL, 'k' },
+            { "per-sample",    no_argument,       NULL, 'u' },
+            { "vcf",     required_argument, NULL, 'V' },
+            { "map",     required_argument, NULL, 'P' },
+            { "save",    required_argument, NULL, 'W' },
+            { "engine",  required_argument, NULL, 'E' },
             { "version", no_argument,       NULL, 'v' },
             { "help",    no_argument,       NULL, 'h' },
             {0, 0, 0, 0}
         };
 
         /* Parse the option */
-        g = getopt_long(argc, argv, "daspcvhm:", long_options, &option_index);
+        g = getopt_long(argc, argv, "daspclCuvhm:o:b:t:F:T:S:X:I:R:K:M:G:V:P:W:k:L:E:", long_options, &option_index);
 
         /* We are at the end of the options */
         if (g == -1)
@@ -199,35 +411,584 @@ int parse_coancestry(int argc, char *argv[], cmd_t *c)
             case 'm':
                 c->minlen = atof(optarg);
                 break;
+            case 'L':
+                if (parse_minlen_bins(optarg, c) < 0)
+                {
+                    print_coancestry_usage("pbwtutil [ERROR]: --minlen-bins needs increasing positive cM values");
+                    return -1;
+                }
+                break;
+            case 's':
+                c->set_match = 1;
+                break;
+            case 'c':
+                c->count_only = 1;
+                break;
+            case 'l':
+                c->out_length = 1;
+                break;
+            case 'o':
+                c->outfile = strdup(optarg);
+                break;
+            case 'b':
+                c->segfile = strdup(optarg);
+                break;
+            case 't':
+                c->nthreads = atoi(optarg);
+                break;
+            case 'p':
+                c->print_sites = 1;
+                break;
+            case 'I':
+                c->samples_file = strdup(optarg);
+                break;
+            case 'R':
+                c->ref_file = strdup(optarg);
+                break;
+            case 'K':
+                c->pca = atoi(optarg);
+                break;
+            case 'C':
+                c->components = 1;
+                break;
+            case 'M':
+                c->comp_min = atof(optarg);
+                break;
+            case 'G':
+                c->merge_gap = atof(optarg);
+                break;
+            case 'F':
+                c->min_maf = atof(optarg);
+                break;
+            case 'T':
+                c->thin_cm = atof(optarg);
+                break;
+            case 'S':
+                c->sites_file = strdup(optarg);
+                break;
+            case 'X':
+                c->exclude_sites = strdup(optarg);
+                break;
+            case 'k':
+                c->top_k = atoi(optarg);
+                break;
+            case 'u':
+                c->per_sample = 1;
+                break;
+            case 'V':
+                c->vcf_file = strdup(optarg);
+                break;
+            case 'P':
+                c->popmap = strdup(optarg);
+                break;
+            case 'W':
+                c->save_file = strdup(optarg);
+                break;
+            case 'E':
+                c->engine = engine_id(optarg);
+                if (c->engine < 0)
+                {
+                    print_coancestry_usage("pbwtutil [ERROR]: --engine must be libpbwt, native or check");
+                    return -1;
+                }
+                break;
+            case 'v':
+                print_version();
+                return -1;
+            case 'h':
+                print_coancestry_usage(NULL);
+                return -1;
+            case '?':
+                sprintf(msg, "pbwtutil [ERROR]: unknown option \"-%c\".\n", optopt);
+                print_coancestry_usage(msg);
+                return -1;
+            default:
+                print_coancestry_usage(NULL);
+                return -1;
+        }
+    }
+
+    /* Parse non-optioned arguments; --vcf takes the place of the PBWT file */
+    if (c->vcf_file)
+    {
+        if (optind != argc)
+        {
+            print_coancestry_usage("pbwtutil [ERROR]: --vcf replaces the PBWT file argument");
+            return -1;
+        }
+        c->instub = strdup(c->vcf_file);
+    }
+    else if (optind != argc - 1)
+    {
+        print_coancestry_usage("pbwtutil [ERROR]: need input file name as mandatory argument");
+        return -1;
+    }
+    else
+    {
+        c->instub = strdup(argv[optind]);
+    }
+
+    /* Population map and saved copy only apply to VCF input */
+    if ((c->popmap || c->save_file) && c->vcf_file == NULL)
+    {
+        print_coancestry_usage("pbwtutil [ERROR]: --map and --save require --vcf");
+        return -1;
+    }
+
+    /* Several outputs from one sweep need separate files */
+    if (c->adjlist + c->count_only + c->out_length + (c->pca > 0) + c->components + (c->top_k > 0) +
+        c->per_sample > 1 && c->outfile == NULL)
+    {
+        print_coancestry_usage("pbwtutil [ERROR]: --out <STR> is mandatory when combining outputs");
+        return -1;
+    }
+
+    /* One sweep at the lowest bound feeds every bin */
+    if (c->nbins > 0)
+    {
+        c->minlen = c->minlen_bins[0];
+    }
+
+    /* One matrix per bin, each in its own file */
+    if (c->nbins > 0 && c->outfile == NULL)
+    {
+        print_coancestry_usage("pbwtutil [ERROR]: --out <STR> is mandatory with --minlen-bins");
+        return -1;
+    }
+    if (c->nbins > 0 && c->pca > 0)
+    {
+        print_coancestry_usage("pbwtutil [ERROR]: --pca cannot be combined with --minlen-bins");
+        return -1;
+    }
+
+    /* Eigenvalues and loadings are two files */
+    if (c->pca > 0 && c->outfile == NULL)
+    {
+        print_coancestry_usage("pbwtutil [ERROR]: --out <STR> is mandatory with --pca");
+        return -1;
+    }
+
+    /* PCA needs the square matrix */
+    if (c->pca > 0 && (c->ref_file || c->samples_file))
+    {
+        print_coancestry_usage("pbwtutil [ERROR]: --pca cannot be combined with --ref or --samples");
+        return -1;
+    }
+
+    /* Both options pick the matrix rows */
+    if (c->ref_file && c->samples_file)
+    {
+        print_coancestry_usage("pbwtutil [ERROR]: --ref and --samples cannot be combined");
+        return -1;
+    }
+
+    /* Standard input can only be read once */
+    if (c->ref_file && is_stdin(c->ref_file) && is_stdin(c->instub))
+    {
+        print_coancestry_usage("pbwtutil [ERROR]: PBWT file and --ref cannot both be standard input");
+        return -1;
+    }
+
+    /* Set-maximal matching is only provided by libpbwt */
+    if (c->set_match && c->engine != ENGINE_LIBPBWT)
+    {
+        print_coancestry_usage("pbwtutil [ERROR]: --set requires --engine libpbwt");
+        return -1;
+    }
+
+    return 0;
+}
+
+int parse_convert(int argc, char *argv[], cmd_t *c)
+{
+    int g = 0;
+    char msg[100];
+
+    while (1)
+    {
+        int option_index = 0;
+
+        /* Declare the option table */
+        static struct option long_options[] =
+        {
+            { "vcf",     no_argument,       NULL, 'c' },
+            { "map",     required_argument, NULL, 'm' },
+            { "reg",     no_argument,       NULL, 'r' },
+            { "out",     required_argument, NULL, 'o' },
+            { "phased",  no_argument,       NULL, 'p' },
+            { "threads", required_argument, NULL, 't' },
+            { "to",      required_argument, NULL, 'x' },
+            { "codec",   required_argument, NULL, 'z' },
+            { "version", no_argument,       NULL, 'v' },
+            { "help",    no_argument,       NULL, 'h' },
+            {0, 0, 0, 0}
+        };
+
+        /* Parse the option */
+        g = getopt_long(argc, argv, "vhcrpm:o:t:x:z:", long_options, &option_index);
+
+        /* We are at the end of the options */
+        if (g == -1)
+        {
+            break;
+        }
+
+        /* Assign the option to variables */
+        switch(g)
+        {
+            case 'c':
+                c->with_vcf = 1;
+                break;
+            case 'r':
+                c->has_reg = 1;
+                break;
+            case 'o':
+                c->outfile = strdup(optarg);
+                break;
+            case 'm':
+                c->popmap = strdup(optarg);
+                break;
+            case 'p':
+                c->is_phased = 1;
+                break;
+            case 't':
+                c->nthreads = atoi(optarg);
+                break;
+            case 'x':
+                c->export_fmt = strdup(optarg);
+                break;
+            case 'z':
+                c->codec = codec_id(optarg);
+                if (c->codec < 0)
+                {
+                    print_convert_usage("pbwtutil [ERROR]: --codec must be zlib or zstd (when built with zstd)");
+                    return -1;
+                }
+                break;
+            case 'v':
+                print_version();
+                return -1;
+            case 'h':
+                print_convert_usage(NULL);
+                return -1;
+            case '?':
+                sprintf(msg, "pbwtutil [ERROR]: unknown option \"-%c\".\n", optopt);
+                print_convert_usage(msg);
+                return -1;
+            default:
+                print_convert_usage(NULL);
+                return -1;
+        }
+    }
+
+    /* Parse non-optioned arguments */
+    if (optind != argc - 1)
+    {
+        print_convert_usage("pbwtutil [ERROR]: need input stub as mandatory argument");
+        return -1;
+    }
+    else
+    {
+        c->instub = strdup(argv[optind]);
+    }
+
+    /* --out switch is actually mandatory */
+    if (!c->outfile)
+    {
+        print_convert_usage("pbwtutil [ERROR]: --out <STR> is a mandatory argument for convert");
+        return -1;
+    }
+
+    /* Only VCF and BCF can be exported */
+    if (c->export_fmt && strcmp(c->export_fmt, "vcf") != 0 && strcmp(c->export_fmt, "bcf") != 0)
+    {
+        print_convert_usage("pbwtutil [ERROR]: --to must be either vcf or bcf");
+        return -1;
+    }
+
+    return 0;
+}
+
+int parse_index(int argc, char *argv[], cmd_t *c)
+{
+    int g = 0;
+    char msg[100];
+
+    while (1)
+    {
+        int option_index = 0;
+
+        /* Declare the option table */
+        static struct option long_options[] =
+        {
+            { "version", no_argument,       NULL, 'v' },
+            { "help",    no_argument,       NULL, 'h' },
+            {0, 0, 0, 0}
+        };
+
+        /* Parse the option */
+        g = getopt_long(argc, argv, "vh", long_options, &option_index);
+
+        /* We are at the end of the options */
+        if (g == -1)
+        {
+            break;
+        }
+
+        /* Assign the option to variables */
+        switch(g)
+        {
+            case 'v':
+                print_version();
+                return -1;
+            case 'h':
+                print_index_usage(NULL);
+                return -1;
+            case '?':
+                sprintf(msg, "pbwtutil [ERROR]: unknown option \"-%c\".\n", optopt);
+                print_index_usage(msg);
+                return -1;
+            default:
+                print_index_usage(NULL);
+                return -1;
+        }
+    }
+
+    /* Parse non-optioned arguments */
+    if (optind != argc - 1)
+    {
+        print_index_usage("pbwtutil [ERROR]: need PBWT file as mandatory argument");
+        return -1;
+    }
+    else
+    {
+        c->instub = strdup(argv[optind]);
+    }
+
+    /* Indexes are written next to the file they describe */
+    if (is_stdin(c->instub))
+    {
+        print_index_usage("pbwtutil [ERROR]: cannot index standard input");
+        return -1;
+    }
+
+    return 0;
+}
+
+int parse_index_matches(int argc, char *argv[], cmd_t *c)
+{
+    int g = 0;
+    char msg[100];
+
+    while (1)
+    {
+        int option_index = 0;
+
+        /* Declare the option table */
+        static struct option long_options[] =
+        {
+            { "minlen",  required_argument, NULL, 'm' },
+            { "engine",  required_argument, NULL, 'E' },
+            { "version", no_argument,       NULL, 'v' },
+            { "help",    no_argument,       NULL, 'h' },
+            {0, 0, 0, 0}
+        };
+
+        /* Parse the option */
+        g = getopt_long(argc, argv, "vhm:E:", long_options, &option_index);
+
+        /* We are at the end of the options */
+        if (g == -1)
+        {
+            break;
+        }
+
+        /* Assign the option to variables */
+        switch(g)
+        {
+            case 'm':
+                c->minlen = atof(optarg);
+                break;
+            case 'E':
+                c->engine = engine_id(optarg);
+                if (c->engine < 0)
+                {
+                    print_index_matches_usage("pbwtutil [ERROR]: --engine must be libpbwt, native or check");
+                    return -1;
+                }
+                break;
+            case 'v':
+                print_version();
+                return -1;
+            case 'h':
+                print_index_matches_usage(NULL);
+                return -1;
+            case '?':
+                sprintf(msg, "pbwtutil [ERROR]: unknown option \"-%c\".\n", optopt);
+                print_index_matches_usage(msg);
+                return -1;
+            default:
+                print_index_matches_usage(NULL);
+                return -1;
+        }
+    }
+
+    /* Parse non-optioned arguments */
+    if (optind != argc - 1)
+    {
+        print_index_matches_usage("pbwtutil [ERROR]: need PBWT file as mandatory argument");
+        return -1;
+    }
+    else
+    {
+        c->instub = strdup(argv[optind]);
+    }
+
+    /* Indexes are written next to the file they describe */
+    if (is_stdin(c->instub))
+    {
+        print_index_matches_usage("pbwtutil [ERROR]: cannot index standard input");
+        return -1;
+    }
+
+    return 0;
+}
+
+int parse_match(int argc, char *argv[], cmd_t *c)
+{
+    int g = 0;
+    char msg[100];
+
+    while (1)
+    {
+        int option_index = 0;
+
+        /* Declare the option table */
+        static struct option long_options[] =
+        {
+            { "query",   required_argument, NULL, 'q' },
+            { "minlen",  required_argument, NULL, 'm' },
+            { "set",     no_argument,       NULL, 's' },
+            { "sites",   no_argument,       NULL, 'p' },
+            { "all",     no_argument,       NULL, 'a' },
+            { "segfile", required_argument, NULL, 'b' },
+            { "out",     required_argument, NULL, 'o' },
+            { "threads", required_argument, NULL, 't' },
+            { "merge-gap-cm",  required_argument, NULL, 'G' },
+            { "min-maf",       required_argument, NULL, 'F' },
+            { "thin-cm",       required_argument, NULL, 'T' },
+            { "sites-file",    required_argument, NULL, 'S' },
+            { "exclude-sites", required_argument, NULL, 'X' },
+            { "top-k",   required_argument, NULL, 'k' },
+            { "vcf",     required_argument, NULL, 'V' },
+            { "map",     required_argument, NULL, 'P' },
+            { "save",    required_argument, NULL, 'W' },
+            { "engine",  required_argument, NULL, 'E' },
+            { "version", no_argument,       NULL, 'v' },
+            { "help",    no_argument,       NULL, 'h' },
+            {0, 0, 0, 0}
+        };
+
+        /* Parse the option */
+        g = getopt_long(argc, argv, "vhapsq:m:b:o:t:F:T:S:X:G:V:P:W:k:E:", long_options, &option_index);
+
+        /* We are at the end of the options */
+        if (g == -1)
+        {
+            break;
+        }
+
+        /* Assign the option to variables */
+        switch(g)
+        {
+            case 'q':
+                c->query = strdup(optarg);
+                break;
+            case 'p':
+                c->print_sites = 1;
+                break;
+            case 'm':
+                c->minlen = atof(optarg);
+                break;
+            case 'a':
+                c->match_all = 1;
+                break;
+            case 'b':
+                c->segfile = strdup(optarg);
+                break;
+            case 'o':
+                c->outfile = strdup(optarg);
+                break;
+            case 't':
+                c->nthreads = atoi(optarg);
+                break;
             case 's':
                 c->set_match = 1;
                 break;
-            case 'c':
-                c->count_only = 1;
+            case 'G':
+                c->merge_gap = atof(optarg);
+                break;
+            case 'F':
+                c->min_maf = atof(optarg);
+                break;
+            case 'T':
+                c->thin_cm = atof(optarg);
+                break;
+            case 'S':
+                c->sites_file = strdup(optarg);
+                break;
+            case 'X':
+                c->exclude_sites = strdup(optarg);
+                break;
+            case 'k':
+                c->top_k = atoi(optarg);
+                break;
+            case 'V':
+                c->vcf_file = strdup(optarg);
+                break;
+            case 'P':
+                c->popmap = strdup(optarg);
+                break;
+            case 'W':
+                c->save_file = strdup(optarg);
                 break;
-            case 'p':
-                c->print_sites = 1;
+            case 'E':
+                c->engine = engine_id(optarg);
+                if (c->engine < 0)
+                {
+                    print_match_usage("pbwtutil [ERROR]: --engine must be libpbwt, native or check");
+                    return -1;
+                }
                 break;
             case 'v':
                 print_version();
                 return -1;
             case 'h':
-                print_coancestry_usage(NULL);
+                print_match_usage(NULL);
                 return -1;
             case '?':
                 sprintf(msg, "pbwtutil [ERROR]: unknown option \"-%c\".\n", optopt);
-                print_coancestry_usage(msg);
+                print_match_usage(msg);
                 return -1;
             default:
-                print_coancestry_usage(NULL);
+                print_match_usage(NULL);
                 return -1;
         }
     }
 
-    /* Parse non-optioned arguments */
-    if (optind != argc - 1)
+    /* Parse non-optioned arguments; --vcf takes the place of the PBWT file */
+    if (c->vcf_file)
     {
-        print_coancestry_usage("pbwtutil [ERROR]: need input file name as mandatory argument");
+        if (optind != argc)
+        {
+            print_match_usage("pbwtutil [ERROR]: --vcf replaces the PBWT file argument");
+            return -1;
+        }
+        c->instub = strdup(c->vcf_file);
+    }
+    else if (optind != argc - 1)
+    {
+        print_match_usage("pbwtutil [ERROR]: need input file name as mandatory argument");
         return -1;
     }
     else
@@ -235,10 +996,38 @@ int parse_coancestry(int argc, char *argv[], cmd_t *c)
         c->instub = strdup(argv[optind]);
     }
 
+    /* Population map and saved copy only apply to VCF input */
+    if ((c->popmap || c->save_file) && c->vcf_file == NULL)
+    {
+        print_match_usage("pbwtutil [ERROR]: --map and --save require --vcf");
+        return -1;
+    }
+
+    /* Top-K replaces both the region summary and the full list */
+    if (c->top_k > 0 && c->match_all)
+    {
+        print_match_usage("pbwtutil [ERROR]: --top-k and --all cannot be combined");
+        return -1;
+    }
+
+    /* Check that a query sequence has been specified */
+    if (c->query == NULL)
+    {
+        print_match_usage("pbwtutil [ERROR]: --query option is mandatory");
+        return -1;
+    }
+
+    /* Set-maximal matching is only provided by libpbwt */
+    if (c->set_match && c->engine != ENGINE_LIBPBWT)
+    {
+        print_match_usage("pbwtutil [ERROR]: --set requires --engine libpbwt");
+        return -1;
+    }
+
     return 0;
 }
 
-int parse_convert(int argc, char *argv[], cmd_t *c)
+int parse_paint(int argc, char *argv[], cmd_t *c)
 {
     int g = 0;
     char msg[100];
@@ -250,18 +1039,24 @@ int parse_convert(int argc, char *argv[], cmd_t *c)
         /* Declare the option table */
         static struct option long_options[] =
         {
-            { "vcf",     no_argument,       NULL, 'c' },
-            { "map",     required_argument, NULL, 'm' },
-            { "reg",     no_argument,       NULL, 'r' },
-            { "out",     required_argument, NULL, 'o' },
-            { "phased",  no_argument,       NULL, 'p' },
-            { "version", no_argument,       NULL, 'v' },
-            { "help",    no_argument,       NULL, 'h' },
+            { "minlen",    required_argument, NULL, 'm' },
+            { "set",       no_argument,       NULL, 's' },
+            { "window-cm", required_argument, NULL, 'B' },
+            { "out",       required_argument, NULL, 'o' },
+            { "threads",   required_argument, NULL, 't' },
+            { "merge-gap-cm",  required_argument, NULL, 'G' },
+            { "min-maf",       required_argument, NULL, 'F' },
+            { "thin-cm",       required_argument, NULL, 'T' },
+            { "sites-file",    required_argument, NULL, 'S' },
+            { "exclude-sites", required_argument, NULL, 'X' },
+            { "engine",  required_argument, NULL, 'E' },
+            { "version",   no_argument,       NULL, 'v' },
+            { "help",      no_argument,       NULL, 'h' },
             {0, 0, 0, 0}
         };
 
         /* Parse the option */
-        g = getopt_long(argc, argv, "vhcrpm:o:", long_options, &option_index);
+        g = getopt_long(argc, argv, "svhm:B:o:t:G:F:T:S:X:E:", long_options, &option_index);
 
         /* We are at the end of the options */
         if (g == -1)
@@ -272,33 +1067,56 @@ int parse_convert(int argc, char *argv[], cmd_t *c)
         /* Assign the option to variables */
         switch(g)
         {
-            case 'c':
-                c->with_vcf = 1;
+            case 'm':
+                c->minlen = atof(optarg);
                 break;
-            case 'r':
-                c->has_reg = 1;
+            case 's':
+                c->set_match = 1;
+                break;
+            case 'B':
+                c->bin_cm = atof(optarg);
                 break;
             case 'o':
                 c->outfile = strdup(optarg);
                 break;
-            case 'm':
-                c->popmap = strdup(optarg);
+            case 't':
+                c->nthreads = atoi(optarg);
                 break;
-            case 'p':
-                c->is_phased = 1;
+            case 'G':
+                c->merge_gap = atof(optarg);
+                break;
+            case 'F':
+                c->min_maf = atof(optarg);
+                break;
+            case 'T':
+                c->thin_cm = atof(optarg);
+                break;
+            case 'S':
+                c->sites_file = strdup(optarg);
+                break;
+            case 'X':
+                c->exclude_sites = strdup(optarg);
+                break;
+            case 'E':
+                c->engine = engine_id(optarg);
+                if (c->engine < 0)
+                {
+                    print_paint_usage("pbwtutil [ERROR]: --engine must be libpbwt, native or check");
+                    return -1;
+                }
                 break;
             case 'v':
                 print_version();
                 return -1;
             case 'h':
-                print_convert_usage(NULL);
+                print_paint_usage(NULL);
                 return -1;
             case '?':
                 sprintf(msg, "pbwtutil [ERROR]: unknown option \"-%c\".\n", optopt);
-                print_convert_usage(msg);
+                print_paint_usage(msg);
                 return -1;
             default:
-                print_convert_usage(NULL);
+                print_paint_usage(NULL);
                 return -1;
         }
     }
@@ -306,7 +1124,7 @@ int parse_convert(int argc, char *argv[], cmd_t *c)
     /* Parse non-optioned arguments */
     if (optind != argc - 1)
     {
-        print_convert_usage("pbwtutil [ERROR]: need input stub as mandatory argument");
+        print_paint_usage("pbwtutil [ERROR]: need input file name as mandatory argument");
         return -1;
     }
     else
@@ -314,17 +1132,24 @@ int parse_convert(int argc, char *argv[], cmd_t *c)
         c->instub = strdup(argv[optind]);
     }
 
-    /* --out switch is actually mandatory */
-    if (!c->outfile)
+    /* The paint array is binary and goes to a file */
+    if (c->outfile == NULL)
     {
-        print_convert_usage("pbwtutil [ERROR]: --out <STR> is a mandatory argument for convert");
+        print_paint_usage("pbwtutil [ERROR]: --out FILE is required");
+        return -1;
+    }
+
+    /* Set-maximal matching is only provided by libpbwt */
+    if (c->set_match && c->engine != ENGINE_LIBPBWT)
+    {
+        print_paint_usage("pbwtutil [ERROR]: --set requires --engine libpbwt");
         return -1;
     }
 
     return 0;
 }
 
-int parse_match(int argc, char *argv[], cmd_t *c)
+int parse_pileup(int argc, char *argv[], cmd_t *c)
 {
     int g = 0;
     char msg[100];
@@ -339,21 +1164,30 @@ int parse_match(int argc, char *argv[], cmd_t *c)
             { "query",   required_argument, NULL, 'q' },
             { "minlen",  required_argument, NULL, 'm' },
             { "set",     no_argument,       NULL, 's' },
-            { "sites",   no_argument,       NULL, 'p' },
-            { "all",     no_argument,       NULL, 'a' },
+            { "out",     required_argument, NULL, 'o' },
+            { "threads", required_argument, NULL, 't' },
+            { "bedgraph", no_argument,      NULL, 'B' },
+            { "cm",      no_argument,       NULL, 'c' },
+            { "track",   required_argument, NULL, 'k' },
+            { "min-maf",       required_argument, NULL, 'F' },
+            { "thin-cm",       required_argument, NULL, 'T' },
+            { "sites-file",    required_argument, NULL, 'S' },
+            { "exclude-sites", required_argument, NULL, 'X' },
+            { "vcf",     required_argument, NULL, 'V' },
+            { "map",     required_argument, NULL, 'P' },
+            { "save",    required_argument, NULL, 'W' },
+            { "engine",  required_argument, NULL, 'E' },
             { "version", no_argument,       NULL, 'v' },
             { "help",    no_argument,       NULL, 'h' },
             {0, 0, 0, 0}
         };
 
         /* Parse the option */
-        g = getopt_long(argc, argv, "vhapq:m:", long_options, &option_index);
+        g = getopt_long(argc, argv, "q:m:o:t:svhF:T:S:X:Bck:V:P:W:E:", long_options, &option_index);
 
         /* We are at the end of the options */
         if (g == -1)
-        {
             break;
-        }
 
         /* Assign the option to variables */
         switch(g)
@@ -361,38 +1195,85 @@ int parse_match(int argc, char *argv[], cmd_t *c)
             case 'q':
                 c->query = strdup(optarg);
                 break;
-            case 'p':
-                c->print_sites = 1;
-                break;
             case 'm':
                 c->minlen = atof(optarg);
                 break;
-            case 'a':
-                c->match_all = 1;
-                break;
             case 's':
                 c->set_match = 1;
                 break;
+            case 'o':
+                c->outfile = strdup(optarg);
+                break;
+            case 't':
+                c->nthreads = atoi(optarg);
+                break;
+            case 'B':
+                c->bedgraph = 1;
+                break;
+            case 'c':
+                c->cm_coords = 1;
+                break;
+            case 'k':
+                c->trackfile = strdup(optarg);
+                break;
+            case 'F':
+                c->min_maf = atof(optarg);
+                break;
+            case 'T':
+                c->thin_cm = atof(optarg);
+                break;
+            case 'S':
+                c->sites_file = strdup(optarg);
+                break;
+            case 'X':
+                c->exclude_sites = strdup(optarg);
+                break;
+            case 'V':
+                c->vcf_file = strdup(optarg);
+                break;
+            case 'P':
+                c->popmap = strdup(optarg);
+                break;
+            case 'W':
+                c->save_file = strdup(optarg);
+                break;
+            case 'E':
+                c->engine = engine_id(optarg);
+                if (c->engine < 0)
+                {
+                    print_pileup_usage("pbwtutil [ERROR]: --engine must be libpbwt, native or check");
+                    return -1;
+                }
+                break;
             case 'v':
                 print_version();
                 return -1;
             case 'h':
-                print_match_usage(NULL);
+                print_pileup_usage(NULL);
                 return -1;
             case '?':
                 sprintf(msg, "pbwtutil [ERROR]: unknown option \"-%c\".\n", optopt);
-                print_match_usage(msg);
+                print_pileup_usage(msg);
                 return -1;
             default:
-                print_match_usage(NULL);
+                print_pileup_usage(NULL);
                 return -1;
         }
     }
 
-    /* Parse non-optioned arguments */
-    if (optind != argc - 1)
+    /* Parse non-optioned arguments; --vcf takes the place of the PBWT file */
+    if (c->vcf_file)
     {
-        print_match_usage("pbwtutil [ERROR]: need input file name as mandatory argument");
+        if (optind != argc)
+        {
+            print_pileup_usage("pbwtutil [ERROR]: --vcf replaces the PBWT file argument");
+            return -1;
+        }
+        c->instub = strdup(c->vcf_file);
+    }
+    else if (optind != argc - 1)
+    {
+        print_pileup_usage("pbwtutil [ERROR]: need input file name as mandatory argument");
         return -1;
     }
     else
@@ -400,17 +1281,31 @@ int parse_match(int argc, char *argv[], cmd_t *c)
         c->instub = strdup(argv[optind]);
     }
 
+    /* Population map and saved copy only apply to VCF input */
+    if ((c->popmap || c->save_file) && c->vcf_file == NULL)
+    {
+        print_pileup_usage("pbwtutil [ERROR]: --map and --save require --vcf");
+        return -1;
+    }
+
     /* Check that a query sequence has been specified */
     if (c->query == NULL)
     {
-        print_match_usage("pbwtutil [ERROR]: --query option is mandatory");
+        print_pileup_usage("pbwtutil [ERROR]: --query option is mandatory");
+        return -1;
+    }
+
+    /* Set-maximal matching is only provided by libpbwt */
+    if (c->set_match && c->engine != ENGINE_LIBPBWT)
+    {
+        print_pileup_usage("pbwtutil [ERROR]: --set requires --engine libpbwt");
         return -1;
     }
 
     return 0;
 }
 
-int parse_pileup(int argc, char *argv[], cmd_t *c)
+int parse_recompress(int argc, char *argv[], cmd_t *c)
 {
     int g = 0;
     char msg[100];
@@ -422,45 +1317,52 @@ int parse_pileup(int argc, char *argv[], cmd_t *c)
         /* Declare the option table */
         static struct option long_options[] =
         {
-            { "query",   required_argument, NULL, 'q' },
-            { "minlen",  required_argument, NULL, 'm' },
-            { "set",     no_argument,       NULL, 's' },
+            { "codec",   required_argument, NULL, 'z' },
+            { "out",     required_argument, NULL, 'o' },
+            { "threads", required_argument, NULL, 't' },
             { "version", no_argument,       NULL, 'v' },
             { "help",    no_argument,       NULL, 'h' },
             {0, 0, 0, 0}
         };
 
         /* Parse the option */
-        g = getopt_long(argc, argv, "q:m:svh", long_options, &option_index);
+        g = getopt_long(argc, argv, "vhz:o:t:", long_options, &option_index);
 
         /* We are at the end of the options */
         if (g == -1)
+        {
             break;
+        }
 
         /* Assign the option to variables */
         switch(g)
         {
-            case 'q':
-                c->query = strdup(optarg);
+            case 'z':
+                c->codec = codec_id(optarg);
+                if (c->codec < 0)
+                {
+                    print_recompress_usage("pbwtutil [ERROR]: --codec must be zlib or zstd (when built with zstd)");
+                    return -1;
+                }
                 break;
-            case 'm':
-                c->minlen = atof(optarg);
+            case 'o':
+                c->outfile = strdup(optarg);
                 break;
-            case 's':
-                c->set_match = 1;
+            case 't':
+                c->nthreads = atoi(optarg);
                 break;
             case 'v':
                 print_version();
                 return -1;
             case 'h':
-                print_pileup_usage(NULL);
+                print_recompress_usage(NULL);
                 return -1;
             case '?':
                 sprintf(msg, "pbwtutil [ERROR]: unknown option \"-%c\".\n", optopt);
-                print_pileup_usage(msg);
+                print_recompress_usage(msg);
                 return -1;
             default:
-                print_pileup_usage(NULL);
+                print_recompress_usage(NULL);
                 return -1;
         }
     }
@@ -468,7 +1370,7 @@ int parse_pileup(int argc, char *argv[], cmd_t *c)
     /* Parse non-optioned arguments */
     if (optind != argc - 1)
     {
-        print_pileup_usage("pbwtutil [ERROR]: need input file name as mandatory argument");
+        print_recompress_usage("pbwtutil [ERROR]: need PBWT file as mandatory argument");
         return -1;
     }
     else
@@ -476,13 +1378,19 @@ int parse_pileup(int argc, char *argv[], cmd_t *c)
         c->instub = strdup(argv[optind]);
     }
 
-    /* Check that a query sequence has been specified */
-    if (c->query == NULL)
+    /* --out switch is mandatory */
+    if (!c->outfile)
     {
-        print_pileup_usage("pbwtutil [ERROR]: --query option is mandatory");
+        print_recompress_usage("pbwtutil [ERROR]: --out <FILE> is a mandatory argument for recompress");
         return -1;
     }
 
+    /* Fastest codec available unless one is named */
+    if (c->codec == CODEC_LEGACY)
+    {
+        c->codec = codec_id("zstd") > 0 ? CODEC_ZSTD : CODEC_ZLIB;
+    }
+
     return 0;
 }
 
@@ -559,15 +1467,20 @@ int parse_view(int argc, char *argv[], cmd_t *c)
         /* Declare option table */
         static struct option long_options[] =
         {
-            { "sites",   no_argument,       NULL, 's' },
-            { "nohaps",  no_argument,       NULL, 'n' },
-            { "version", no_argument,       NULL, 'v' },
-            { "help",    no_argument,       NULL, 'h' },
+            { "sites",    no_argument,       NULL, 's' },
+            { "nohaps",   no_argument,       NULL, 'n' },
+            { "segments", no_argument,       NULL, 'g' },
+            { "track",    no_argument,       NULL, 'k' },
+            { "query",    required_argument, NULL, 'q' },
+            { "out",      required_argument, NULL, 'o' },
+            { "threads",  required_argument, NULL, 't' },
+            { "version",  no_argument,       NULL, 'v' },
+            { "help",     no_argument,       NULL, 'h' },
             {0, 0, 0, 0}
         };
 
         /* Parse options */
-        g = getopt_long(argc, argv, "snhv", long_options, &option_index);
+        g = getopt_long(argc, argv, "sngkhvq:o:t:", long_options, &option_index);
 
         /* We are at the end of the options */
         if (g == -1)
@@ -584,6 +1497,21 @@ int parse_view(int argc, char *argv[], cmd_t *c)
             case 's':
                 c->only_sites = 1;
                 break;
+            case 'g':
+                c->only_segments = 1;
+                break;
+            case 'k':
+                c->only_track = 1;
+                break;
+            case 'q':
+                c->query = strdup(optarg);
+                break;
+            case 'o':
+                c->outfile = strdup(optarg);
+                break;
+            case 't':
+                c->nthreads = atoi(optarg);
+                break;
             case 'v':
                 print_version();
                 return -1;
@@ -611,6 +1539,18 @@ int parse_view(int argc, char *argv[], cmd_t *c)
         c->instub = strdup(argv[optind]);
     }
 
+    /* Segment lookups are keyed by sample identifier */
+    if (c->only_segments && c->query == NULL)
+    {
+        print_view_usage("pbwtutil [ERROR]: --segments requires --query");
+        return -1;
+    }
+    if (c->only_track && c->query == NULL)
+    {
+        print_view_usage("pbwtutil [ERROR]: --track requires --query CHR[:FROM-TO]");
+        return -1;
+    }
+
     return 0;
 }
 
@@ -624,16 +1564,48 @@ int print_main_usage(const char *msg)
         printf ("%s\n\n", msg);
     }
     puts("Commands:");
+    puts("  boundaries          Count match start and end events per site");
     puts("  coancesty           Construct coancestry matrix between individuals");
     puts("  convert             Convert PLINK or VCF to PBWT or vice versa");
+    puts("  index               Build .pbwt.idx sample and region index");
+    puts("  index-matches       Cache all matches in .pbwt.mcache for later runs");
     puts("  match               Run region matching algorithm");
+    puts("  paint               Paint each haplotype by the regions it copies from");
     puts("  pileup              Calculate match pileup depth across chromosomes");
+    puts("  recompress          Rewrite a PBWT file with block compression");
     puts("  summary             Produce summary of PBWT file");
     puts("  view                Dump .pbwt file to stdout");
     putchar('\n');
     return 0;
 }
 
+int print_boundaries_usage(const char *msg)
+{
+    puts("Usage: pbwtutil boundaries [OPTION]... [PBWT FILE]\n");
+    puts("Count match start and end events per site or cM bin\n");
+    putchar('\n');
+    if (msg)
+    {
+        printf("%s\n\n", msg);
+    }
+    puts("Options:");
+    puts("  --minlen   FLOAT   Minimum match size (cM) [ Default: 0.5 cM ]");
+    puts("  --set              Find only set-maximal matches [ Default: all matches ]");
+    puts("  --bin-cm   FLOAT   Sum events over bins of FLOAT cM [ Default: per site ]");
+    puts("  --out      FILE    Write output to FILE, BGZF-compressed if it ends in .gz");
+    puts("  --threads  INT     Compression threads for .gz output [ Default: 1 ]");
+    puts("  --merge-gap-cm  FLOAT   Stitch matches of a pair separated by at most FLOAT cM");
+    puts("  --min-maf       FLOAT   Drop sites with minor allele frequency below FLOAT");
+    puts("  --thin-cm       FLOAT   Keep sites at least FLOAT cM apart");
+    puts("  --sites-file    FILE    Keep only sites whose rsid is listed in FILE");
+    puts("  --exclude-sites FILE    Drop sites whose rsid is listed in FILE");
+    puts("  --engine        STR     Matching engine: libpbwt, native or check [ Default: libpbwt ]");
+    puts("  --version          Print version number and exit");
+    puts("  --help             Display this help message and exit");
+    putchar('\n');
+    return 0;
+}
+
 int print_coancestry_usage(const char *msg)
 {
     puts("Usage: pbwtutil coancestry [OPTION]... [PBWT FILE]\n");
@@ -645,11 +1617,33 @@ int print_coancestry_usage(const char *msg)
     }
     puts("Options:");
     puts("  --adjlist          Output graph-based adjacency list [ Default: False ]");
-    puts("  --diploid          Output diploid rather than haploid-based measures");
+    puts("  --diploid          Output individual-level measures summed over haplotype pairs");
     puts("  --set              Find only set-maximal matches [ Default: all matches ]");
     puts("  --sites            Print site indices [ Default: false ]");
     puts("  --count            Coancestry matrix will have match count [ Default: total length ]");
+    puts("  --length           Coancestry matrix will have total length (combine with --count/--adjlist)");
     puts("  --minlen   FLOAT   Minimum match size (cM) [ Default: 0.5 cM ]");
+    puts("  --minlen-bins   LIST    One count/length matrix per match length bin, e.g. 1,2,5,10 cM");
+    puts("  --out      STR     Output stub; writes STR.adjlist, STR.count, STR.length [ Default: stdout ]");
+    puts("                     A .gz suffix gives BGZF files, e.g. STR.count.gz");
+    puts("  --threads  INT     Threads for matrix formatting and .gz output [ Default: 1 ]");
+    puts("  --segfile  FILE    Write matches as an indexed binary segment file");
+    puts("  --samples  FILE    Rows only for samples listed in FILE (subset x panel matrix)");
+    puts("  --ref      FILE    Reference .pbwt on the same sites; output target x reference block");
+    puts("  --pca      INT     Write top INT eigenvalues/loadings to STR.eigenval, STR.eigenvec");
+    puts("  --components       Write connected components of the match graph to STR.components");
+    puts("  --top-k    INT     Write each sample's INT longest matches to STR.topk");
+    puts("  --per-sample       Write each sample's total cM, matches and partners to STR.persample");
+    puts("  --component-min FLOAT   Join a pair only once its total match length reaches FLOAT cM");
+    puts("  --merge-gap-cm  FLOAT   Stitch matches of a pair separated by at most FLOAT cM");
+    puts("  --min-maf       FLOAT   Drop sites with minor allele frequency below FLOAT");
+    puts("  --thin-cm       FLOAT   Keep sites at least FLOAT cM apart");
+    puts("  --sites-file    FILE    Keep only sites whose rsid is listed in FILE");
+    puts("  --exclude-sites FILE    Drop sites whose rsid is listed in FILE");
+    puts("  --vcf           FILE    Import VCF FILE in memory in place of the PBWT file");
+    puts("  --map           FILE    Population map for --vcf, as for convert");
+    puts("  --save          FILE    Also write the panel imported with --vcf to FILE");
+    puts("  --engine        STR     Matching engine: libpbwt, native or check [ Default: libpbwt ]");
     puts("  --version          Print version number and exit");
     puts("  --help             Display this help message and exit");
     putchar('\n');
@@ -672,6 +1666,43 @@ int print_convert_usage(const char *msg)
     puts("  --reg               Input PLINK stub includes a REG file");
     puts("  --out      <STR>    Output stub (.pbwt extension will be added)");
     puts("  --query    <STR>    Use only this region/population (requires -r switch)");
+    puts("  --to       <STR>    Export PBWT input to vcf or bcf (--out is the output file)");
+    puts("  --threads  <INT>    Threads for PLINK .bed transposition or export compression [ Default: 1 ]");
+    puts("  --codec    <STR>    Write block-compressed .pbwt with zlib or zstd [ Default: libpbwt format ]");
+    puts("  --version           Print version number and exit");
+    puts("  --help              Display this help message and exit");
+    putchar('\n');
+    return 0;
+}
+
+int print_index_usage(const char *msg)
+{
+    puts("Usage: pbwtutil index [OPTION]... [PBWT FILE]\n");
+    puts("Build sample and region index alongside .pbwt file\n");
+    putchar('\n');
+    if (msg)
+    {
+        printf("%s\n\n", msg);
+    }
+    puts("Options:");
+    puts("  --version           Print version number and exit");
+    puts("  --help              Display this help message and exit");
+    putchar('\n');
+    return 0;
+}
+
+int print_index_matches_usage(const char *msg)
+{
+    puts("Usage: pbwtutil index-matches [OPTION]... [PBWT FILE]\n");
+    puts("Store all matches alongside .pbwt file for reuse by other commands\n");
+    putchar('\n');
+    if (msg)
+    {
+        printf("%s\n\n", msg);
+    }
+    puts("Options:");
+    puts("  --minlen   FLOAT   Base match size (cM); later runs need --minlen >= FLOAT [ Default: 0.5 cM ]");
+    puts("  --engine        STR     Matching engine: libpbwt, native or check [ Default: libpbwt ]");
     puts("  --version           Print version number and exit");
     puts("  --help              Display this help message and exit");
     putchar('\n');
@@ -691,8 +1722,48 @@ int print_match_usage(const char *msg)
     puts("  --minlen   FLOAT   Minimum match size (cM) [ Default: 0.5 cM ]");
     puts("  --query    STR     String identifier of haplotypes to mark as query");
     puts("  --all              Print a list of all individual matches with query");
+    puts("  --top-k    INT     Print only the query's INT longest matches");
+    puts("  --segfile  FILE    Write matches as an indexed binary segment file");
+    puts("  --out      FILE    Write output to FILE, BGZF-compressed if it ends in .gz");
+    puts("  --threads  INT     Compression threads for .gz output [ Default: 1 ]");
     puts("  --set              Find only set-maximal matches [ Default: all matches ]");
     puts("  --sites            Print site indices [ Default: false ]");
+    puts("  --merge-gap-cm  FLOAT   Stitch matches of a pair separated by at most FLOAT cM");
+    puts("  --min-maf       FLOAT   Drop sites with minor allele frequency below FLOAT");
+    puts("  --thin-cm       FLOAT   Keep sites at least FLOAT cM apart");
+    puts("  --sites-file    FILE    Keep only sites whose rsid is listed in FILE");
+    puts("  --exclude-sites FILE    Drop sites whose rsid is listed in FILE");
+    puts("  --vcf           FILE    Import VCF FILE in memory in place of the PBWT file");
+    puts("  --map           FILE    Population map for --vcf, as for convert");
+    puts("  --save          FILE    Also write the panel imported with --vcf to FILE");
+    puts("  --engine        STR     Matching engine: libpbwt, native or check [ Default: libpbwt ]");
+    puts("  --version          Print version number and exit");
+    puts("  --help             Display this help message and exit");
+    putchar('\n');
+    return 0;
+}
+
+int print_paint_usage(const char *msg)
+{
+    puts("Usage: pbwtutil paint [OPTION]... [PBWT FILE]\n");
+    puts("Paint each haplotype by the regions of the haplotypes it matches\n");
+    putchar('\n');
+    if (msg)
+    {
+        printf("%s\n\n", msg);
+    }
+    puts("Options:");
+    puts("  --minlen    FLOAT  Minimum match size (cM) [ Default: 0.5 cM ]");
+    puts("  --set              Find only set-maximal matches [ Default: all matches ]");
+    puts("  --window-cm FLOAT  Sum over windows of FLOAT cM [ Default: per site, 4 x nsam x nsite x nreg bytes ]");
+    puts("  --out       FILE   Write the binary paint array to FILE (required)");
+    puts("  --threads   INT    Worker threads, each painting a range of haplotypes [ Default: 1 ]");
+    puts("  --merge-gap-cm  FLOAT   Stitch matches of a pair separated by at most FLOAT cM");
+    puts("  --min-maf       FLOAT   Drop sites with minor allele frequency below FLOAT");
+    puts("  --thin-cm       FLOAT   Keep sites at least FLOAT cM apart");
+    puts("  --sites-file    FILE    Keep only sites whose rsid is listed in FILE");
+    puts("  --exclude-sites FILE    Drop sites whose rsid is listed in FILE");
+    puts("  --engine        STR     Matching engine: libpbwt, native or check [ Default: libpbwt ]");
     puts("  --version          Print version number and exit");
     puts("  --help             Display this help message and exit");
     putchar('\n');
@@ -712,12 +1783,44 @@ int print_pileup_usage(const char *msg)
     puts("  --minlen   FLOAT   Minimum match size (cM) [ Default: 0.5 cM ]");
     puts("  --query    STR     String identifier of haplotypes to mark as query");
     puts("  --set              Find only set-maximal matches [ Default: all matches ]");
+    puts("  --out      FILE    Write output to FILE, BGZF-compressed if it ends in .gz");
+    puts("  --threads  INT     Compression threads for .gz output [ Default: 1 ]");
+    puts("  --bedgraph         Print depth as merged runs: CHR, START, END, DEPTH");
+    puts("  --cm               Use cM rather than site ordinals for --bedgraph coordinates");
+    puts("  --track    FILE    Also write runs to an indexed binary track (see view --track)");
+    puts("  --min-maf       FLOAT   Drop sites with minor allele frequency below FLOAT");
+    puts("  --thin-cm       FLOAT   Keep sites at least FLOAT cM apart");
+    puts("  --sites-file    FILE    Keep only sites whose rsid is listed in FILE");
+    puts("  --exclude-sites FILE    Drop sites whose rsid is listed in FILE");
+    puts("  --vcf           FILE    Import VCF FILE in memory in place of the PBWT file");
+    puts("  --map           FILE    Population map for --vcf, as for convert");
+    puts("  --save          FILE    Also write the panel imported with --vcf to FILE");
+    puts("  --engine        STR     Matching engine: libpbwt, native or check [ Default: libpbwt ]");
     puts("  --version          Print version number and exit");
     puts("  --help             Display this help message and exit");
     putchar('\n');
     return 0;
 }
 
+int print_recompress_usage(const char *msg)
+{
+    puts("Usage: pbwtutil recompress [OPTION]... [PBWT FILE]\n");
+    puts("Rewrite PBWT file with independently compressed haplotype blocks\n");
+    putchar('\n');
+    if (msg)
+    {
+        printf("%s\n\n", msg);
+    }
+    puts("Options:");
+    puts("  --out      <FILE>   Output .pbwt file");
+    puts("  --codec    <STR>    Block codec, zlib or zstd [ Default: zstd when built in, else zlib ]");
+    puts("  --threads  <INT>    Compression threads [ Default: 1 ]");
+    puts("  --version           Print version number and exit");
+    puts("  --help              Display this help message and exit");
+    putchar('\n');
+    return 0;
+}
+
 int print_summary_usage(const char *msg)
 {
     puts("Usage: pbwtutil summary [OPTION]... [INPUT STUB]\n");
@@ -747,12 +1850,49 @@ int print_view_usage(const char *msg)
     puts("Options:");
     puts("  --nohaps            Omit haplotype states-- only print sample metadata");
     puts("  --sites             Print only site information");
+    puts("  --segments          Input is a segment file; print segments of --query");
+    puts("  --track             Input is a pileup track; print runs in --query CHR[:FROM-TO]");
+    puts("  --query    <STR>    Sample identifier (--segments) or region (--track) to look up");
+    puts("  --out      <FILE>   Write output to FILE, BGZF-compressed if it ends in .gz");
+    puts("  --threads  <INT>    Compression threads for .gz output [ Default: 1 ]");
     puts("  --version           Print version number and exit");
     puts("  --help              Display this help message and exit");
     putchar('\n');
     return 0;
 }
 
+int parse_minlen_bins(const char *arg, cmd_t *c)
+{
+    size_t n = 1;
+    const char *p = NULL;
+    char *end = NULL;
+
+    for (p = arg; *p; ++p)
+    {
+        n += *p == ',';
+    }
+    c->minlen_bins = (double *)malloc(n * sizeof(double));
+    if (c->minlen_bins == NULL)
+    {
+        return -1;
+    }
+
+    /* Bounds must rise strictly so every length falls in one bin */
+    p = arg;
+    for (c->nbins = 0; c->nbins < n; ++c->nbins)
+    {
+        c->minlen_bins[c->nbins] = strtod(p, &end);
+        if (end == p || (*end != ',' && *end != '\0') || !(c->minlen_bins[c->nbins] > 0.0) ||
+            (c->nbins > 0 && c->minlen_bins[c->nbins] <= c->minlen_bins[c->nbins-1]))
+        {
+            return -1;
+        }
+        p = end + 1;
+    }
+
+    return 0;
+}
+
 void print_version(void)
 {
     printf("pbwtutil: %s\n", Version);
@@ -0,0 +1,640 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#ifdef HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "pbwtutil.h"
+
+/* Block-compressed .pbwt files. libpbwt stores the haplotype matrix as
+ * one zlib stream, so inflating it is bound to a single core. Here the
+ * matrix is cut into blocks of whole haplotype rows, each compressed on
+ * its own and listed in a block table, so blocks are compressed and
+ * inflated by parallel workers straight into place. Site and sample
+ * metadata are stored uncompressed ahead of the table. Files in the
+ * libpbwt format are told apart by the magic and read as before. */
+
+#define BLOCK_MAGIC "PBWTBLK1"
+#define BLOCK_BYTES (1 << 22)
+#define ZLIB_LEVEL 6
+#define ZSTD_LEVEL 3
+
+typedef struct block_hdr
+{
+    char magic[8];
+    uint32_t codec;
+    uint32_t reserved;
+    uint64_t nsam;
+    uint64_t nsite;
+    uint64_t block_rows;
+    uint64_t nblock;
+    uint64_t str_len;
+    uint64_t table_off;
+} block_hdr_t;
+
+typedef struct block_ent
+{
+    uint64_t offset;
+    uint64_t csize;
+} block_ent_t;
+
+typedef struct block_job
+{
+    int codec;
+    int tid;
+    int nt;
+    int status;
+    size_t nblock;
+    size_t block_bytes;
+    size_t total_bytes;
+    unsigned char *raw;
+    unsigned char **cbuf;
+    uint64_t *csize;
+    const unsigned char *base;
+    const block_ent_t *ent;
+} block_job_t;
+
+int block_check(const block_hdr_t *, const size_t);
+int copy_str(const char **, const char *, char **);
+void *compress_worker(void *);
+void *inflate_worker(void *);
+int run_block_jobs(block_job_t *, const int, void *(*)(void *));
+
+int codec_id(const char *name)
+{
+    if (strcmp(name, "zlib") == 0)
+    {
+        return CODEC_ZLIB;
+    }
+#ifdef HAVE_ZSTD
+    if (strcmp(name, "zstd") == 0)
+    {
+        return CODEC_ZSTD;
+    }
+#endif
+
+    return -1;
+}
+
+int block_probe(const char *path)
+{
+    char magic[8];
+    FILE *fp = NULL;
+    int found = 0;
+
+    fp = fopen(path, "rb");
+    if (fp == NULL)
+    {
+        return 0;
+    }
+    found = fread(magic, 1, 8, fp) == 8 && memcmp(magic, BLOCK_MAGIC, 8) == 0;
+    fclose(fp);
+
+    return found;
+}
+
+int block_write(const char *outfile, const pbwt_t *b, const int codec, const int nthreads)
+{
+    int v = 0;
+    int nt = nthreads > 1 ? nthreads : 1;
+    size_t i = 0;
+    size_t j = 0;
+    uint64_t off = 0;
+    const char zero[8] = {0};
+    block_hdr_t hdr;
+    block_ent_t *ent = NULL;
+    block_job_t *job = NULL;
+    unsigned char **cbuf = NULL;
+    uint64_t *csize = NULL;
+    FILE *fp = NULL;
+
+    if (b->nsite == 0)
+    {
+        fputs("pbwtutil [ERROR]: cannot block-compress a panel with no sites\n", stderr);
+        return -1;
+    }
+
+    memset(&hdr, 0, sizeof(block_hdr_t));
+    memcpy(hdr.magic, BLOCK_MAGIC, 8);
+    hdr.codec = (uint32_t)codec;
+    hdr.nsam = b->nsam;
+    hdr.nsite = b->nsite;
+    hdr.block_rows = b->nsite < BLOCK_BYTES ? BLOCK_BYTES / b->nsite : 1;
+    hdr.nblock = (b->nsam + hdr.block_rows - 1) / hdr.block_rows;
+
+    /* Site strings first, then sample strings */
+    for (j = 0; j < b->nsite; ++j)
+    {
+        hdr.str_len += strlen(b->chr[j]) + strlen(b->rsid[j]) + 2;
+    }
+    for (i = 0; i < b->nsam; ++i)
+    {
+        hdr.str_len += strlen(b->sid[i]) + strlen(b->reg[i]) + 2;
+    }
+    hdr.table_off = ALIGN8(sizeof(block_hdr_t) + b->nsite * sizeof(double) + hdr.str_len);
+
+    ent = (block_ent_t *)malloc(hdr.nblock * sizeof(block_ent_t) + 1);
+    cbuf = (unsigned char **)calloc(hdr.nblock + 1, sizeof(unsigned char *));
+    csize = (uint64_t *)calloc(hdr.nblock + 1, sizeof(uint64_t));
+    job = (block_job_t *)malloc(nt * sizeof(block_job_t));
+    if (ent == NULL || cbuf == NULL || csize == NULL || job == NULL)
+    {
+        fputs("pbwtutil [ERROR]: memory allocation failure\n", stderr);
+        return -1;
+    }
+
+    /* Compress every block before anything is written */
+    for (i = 0; i < (size_t)nt; ++i)
+    {
+        memset(&job[i], 0, sizeof(block_job_t));
+        job[i].codec = codec;
+        job[i].tid = (int)i;
+        job[i].nt = nt;
+        job[i].nblock = hdr.nblock;
+        job[i].block_bytes = hdr.block_rows * b->nsite;
+        job[i].total_bytes = b->nsam * b->nsite;
+        job[i].raw = b->data;
+        job[i].cbuf = cbuf;
+        job[i].csize = csize;
+    }
+    v = run_block_jobs(job, nt, compress_worker);
+    if (v < 0)
+    {
+        fputs("pbwtutil [ERROR]: error compressing haplotype blocks\n", stderr);
+        return -1;
+    }
+
+    off = hdr.table_off + hdr.nblock * sizeof(block_ent_t);
+    for (i = 0; i < hdr.nblock; ++i)
+    {
+        ent[i].offset = off;
+        ent[i].csize = csize[i];
+        off += csize[i];
+    }
+
+    fp = fopen(outfile, "wb");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "pbwtutil [ERROR]: cannot open %s for writing\n", outfile);
+        return -1;
+    }
+    fwrite(&hdr, sizeof(block_hdr_t), 1, fp);
+    fwrite(b->cm, sizeof(double), b->nsite, fp);
+    for (j = 0; j < b->nsite; ++j)
+    {
+        fwrite(b->chr[j], 1, strlen(b->chr[j]) + 1, fp);
+        fwrite(b->rsid[j], 1, strlen(b->rsid[j]) + 1, fp);
+    }
+    for (i = 0; i < b->nsam; ++i)
+    {
+        fwrite(b->sid[i], 1, strlen(b->sid[i]) + 1, fp);
+        fwrite(b->reg[i], 1, strlen(b->reg[i]) + 1, fp);
+    }
+    fwrite(zero, 1, hdr.table_off - (sizeof(block_hdr_t) + b->nsite * sizeof(double) + hdr.str_len), fp);
+    fwrite(ent, sizeof(block_ent_t), hdr.nblock, fp);
+    for (i = 0; i < hdr.nblock; ++i)
+    {
+        fwrite(cbuf[i], 1, csize[i], fp);
+        free(cbuf[i]);
+    }
+    if (fclose(fp) != 0)
+    {
+        fprintf(stderr, "pbwtutil [ERROR]: error writing %s\n", outfile);
+        return -1;
+    }
+
+    /* Clean up allocated memory */
+    free(ent);
+    free(cbuf);
+    free(csize);
+    free(job);
+
+    return 0;
+}
+
+pbwt_t *block_read(const char *path, const int with_data, size_t *packed, const int nthreads)
+{
+    int v = 0;
+    int fd = -1;
+    int nt = nthreads > 1 ? nthreads : 1;
+    size_t i = 0;
+    size_t j = 0;
+    size_t size = 0;
+    uint64_t total = 0;
+    const char *str = NULL;
+    const char *end = NULL;
+    void *base = NULL;
+    const block_hdr_t *hdr = NULL;
+    const block_ent_t *ent = NULL;
+    block_job_t *job = NULL;
+    pbwt_t *b = NULL;
+    struct stat st;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(block_hdr_t))
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return NULL;
+    }
+    size = (size_t)st.st_size;
+    base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    hdr = (const block_hdr_t *)base;
+    if (block_check(hdr, size) < 0)
+    {
+        fprintf(stderr, "pbwtutil [ERROR]: %s is truncated or corrupt\n", path);
+        munmap(base, size);
+        return NULL;
+    }
+    ent = (const block_ent_t *)((const char *)base + hdr->table_off);
+#ifndef HAVE_ZSTD
+    if (hdr->codec == CODEC_ZSTD)
+    {
+        fputs("pbwtutil [ERROR]: file uses zstd blocks but zstd support is not built in\n", stderr);
+        munmap(base, size);
+        return NULL;
+    }
+#endif
+
+    /* Without haplotypes the panel is built with no sites, so the matrix
+     * is never allocated, and the site arrays are added here */
+    b = pbwt_init(with_data ? hdr->nsite : 0, hdr->nsam);
+    if (b && !with_data)
+    {
+        free(b->cm);
+        free(b->chr);
+        free(b->rsid);
+        b->cm = (double *)calloc(hdr->nsite, sizeof(double));
+        b->chr = (char **)calloc(hdr->nsite, sizeof(char *));
+        b->rsid = (char **)calloc(hdr->nsite, sizeof(char *));
+        b->nsite = hdr->nsite;
+        if (hdr->nsite > 0 && (b->cm == NULL || b->chr == NULL || b->rsid == NULL))
+        {
+            b->nsite = 0;
+            pbwt_destroy(b);
+            b = NULL;
+        }
+    }
+    if (b == NULL)
+    {
+        fputs("pbwtutil [ERROR]: memory allocation failure\n", stderr);
+        munmap(base, size);
+        return NULL;
+    }
+
+    /* Metadata is copied out of the mapping */
+    memcpy(b->cm, (const char *)base + sizeof(block_hdr_t), hdr->nsite * sizeof(double));
+    str = (const char *)base + sizeof(block_hdr_t) + hdr->nsite * sizeof(double);
+    end = str + hdr->str_len;
+    for (j = 0; j < hdr->nsite && v == 0; ++j)
+    {
+        if (copy_str(&str, end, &b->chr[j]) < 0 || copy_str(&str, end, &b->rsid[j]) < 0)
+        {
+            v = -1;
+        }
+    }
+    for (i = 0; i < hdr->nsam && v == 0; ++i)
+    {
+        if (copy_str(&str, end, &b->sid[i]) < 0 || copy_str(&str, end, &b->reg[i]) < 0)
+        {
+            v = -1;
+        }
+    }
+    if (v < 0)
+    {
+        fprintf(stderr, "pbwtutil [ERROR]: truncated metadata in %s\n", path);
+        pbwt_destroy(b);
+        munmap(base, size);
+        return NULL;
+    }
+
+    for (i = 0; i < hdr->nblock; ++i)
+    {
+        total += ent[i].csize;
+    }
+    if (packed)
+    {
+        *packed = (size_t)total;
+    }
+    b->datasize = b->nsam * b->nsite;
+
+    /* Blocks are independent, so each worker inflates its share */
+    if (with_data)
+    {
+        if ((size_t)nt > hdr->nblock)
+        {
+            nt = hdr->nblock > 0 ? (int)hdr->nblock : 1;
+        }
+        job = (block_job_t *)malloc(nt * sizeof(block_job_t));
+        if (job == NULL)
+        {
+            fputs("pbwtutil [ERROR]: memory allocation failure\n", stderr);
+            pbwt_destroy(b);
+            munmap(base, size);
+            return NULL;
+        }
+        for (i = 0; i < (size_t)nt; ++i)
+        {
+            memset(&job[i], 0, sizeof(block_job_t));
+            job[i].codec = (int)hdr->codec;
+            job[i].tid = (int)i;
+            job[i].nt = nt;
+            job[i].nblock = hdr->nblock;
+            job[i].block_bytes = hdr->block_rows * hdr->nsite;
+            job[i].total_bytes = b->datasize;
+            job[i].raw = b->data;
+            job[i].base = (const unsigned char *)base;
+            job[i].ent = ent;
+        }
+        v = run_block_jobs(job, nt, inflate_worker);
+        free(job);
+        if (v < 0)
+        {
+            fprintf(stderr, "pbwtutil [ERROR]: corrupt haplotype block in %s\n", path);
+            pbwt_destroy(b);
+            munmap(base, size);
+            return NULL;
+        }
+    }
+
+    munmap(base, size);
+
+    return b;
+}
+
+int block_check(const block_hdr_t *hdr, const size_t size)
+{
+    size_t k = 0;
+    uint64_t data_off = 0;
+    const block_ent_t *ent = NULL;
+
+    /* Counts are bounded by the file size before they are multiplied;
+     * every site and sample string takes at least its NUL */
+    if (hdr->nsite > size / sizeof(double) || hdr->str_len > size || hdr->table_off > size ||
+        hdr->nblock > size / sizeof(block_ent_t) || hdr->nsam > hdr->str_len / 2 ||
+        hdr->nsite + hdr->nsam > hdr->str_len / 2)
+    {
+        return -1;
+    }
+    if (sizeof(block_hdr_t) + hdr->nsite * sizeof(double) + hdr->str_len > hdr->table_off)
+    {
+        return -1;
+    }
+    data_off = hdr->table_off + hdr->nblock * sizeof(block_ent_t);
+    if (data_off > size)
+    {
+        return -1;
+    }
+
+    /* The blocks hold every haplotype row and no more */
+    if (hdr->block_rows == 0 || hdr->block_rows > SIZE_MAX / (hdr->nsite + 1) ||
+        hdr->nblock != hdr->nsam / hdr->block_rows + (hdr->nsam % hdr->block_rows != 0))
+    {
+        return -1;
+    }
+
+    ent = (const block_ent_t *)((const char *)hdr + hdr->table_off);
+    for (k = 0; k < hdr->nblock; ++k)
+    {
+        if (ent[k].offset < data_off || ent[k].offset > size || ent[k].csize > size - ent[k].offset)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int copy_str(const char **str, const char *end, char **dst)
+{
+    const char *nul = memchr(*str, '\0', (size_t)(end - *str));
+
+    if (nul == NULL)
+    {
+        return -1;
+    }
+    *dst = strdup(*str);
+    if (*dst == NULL)
+    {
+        return -1;
+    }
+    *str = nul + 1;
+
+    return 0;
+}
+
+int run_block_jobs(block_job_t *job, const int nt, void *(*worker)(void *))
+{
+    int i = 0;
+    int v = 0;
+    int nrun = 0;
+    pthread_t *tid = NULL;
+
+    tid = (pthread_t *)malloc(nt * sizeof(pthread_t));
+    if (tid == NULL)
+    {
+        return -1;
+    }
+    for (i = 1; i < nt; ++i)
+    {
+        if (pthread_create(&tid[i], NULL, worker, &job[i]) != 0)
+        {
+            fputs("pbwtutil [ERROR]: cannot start worker thread\n", stderr);
+            v = -1;
+            break;
+        }
+    }
+    nrun = i;
+    if (v == 0)
+    {
+        (*worker)(&job[0]);
+    }
+    for (i = 1; i < nrun; ++i)
+    {
+        pthread_join(tid[i], NULL);
+    }
+    for (i = 0; i < nt; ++i)
+    {
+        v |= job[i].status;
+    }
+    free(tid);
+
+    return v < 0 ? -1 : 0;
+}
+
+void *compress_worker(void *arg)
+{
+    size_t k = 0;
+    block_job_t *m = (block_job_t *)arg;
+#ifdef HAVE_LIBDEFLATE
+    struct libdeflate_compressor *z = libdeflate_alloc_compressor(ZLIB_LEVEL);
+#endif
+
+    /* Blocks are dealt round-robin across workers */
+    for (k = (size_t)m->tid; k < m->nblock && m->status == 0; k += (size_t)m->nt)
+    {
+        const size_t lo = k * m->block_bytes;
+        const size_t n = lo + m->block_bytes < m->total_bytes ? m->block_bytes : m->total_bytes - lo;
+        size_t bound = 0;
+
+        if (m->codec == CODEC_ZLIB)
+        {
+#ifdef HAVE_LIBDEFLATE
+            bound = z ? libdeflate_zlib_compress_bound(z, n) : 0;
+            m->cbuf[k] = (unsigned char *)malloc(bound + 1);
+            m->csize[k] = z && m->cbuf[k] ? libdeflate_zlib_compress(z, m->raw + lo, n, m->cbuf[k], bound) : 0;
+            if (m->csize[k] == 0)
+            {
+                m->status = -1;
+            }
+#else
+            uLongf len = compressBound((uLong)n);
+            bound = (size_t)len;
+            m->cbuf[k] = (unsigned char *)malloc(bound + 1);
+            if (m->cbuf[k] == NULL || compress2(m->cbuf[k], &len, m->raw + lo, (uLong)n, ZLIB_LEVEL) != Z_OK)
+            {
+                m->status = -1;
+            }
+            m->csize[k] = (uint64_t)len;
+#endif
+        }
+#ifdef HAVE_ZSTD
+        else if (m->codec == CODEC_ZSTD)
+        {
+            size_t len = 0;
+            bound = ZSTD_compressBound(n);
+            m->cbuf[k] = (unsigned char *)malloc(bound + 1);
+            len = m->cbuf[k] ? ZSTD_compress(m->cbuf[k], bound, m->raw + lo, n, ZSTD_LEVEL) : 0;
+            if (m->cbuf[k] == NULL || ZSTD_isError(len))
+            {
+                m->status = -1;
+            }
+            m->csize[k] = (uint64_t)len;
+        }
+#endif
+        else
+        {
+            m->status = -1;
+        }
+    }
+
+#ifdef HAVE_LIBDEFLATE
+    if (z)
+    {
+        libdeflate_free_compressor(z);
+    }
+#endif
+
+    return NULL;
+}
+
+void *inflate_worker(void *arg)
+{
+    size_t k = 0;
+    block_job_t *m = (block_job_t *)arg;
+#ifdef HAVE_LIBDEFLATE
+    struct libdeflate_decompressor *z = libdeflate_alloc_decompressor();
+#endif
+
+    for (k = (size_t)m->tid; k < m->nblock && m->status == 0; k += (size_t)m->nt)
+    {
+        const size_t lo = k * m->block_bytes;
+        const size_t n = lo + m->block_bytes < m->total_bytes ? m->block_bytes : m->total_bytes - lo;
+        const unsigned char *src = m->base + m->ent[k].offset;
+        const size_t csize = (size_t)m->ent[k].csize;
+
+        if (m->codec == CODEC_ZLIB)
+        {
+#ifdef HAVE_LIBDEFLATE
+            size_t len = 0;
+            if (z == NULL || libdeflate_zlib_decompress(z, src, csize, m->raw + lo, n, &len) != LIBDEFLATE_SUCCESS ||
+                len != n)
+            {
+                m->status = -1;
+            }
+#else
+            uLongf len = (uLongf)n;
+            if (uncompress(m->raw + lo, &len, src, (uLong)csize) != Z_OK || len != n)
+            {
+                m->status = -1;
+            }
+#endif
+        }
+#ifdef HAVE_ZSTD
+        else if (m->codec == CODEC_ZSTD)
+        {
+            const size_t len = ZSTD_decompress(m->raw + lo, n, src, csize);
+            if (ZSTD_isError(len) || len != n)
+            {
+                m->status = -1;
+            }
+        }
+#endif
+        else
+        {
+            m->status = -1;
+        }
+    }
+
+#ifdef HAVE_LIBDEFLATE
+    if (z)
+    {
+        libdeflate_free_decompressor(z);
+    }
+#endif
+
+    return NULL;
+}
+
+int pbwt_recompress(const cmd_t *c)
+{
+    int v = 0;
+    pbwt_t *b = NULL;
+
+    if (c == NULL)
+    {
+        return -1;
+    }
+
+    /* Either format is read in full, then written block-compressed */
+    b = read_pbwt(c->instub, 1, NULL, c->nthreads);
+    if (b == NULL)
+    {
+        return -1;
+    }
+
+    v = block_write(c->outfile, b, c->codec, c->nthreads);
+    if (v < 0)
+    {
+        return -1;
+    }
+
+    /* The sidecar is keyed on the new file's size and mtime */
+    v = sidecar_build(b, c->outfile);
+    if (v < 0)
+    {
+        return -1;
+    }
+
+    /* Clean up allocated memory */
+    pbwt_destroy(b);
+
+    return 0;
+}
@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "pbwtutil.h"
+
+/* Where matches start and end. One all-match sweep bumps two dense
+ * per-site counters; the track then lists only sites (or cM bins) with
+ * at least one event. Matches are cut at the ends of the data, so the
+ * first and last sites of each chromosome also collect truncated
+ * matches. */
+
+/* Per-site event counts for the current sweep */
+static uint64_t *start_count = NULL;
+static uint64_t *end_count = NULL;
+
+void count_boundary(pbwt_t *, const size_t, const size_t, const size_t, const size_t);
+void print_site_track(out_t *, const pbwt_t *);
+void print_bin_track(out_t *, const pbwt_t *, const double);
+
+int pbwt_boundaries(const cmd_t *c)
+{
+    int v = 0;
+    out_t *fp = NULL;
+    pbwt_t *b = NULL;
+
+    if (c == NULL)
+    {
+        return -1;
+    }
+
+    /* Read, uncompress and filter the pbwt data */
+    b = load_pbwt(c);
+    if (b == NULL)
+    {
+        return -1;
+    }
+
+    start_count = (uint64_t *)calloc(b->nsite, sizeof(uint64_t));
+    end_count = (uint64_t *)calloc(b->nsite, sizeof(uint64_t));
+    if (start_count == NULL || end_count == NULL)
+    {
+        fputs("pbwtutil [ERROR]: memory allocation failure\n", stderr);
+        v = -1;
+    }
+
+    /* Find matches */
+    if (v == 0 && run_sweep(b, c, count_boundary) < 0)
+    {
+        fputs("pbwtutil [ERROR]: error retrieving matches\n", stderr);
+        v = -1;
+    }
+
+    if (v == 0)
+    {
+        fp = open_output(c, NULL);
+        v = fp ? 0 : -1;
+    }
+    if (v == 0)
+    {
+        if (c->bin_cm > 0.0)
+        {
+            print_bin_track(fp, b, c->bin_cm);
+        }
+        else
+        {
+            print_site_track(fp, b);
+        }
+        if (out_close(fp) < 0)
+        {
+            fputs("pbwtutil [ERROR]: error writing output\n", stderr);
+            v = -1;
+        }
+    }
+
+    /* Clean up allocated memory on every path */
+    free(start_count);
+    free(end_count);
+    start_count = NULL;
+    end_count = NULL;
+    pbwt_destroy(b);
+
+    return v;
+}
+
+void count_boundary(pbwt_t *b, const size_t first, const size_t second, const size_t begin, const size_t end)
+{
+    start_count[begin]++;
+    end_count[end]++;
+}
+
+void print_site_track(out_t *fp, const pbwt_t *b)
+{
+    size_t j = 0;
+    size_t ord = 0;
+
+    /* Sites are numbered from zero on each chromosome */
+    for (j = 0; j < b->nsite; ++j)
+    {
+        ord = j > 0 && strcmp(b->chr[j], b->chr[j-1]) == 0 ? ord + 1 : 0;
+        if (start_count[j] || end_count[j])
+        {
+            out_printf(fp, "%s\t%zu\t%s\t%1.4lf\t%lu\t%lu\n", b->chr[j], ord, b->rsid[j], b->cm[j],
+                       (unsigned long)start_count[j], (unsigned long)end_count[j]);
+        }
+    }
+}
+
+void print_bin_track(out_t *fp, const pbwt_t *b, const double bin)
+{
+    size_t j = 0;
+    int64_t cur = 0;
+    uint64_t starts = 0;
+    uint64_t ends = 0;
+
+    /* A bin closes when the next site falls in another bin or on
+     * another chromosome */
+    for (j = 0; j < b->nsite; ++j)
+    {
+        const int64_t k = (int64_t)floor(b->cm[j] / bin);
+
+        if (j > 0 && (k != cur || strcmp(b->chr[j], b->chr[j-1]) != 0))
+        {
+            if (starts || ends)
+            {
+                out_printf(fp, "%s\t%1.4lf\t%1.4lf\t%lu\t%lu\n", b->chr[j-1], cur * bin, (cur + 1) * bin,
+                           (unsigned long)starts, (unsigned long)ends);
+            }
+            starts = 0;
+            ends = 0;
+        }
+        cur = k;
+        starts += start_count[j];
+        ends += end_count[j];
+    }
+    if (b->nsite > 0 && (starts || ends))
+    {
+        out_printf(fp, "%s\t%1.4lf\t%1.4lf\t%lu\t%lu\n", b->chr[b->nsite-1], cur * bin, (cur + 1) * bin,
+                   (unsigned long)starts, (unsigned long)ends);
+    }
+}
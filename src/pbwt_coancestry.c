@@ -3,11 +3,18 @@
 #include <string.h>
 #include "pbwtutil.h"
 
+int print_components(out_t *, const pbwt_t *, const accum_t *);
+int write_matrices(const cmd_t *, const accum_t *, const char *, const int);
+
 int pbwt_coancestry(const cmd_t *c)
 {
     int v = 0;
-    size_t i = 0;
-    size_t j = 0;
+    int flags = 0;
+    int print_length = 0;
+    size_t ref0 = 0;
+    out_t *fp = NULL;
+    out_t *adjfp = NULL;
+    accum_t *acc = NULL;
     pbwt_t *b = NULL;
 
     if (c == NULL)
@@ -15,126 +22,253 @@ int pbwt_coancestry(const cmd_t *c)
         return -1;
     }
 
-    /* Read in the pbwt file from disk */
-    b = pbwt_read(c->instub);
+    /* Read, uncompress and filter the pbwt data, appending the
+     * reference panel when one is given */
+    b = c->ref_file ? load_pbwt_ref(c, &ref0) : load_pbwt(c);
     if (b == NULL)
     {
-        fprintf(stderr, "pbwtutil [ERROR]: cannot read data from %s\n", c->instub);
         return -1;
     }
 
-    /* Uncompress the haplotype data */
-    v = pbwt_uncompress(b);
+    /* Collect every requested output so a single sweep feeds them all */
+    if (c->adjlist)
+    {
+        flags |= ACC_ADJLIST;
+    }
+    if (c->count_only)
+    {
+        flags |= ACC_COUNT;
+    }
+    if (c->segfile)
+    {
+        flags |= ACC_SEGMENT;
+    }
+    if (c->components)
+    {
+        flags |= ACC_COMPONENT;
+    }
+    if (c->top_k > 0)
+    {
+        flags |= ACC_TOPK;
+    }
+    if (c->per_sample)
+    {
+        flags |= ACC_SAMPLE;
+    }
+    if (c->out_length || (flags == 0 && c->pca == 0))
+    {
+        flags |= ACC_LENGTH;
+    }
+    print_length = flags & ACC_LENGTH;
+
+    /* PCA works on the length matrix whether or not it is printed */
+    if (c->pca > 0)
+    {
+        flags |= ACC_LENGTH;
+    }
+
+    acc = accum_init(b, c, flags, ref0);
+    if (acc == NULL)
+    {
+        fputs("pbwtutil [ERROR]: memory allocation failure\n", stderr);
+        return -1;
+    }
+
+    /* Adjacency list is streamed during the sweep */
+    if (flags & ACC_ADJLIST)
+    {
+        adjfp = open_output(c, "adjlist");
+        if (adjfp == NULL)
+        {
+            return -1;
+        }
+        set_adjlist_stream(adjfp);
+    }
+
+    /* Find matches */
+    v = run_sweep(b, c, accumulate);
     if (v < 0)
     {
-        fputs("pbwtutil [ERROR]: error uncompressing haplotype data\n", stderr);
+        fputs("pbwtutil [ERROR]: error retrieving matches\n", stderr);
         return -1;
     }
 
-    /* Construct adjacency list */
-    if (c->adjlist)
+    if (adjfp)
     {
-        if (c->set_match)
+        set_adjlist_stream(NULL);
+        if (out_close(adjfp) < 0)
         {
-            if (c->print_sites)
-            {
-                v = pbwt_set_match(b, c->minlen, report_adjlist_with_sites);
-            }
-            else
-            {
-                v = pbwt_set_match(b, c->minlen, report_adjlist);
-            }
+            fputs("pbwtutil [ERROR]: error writing adjacency list\n", stderr);
+            return -1;
         }
-        else
+    }
+
+    /* Print the coancestry matrices */
+    if (flags & ACC_COUNT)
+    {
+        v = write_matrices(c, acc, "count", 0);
+        if (v < 0)
         {
-            if (c->print_sites)
-            {
-                v = pbwt_all_match(b, c->minlen, report_adjlist_with_sites);
-            }
-            else
-            {
-                v = pbwt_all_match(b, c->minlen, report_adjlist);
-            }
+            fputs("pbwtutil [ERROR]: error writing count matrix\n", stderr);
+            return -1;
         }
     }
-    else if (c->count_only)
+    if (print_length)
     {
-        if (c->set_match)
+        v = write_matrices(c, acc, "length", 1);
+        if (v < 0)
         {
-            v = pbwt_set_match(b, c->minlen, add_nmatch);
+            fputs("pbwtutil [ERROR]: error writing length matrix\n", stderr);
+            return -1;
         }
-        else
+    }
+
+    /* Component assignments replace the edge list */
+    if (flags & ACC_COMPONENT)
+    {
+        fp = open_output(c, "components");
+        if (fp == NULL)
         {
-            v = pbwt_all_match(b, c->minlen, add_nmatch);
+            return -1;
         }
-        if (c->out_diploid)
+        v = print_components(fp, b, acc);
+        if (v < 0)
         {
-            for (i = 0; i < b->nsam/2; ++i)
-            {
-                for (j = 0; j < b->nsam/2 - 1; ++j)
-                {
-                    printf("%zu\t", b->nmatrix[2*i][2*j+1] + b->nmatrix[2*i+1][2*j]);
-                }
-                printf("%zu\n", b->nmatrix[2*i][2*j] + b->nmatrix[2*i+1][2*j+1]);
-            }
+            fputs("pbwtutil [ERROR]: memory allocation failure\n", stderr);
+            out_close(fp);
+            return -1;
         }
-        else
+        if (out_close(fp) < 0)
         {
-            /* Print coancestry matrix to STDOUT */
-            for (i = 0; i < b->nsam; ++i)
-            {
-                for (j = 0; j < b->nsam - 1; ++j)
-                {
-                    printf("%zu\t", b->nmatrix[i][j]);
-                }
-                printf("%zu\n", b->nmatrix[i][j]);
-            }
+            fputs("pbwtutil [ERROR]: error writing components\n", stderr);
+            return -1;
         }
     }
-    else
+
+    /* Longest matches per unit, already bounded during the sweep */
+    if (flags & ACC_TOPK)
     {
-        /* Find matches */
-        if (c->set_match)
+        fp = open_output(c, "topk");
+        if (fp == NULL)
         {
-            v = pbwt_set_match(b, c->minlen, add_coancestry);
+            return -1;
         }
-        else
+        v = print_top_k(fp, b, acc, 0, acc->n, c->print_sites);
+        if (out_close(fp) < 0 || v < 0)
         {
-            v = pbwt_all_match(b, c->minlen, add_coancestry);
+            fputs("pbwtutil [ERROR]: error writing top-K matches\n", stderr);
+            return -1;
         }
-        if (v < 0)
+    }
+
+    /* Per-sample totals, linear in the panel */
+    if (flags & ACC_SAMPLE)
+    {
+        fp = open_output(c, "persample");
+        if (fp == NULL)
         {
-            fputs("pbwtutil [ERROR]: error retrieving matches\n", stderr);
             return -1;
         }
-
-        if (c->out_diploid)
+        v = print_per_sample(fp, b, acc);
+        if (out_close(fp) < 0 || v < 0)
         {
-            for (i = 0; i < b->nsam/2; ++i)
-            {
-                for (j = 0; j < b->nsam/2 - 1; ++j)
-                {
-                    printf("%1.4lf\t", b->cmatrix[2*i][2*j+1] + b->cmatrix[2*i+1][2*j]);
-                }
-                printf("%1.4lf\n", b->cmatrix[2*i][2*j] + b->cmatrix[2*i+1][2*j+1]);
-            }
+            fputs("pbwtutil [ERROR]: error writing per-sample summary\n", stderr);
+            return -1;
         }
-        else
+    }
+
+    /* Leading eigenpairs without writing the matrix out */
+    if (c->pca > 0)
+    {
+        v = coancestry_pca(b, acc, c);
+        if (v < 0)
         {
-            /* Print coancestry matrix to STDOUT */
-            for (i = 0; i < b->nsam; ++i)
-            {
-                for (j = 0; j < b->nsam - 1; ++j)
-                {
-                    printf("%1.4lf\t", b->cmatrix[i][j]);
-                }
-                printf("%1.4lf\n", b->cmatrix[i][j]);
-            }
+            fputs("pbwtutil [ERROR]: error computing principal components\n", stderr);
+            return -1;
         }
     }
 
     /* Clean up allocated memory */
+    if (accum_destroy(acc) < 0)
+    {
+        fprintf(stderr, "pbwtutil [ERROR]: error writing %s\n", c->segfile);
+        return -1;
+    }
     pbwt_destroy(b);
 
     return 0;
 }
+
+int print_components(out_t *fp, const pbwt_t *b, const accum_t *acc)
+{
+    size_t u = 0;
+    size_t ncomp = 0;
+    size_t *label = NULL;
+
+    label = (size_t *)malloc(acc->n * sizeof(size_t));
+    if (label == NULL)
+    {
+        return -1;
+    }
+    for (u = 0; u < acc->n; ++u)
+    {
+        label[u] = SIZE_MAX;
+    }
+
+    /* Components are numbered in order of their first member */
+    for (u = 0; u < acc->n; ++u)
+    {
+        const size_t root = find_root(acc->parent, u);
+        if (label[root] == SIZE_MAX)
+        {
+            label[root] = ncomp++;
+        }
+        out_printf(fp, "%s\t%zu\t%zu\n", b->sid[u << acc->shift], label[root], acc->csize[root]);
+    }
+
+    free(label);
+
+    return 0;
+}
+
+int write_matrices(const cmd_t *c, const accum_t *acc, const char *ext, const int length)
+{
+    int v = 0;
+    size_t k = 0;
+    char binext[100];
+    out_t *fp = NULL;
+
+    /* Length bins get one file each, named by their bounds in cM; a
+     * single --minlen-bins value is still an open-ended bin */
+    for (k = 0; k < acc->nbin; ++k)
+    {
+        if (c->nbins == 0)
+        {
+            snprintf(binext, sizeof(binext), "%s", ext);
+        }
+        else if (k < acc->nbin - 1)
+        {
+            snprintf(binext, sizeof(binext), "%s.%g-%g", ext, acc->bin_lo[k], acc->bin_lo[k+1]);
+        }
+        else
+        {
+            snprintf(binext, sizeof(binext), "%s.%g+", ext, acc->bin_lo[k]);
+        }
+        fp = open_output(c, binext);
+        if (fp == NULL)
+        {
+            return -1;
+        }
+        v = print_matrix(fp, acc, length, k, c->nthreads);
+        if (out_close(fp) < 0)
+        {
+            v = -1;
+        }
+        if (v < 0)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
@@ -17,7 +17,7 @@ int pbwt_convert_plink(const cmd_t *c)
 
     /* Construct outfile name */
     length = strlen(c->instub);
-    outfile = (char *)malloc((length + 4) * sizeof(char));
+    outfile = (char *)malloc((length + 6) * sizeof(char));
     if (outfile == NULL)
     {
         fputs("pbwtutil [ERROR]: memory allocation error\n", stderr);
@@ -26,19 +26,46 @@ int pbwt_convert_plink(const cmd_t *c)
     strcpy(outfile, c->instub);
     strcat(outfile, ".pbwt");
 
-    /* Import PBWT structure */
-    b = pbwt_import_plink(c->instub);
+    /* Transpose the .bed genotypes into haplotype rows */
+    b = import_plink_bed(c->instub, c->has_reg, c->nthreads);
     if (b == NULL)
     {
         fputs("pbwtutil [ERROR]: problem importing PLINK stub\n", stderr);
         return -1;
     }
 
-    /* Write the pbwt to file */
-    v = pbwt_write(outfile, b);
-    if (v != 0)
+    /* Block compression works on the uncompressed rows */
+    if (c->codec != CODEC_LEGACY)
+    {
+        v = block_write(outfile, b, c->codec, c->nthreads);
+        if (v < 0)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        /* Compress haplotype data for storage */
+        v = pbwt_compress(b);
+        if (v < 0)
+        {
+            fputs("pbwtutil [ERROR]: error compressing haplotype data\n", stderr);
+            return -1;
+        }
+
+        /* Write the pbwt to file */
+        v = pbwt_write(outfile, b);
+        if (v != 0)
+        {
+            fputs("pbwtutil [ERROR]: Failed to write PBWT to disk\n", stderr);
+            return -1;
+        }
+    }
+
+    /* Index sample and region metadata for later queries */
+    v = sidecar_build(b, outfile);
+    if (v < 0)
     {
-        fputs("pbwtutil [ERROR]: Failed to write PBWT to disk\n", stderr);
         return -1;
     }
 
@@ -67,16 +94,266 @@ int pbwt_convert_vcf(const cmd_t *c)
         return -1;
     }
 
-    /* Write the pbwt to file */
-    v = pbwt_write(c->outfile, b);
+    /* The import comes back compressed; block output needs it inflated */
+    if (c->codec != CODEC_LEGACY)
+    {
+        v = pbwt_uncompress(b);
+        if (v < 0)
+        {
+            fputs("pbwtutil [ERROR]: error uncompressing haplotype data\n", stderr);
+            return -1;
+        }
+        v = block_write(c->outfile, b, c->codec, c->nthreads);
+        if (v < 0)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        /* Write the pbwt to file */
+        v = pbwt_write(c->outfile, b);
+        if (v != 0)
+        {
+            fputs("pbwtutil [ERROR]: Failed to write PBWT to disk\n", stderr);
+            return -1;
+        }
+    }
+
+    /* Index sample and region metadata for later queries */
+    v = sidecar_build(b, c->outfile);
+    if (v < 0)
+    {
+        return -1;
+    }
+
+    /* Clean up allocated memory */
+    pbwt_destroy(b);
+
+    return 0;
+}
+
+/* Sites are exported in blocks so the genotype buffer stays bounded
+ * regardless of panel size */
+
+#define EXPORT_BUFSIZE (1 << 25)
+
+bcf_hdr_t *export_header(const pbwt_t *);
+
+int pbwt_export_vcf(const cmd_t *c)
+{
+    int a = 0;
+    int v = 0;
+    int rid = -1;
+    khint_t kc = 0;
+    size_t i = 0;
+    size_t j = 0;
+    size_t k = 0;
+    size_t j0 = 0;
+    size_t nblock = 0;
+    size_t blocksize = 0;
+    float cm = 0.0;
+    const char *chr = NULL;
+    size_t *pos = NULL;
+    int32_t *gt = NULL;
+    const char *mode = NULL;
+    htsFile *fp = NULL;
+    bcf_hdr_t *hdr = NULL;
+    bcf1_t *rec = NULL;
+    khash_t(integer) *npos = NULL;
+    pbwt_t *b = NULL;
+
+    if (c == NULL)
+    {
+        return -1;
+    }
+
+    /* Read and uncompress the pbwt data */
+    b = load_pbwt(c);
+    if (b == NULL)
+    {
+        return -1;
+    }
+    if (b->nsam % 2 != 0)
+    {
+        fputs("pbwtutil [ERROR]: odd number of haplotypes cannot be paired into samples\n", stderr);
+        return -1;
+    }
+
+    hdr = export_header(b);
+    if (hdr == NULL)
+    {
+        fputs("pbwtutil [ERROR]: cannot build VCF header\n", stderr);
+        return -1;
+    }
+
+    /* BCF is always compressed; VCF only when asked for .gz */
+    if (strcmp(c->export_fmt, "bcf") == 0)
+    {
+        mode = "wb";
+    }
+    else
+    {
+        size_t length = strlen(c->outfile);
+        mode = length > 3 && strcmp(c->outfile + length - 3, ".gz") == 0 ? "wz" : "w";
+    }
+    fp = hts_open(c->outfile, mode);
+    if (fp == NULL)
+    {
+        fprintf(stderr, "pbwtutil [ERROR]: cannot open %s for writing\n", c->outfile);
+        return -1;
+    }
+    if (c->nthreads > 1 && hts_set_threads(fp, c->nthreads) < 0)
+    {
+        fputs("pbwtutil [WARNING]: cannot start compression threads\n", stderr);
+    }
+    if (bcf_hdr_write(fp, hdr) < 0)
+    {
+        fprintf(stderr, "pbwtutil [ERROR]: cannot write header to %s\n", c->outfile);
+        return -1;
+    }
+
+    /* Genotype buffer holds one block of sites, site-major */
+    blocksize = EXPORT_BUFSIZE / (b->nsam * sizeof(int32_t));
+    if (blocksize == 0)
+    {
+        blocksize = 1;
+    }
+    if (blocksize > b->nsite)
+    {
+        blocksize = b->nsite;
+    }
+    gt = (int32_t *)malloc(blocksize * b->nsam * sizeof(int32_t));
+    rec = bcf_init();
+    npos = kh_init(integer);
+    if (gt == NULL || rec == NULL || npos == NULL)
+    {
+        fputs("pbwtutil [ERROR]: memory allocation failure\n", stderr);
+        return -1;
+    }
+
+    for (j0 = 0; j0 < b->nsite; j0 += nblock)
+    {
+        nblock = b->nsite - j0 < blocksize ? b->nsite - j0 : blocksize;
+
+        /* Transpose the block: rows are read contiguously, one haplotype
+         * at a time. htslib keeps the phase flag on the second allele */
+        for (i = 0; i < b->nsam; ++i)
+        {
+            const unsigned char *row = b->data + TWODCORD(i, b->nsite, j0);
+            int32_t *dst = gt + i;
+            if (i % 2 == 0)
+            {
+                for (k = 0; k < nblock; ++k)
+                {
+                    dst[k * b->nsam] = bcf_gt_unphased(row[k] & 1);
+                }
+            }
+            else
+            {
+                for (k = 0; k < nblock; ++k)
+                {
+                    dst[k * b->nsam] = bcf_gt_phased(row[k] & 1);
+                }
+            }
+        }
+
+        for (k = 0; k < nblock; ++k)
+        {
+            j = j0 + k;
+
+            /* Positions are site ordinals counted from 1 on each chromosome,
+             * carried on if the chromosome shows up again later */
+            if (chr == NULL || strcmp(chr, b->chr[j]) != 0)
+            {
+                chr = b->chr[j];
+                rid = bcf_hdr_name2id(hdr, chr);
+                kc = kh_put(integer, npos, chr, &a);
+                if (a != 0)
+                {
+                    kh_value(npos, kc) = 0;
+                }
+                pos = &kh_value(npos, kc);
+            }
+
+            bcf_clear(rec);
+            rec->rid = rid;
+            rec->pos = (int64_t)(*pos)++;
+            cm = (float)b->cm[j];
+            bcf_update_id(hdr, rec, b->rsid[j]);
+            bcf_update_alleles_str(hdr, rec, "N,<ALT>");
+            bcf_update_info_float(hdr, rec, "CM", &cm, 1);
+            bcf_update_genotypes(hdr, rec, gt + k * b->nsam, (int)b->nsam);
+            if (bcf_write(fp, hdr, rec) < 0)
+            {
+                fprintf(stderr, "pbwtutil [ERROR]: error writing site %s\n", b->rsid[j]);
+                return -1;
+            }
+        }
+    }
+
+    v = hts_close(fp);
     if (v != 0)
     {
-     	fputs("pbwtutil [ERROR]: Failed to write PBWT to disk\n", stderr);
+        fprintf(stderr, "pbwtutil [ERROR]: error closing %s\n", c->outfile);
         return -1;
     }
 
     /* Clean up allocated memory */
+    bcf_destroy(rec);
+    bcf_hdr_destroy(hdr);
+    kh_destroy(integer, npos);
+    free(gt);
     pbwt_destroy(b);
 
     return 0;
 }
+
+bcf_hdr_t *export_header(const pbwt_t *b)
+{
+    int a = 0;
+    size_t i = 0;
+    size_t j = 0;
+    bcf_hdr_t *hdr = NULL;
+    khash_t(integer) *seen = NULL;
+
+    hdr = bcf_hdr_init("w");
+    seen = kh_init(integer);
+    if (hdr == NULL || seen == NULL)
+    {
+        return NULL;
+    }
+
+    /* One contig line per chromosome, in order of first appearance */
+    for (j = 0; j < b->nsite; ++j)
+    {
+        if (j == 0 || strcmp(b->chr[j], b->chr[j-1]) != 0)
+        {
+            kh_put(integer, seen, b->chr[j], &a);
+            if (a != 0)
+            {
+                bcf_hdr_printf(hdr, "##contig=<ID=%s>", b->chr[j]);
+            }
+        }
+    }
+    kh_destroy(integer, seen);
+    bcf_hdr_append(hdr, "##INFO=<ID=CM,Number=1,Type=Float,Description=\"Genetic map position (cM)\">");
+    bcf_hdr_append(hdr, "##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Phased genotype\">");
+
+    /* Consecutive haplotypes make up one diploid sample */
+    for (i = 0; i < b->nsam; i += 2)
+    {
+        if (bcf_hdr_add_sample(hdr, b->sid[i]) < 0)
+        {
+            bcf_hdr_destroy(hdr);
+            return NULL;
+        }
+    }
+    if (bcf_hdr_sync(hdr) < 0)
+    {
+        bcf_hdr_destroy(hdr);
+        return NULL;
+    }
+
+    return hdr;
+}
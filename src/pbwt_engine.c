@@ -0,0 +1,525 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pbwtutil.h"
+
+/* Native matching engine: Durbin's positional prefix and divergence
+ * arrays swept over bit-packed columns. Each site's alleles are packed
+ * 64 haplotypes to a word, so a column is a few cache lines and a
+ * monomorphic column is spotted with one pass of word ORs and ANDs and
+ * skipped outright. Before column k is applied, every pair that stops
+ * matching at k is reported as a maximal match ending at k - 1.
+ *
+ * Blocks are runs of the prefix order whose divergence is long enough
+ * in cM; within a block, pairs are enumerated from the minority allele
+ * so the work follows the number of matches reported. Chromosomes are
+ * swept one at a time, so no match spans a chromosome boundary.
+ *
+ * The all-pairs and query sweeps are one inline body instantiated
+ * twice with a constant query flag. --engine check runs libpbwt as well
+ * and fails if the two sets of matches differ other than where libpbwt
+ * carries a match across a chromosome boundary, then passes libpbwt's
+ * matches on. */
+
+typedef struct engine
+{
+    size_t nsam;
+    size_t nword;
+    uint64_t last_mask;
+    uint64_t *col;
+    uint32_t *a;
+    uint32_t *d;
+    uint32_t *a1;
+    uint32_t *d1;
+} engine_t;
+
+/* One match in canonical form for --engine check */
+typedef struct check_rec
+{
+    uint32_t first;
+    uint32_t second;
+    uint32_t begin;
+    uint32_t end;
+} check_rec_t;
+
+typedef struct check_list
+{
+    size_t n;
+    size_t cap;
+    check_rec_t *rec;
+} check_list_t;
+
+/* Match list being filled by the current check sweep */
+static check_list_t *collect = NULL;
+
+int engine_open(engine_t *, const pbwt_t *);
+void engine_close(engine_t *);
+int native_all_match(pbwt_t *, const double, match_report_t);
+int native_query_match(pbwt_t *, const double, match_report_t);
+int check_all_match(pbwt_t *, const double, match_report_t);
+int check_query_match(pbwt_t *, const double, match_report_t);
+int check_sweep(pbwt_t *, const double, match_report_t, match_sweep_t, match_sweep_t);
+void check_collect(pbwt_t *, const size_t, const size_t, const size_t, const size_t);
+int cmp_check_rec(const void *, const void *);
+int at_chr_edge(const pbwt_t *, const check_rec_t *, const int);
+
+int engine_id(const char *name)
+{
+    if (strcmp(name, "libpbwt") == 0)
+    {
+        return ENGINE_LIBPBWT;
+    }
+    if (strcmp(name, "native") == 0)
+    {
+        return ENGINE_NATIVE;
+    }
+    if (strcmp(name, "check") == 0)
+    {
+        return ENGINE_CHECK;
+    }
+
+    return -1;
+}
+
+match_sweep_t engine_sweep(const cmd_t *c, const int query)
+{
+    /* --set is rejected with the other engines when parsing; set-maximal
+     * matching is only provided by libpbwt */
+    if (c->set_match || c->engine == ENGINE_LIBPBWT)
+    {
+        return NULL;
+    }
+    if (c->engine == ENGINE_CHECK)
+    {
+        return query ? check_query_match : check_all_match;
+    }
+
+    return query ? native_query_match : native_all_match;
+}
+
+int engine_open(engine_t *e, const pbwt_t *b)
+{
+    size_t i = 0;
+    size_t k = 0;
+
+    memset(e, 0, sizeof(engine_t));
+    e->nsam = b->nsam;
+    e->nword = (b->nsam + 63) / 64;
+    e->last_mask = b->nsam % 64 ? ((uint64_t)1 << (b->nsam % 64)) - 1 : ~(uint64_t)0;
+    e->col = (uint64_t *)calloc(b->nsite * e->nword + 1, sizeof(uint64_t));
+    e->a = (uint32_t *)malloc(b->nsam * sizeof(uint32_t) + 1);
+    e->d = (uint32_t *)malloc(b->nsam * sizeof(uint32_t) + 1);
+    e->a1 = (uint32_t *)malloc(b->nsam * sizeof(uint32_t) + 1);
+    e->d1 = (uint32_t *)malloc(b->nsam * sizeof(uint32_t) + 1);
+    if (e->col == NULL || e->a == NULL || e->d == NULL || e->a1 == NULL || e->d1 == NULL)
+    {
+        engine_close(e);
+        return -1;
+    }
+
+    /* Transpose haplotype rows into packed site columns */
+    for (i = 0; i < b->nsam; ++i)
+    {
+        const unsigned char *row = b->data + TWODCORD(i, b->nsite, 0);
+        uint64_t *w = e->col + i / 64;
+        const int shift = (int)(i % 64);
+        for (k = 0; k < b->nsite; ++k)
+        {
+            w[k*e->nword] |= (uint64_t)(row[k] == '1') << shift;
+        }
+        e->a[i] = (uint32_t)i;
+    }
+
+    return 0;
+}
+
+void engine_close(engine_t *e)
+{
+    free(e->col);
+    free(e->a);
+    free(e->d);
+    free(e->a1);
+    free(e->d1);
+}
+
+#define ALLELE(col, h) ((int)((col)[(h) >> 6] >> ((h) & 63) & 1))
+
+static inline void report_block(pbwt_t *b, const engine_t *e, const size_t s, const size_t t,
+                                const size_t k, const uint64_t *col, const int query,
+                                match_report_t report)
+{
+    size_t i = 0;
+    size_t j = 0;
+    size_t ones = 0;
+    int minor = 0;
+    uint32_t m = 0;
+    const uint32_t *a = e->a;
+    const uint32_t *d = e->d;
+    const size_t end = k - 1;
+
+    if (query)
+    {
+        /* Scan out from each query haplotype; a pair of two queries is
+         * reported from the later one in prefix order only */
+        for (i = s; i <= t; ++i)
+        {
+            const int y = col ? ALLELE(col, a[i]) : 0;
+            if (!b->is_query[a[i]])
+            {
+                continue;
+            }
+            for (m = 0, j = i; j > s; --j)
+            {
+                m = d[j] > m ? d[j] : m;
+                if (col == NULL || ALLELE(col, a[j-1]) != y)
+                {
+                    (*report)(b, a[j-1], a[i], m, end);
+                }
+            }
+            for (m = 0, j = i + 1; j <= t; ++j)
+            {
+                m = d[j] > m ? d[j] : m;
+                if ((col == NULL || ALLELE(col, a[j]) != y) && !b->is_query[a[j]])
+                {
+                    (*report)(b, a[i], a[j], m, end);
+                }
+            }
+        }
+        return;
+    }
+
+    /* Last site of a chromosome: every pair in the block ends here */
+    if (col == NULL)
+    {
+        for (i = s + 1; i <= t; ++i)
+        {
+            for (m = 0, j = i; j > s; --j)
+            {
+                m = d[j] > m ? d[j] : m;
+                (*report)(b, a[j-1], a[i], m, end);
+            }
+        }
+        return;
+    }
+
+    /* Only pairs with different alleles end; scan from the rarer one */
+    for (i = s; i <= t; ++i)
+    {
+        ones += ALLELE(col, a[i]);
+    }
+    if (ones == 0 || ones == t - s + 1)
+    {
+        return;
+    }
+    minor = 2 * ones <= t - s + 1;
+    for (i = s; i <= t; ++i)
+    {
+        if (ALLELE(col, a[i]) != minor)
+        {
+            continue;
+        }
+        for (m = 0, j = i; j > s; --j)
+        {
+            m = d[j] > m ? d[j] : m;
+            if (ALLELE(col, a[j-1]) != minor)
+            {
+                (*report)(b, a[j-1], a[i], m, end);
+            }
+        }
+        for (m = 0, j = i + 1; j <= t; ++j)
+        {
+            m = d[j] > m ? d[j] : m;
+            if (ALLELE(col, a[j]) != minor)
+            {
+                (*report)(b, a[i], a[j], m, end);
+            }
+        }
+    }
+}
+
+static inline void report_site(pbwt_t *b, const engine_t *e, const size_t k, const double minlen,
+                               const uint64_t *col, const int query, match_report_t report)
+{
+    size_t i = 0;
+    size_t s = 0;
+    const uint32_t *d = e->d;
+    const double cm_end = b->cm[k-1];
+
+    /* A block grows while the match with the previous haplotype in
+     * prefix order is non-empty and at least minlen long */
+    for (i = 1; i <= e->nsam; ++i)
+    {
+        if (i < e->nsam && d[i] < k && cm_end - b->cm[d[i]] >= minlen)
+        {
+            continue;
+        }
+        if (i - 1 > s)
+        {
+            report_block(b, e, s, i - 1, k, col, query, report);
+        }
+        s = i;
+    }
+}
+
+static inline int monomorphic(const engine_t *e, const uint64_t *col)
+{
+    size_t w = 0;
+    uint64_t any = 0;
+    uint64_t all = ~(uint64_t)0;
+
+    for (w = 0; w + 1 < e->nword; ++w)
+    {
+        any |= col[w];
+        all &= col[w];
+    }
+    any |= col[w] & e->last_mask;
+    all &= col[w] | ~e->last_mask;
+
+    return any == 0 || all == ~(uint64_t)0;
+}
+
+static inline void update_site(engine_t *e, const size_t k, const uint64_t *col)
+{
+    size_t i = 0;
+    size_t n0 = 0;
+    size_t n1 = 0;
+    uint32_t p = (uint32_t)(k + 1);
+    uint32_t q = (uint32_t)(k + 1);
+
+    /* Stable partition by allele; the zero group is written back in
+     * place since it never overtakes the read position */
+    for (i = 0; i < e->nsam; ++i)
+    {
+        const uint32_t h = e->a[i];
+        const uint32_t di = e->d[i];
+        p = di > p ? di : p;
+        q = di > q ? di : q;
+        if (ALLELE(col, h))
+        {
+            e->a1[n1] = h;
+            e->d1[n1++] = q;
+            q = 0;
+        }
+        else
+        {
+            e->a[n0] = h;
+            e->d[n0++] = p;
+            p = 0;
+        }
+    }
+    memcpy(e->a + n0, e->a1, n1 * sizeof(uint32_t));
+    memcpy(e->d + n0, e->d1, n1 * sizeof(uint32_t));
+}
+
+static inline int native_sweep(pbwt_t *b, const double minlen, match_report_t report, const int query)
+{
+    size_t i = 0;
+    size_t k = 0;
+    size_t c0 = 0;
+    engine_t e;
+
+    if (b->nsam > UINT32_MAX || b->nsite >= UINT32_MAX)
+    {
+        return -1;
+    }
+    if (engine_open(&e, b) < 0)
+    {
+        return -1;
+    }
+
+    while (c0 < b->nsite)
+    {
+        size_t c1 = c0 + 1;
+        while (c1 < b->nsite && strcmp(b->chr[c1], b->chr[c0]) == 0)
+        {
+            ++c1;
+        }
+
+        /* Every match is empty at the start of a chromosome */
+        for (i = 0; i < b->nsam; ++i)
+        {
+            e.d[i] = (uint32_t)c0;
+        }
+
+        for (k = c0; k <= c1; ++k)
+        {
+            const uint64_t *col = k < c1 ? e.col + k * e.nword : NULL;
+            if (col && monomorphic(&e, col))
+            {
+                continue;
+            }
+            if (k > c0)
+            {
+                report_site(b, &e, k, minlen, col, query, report);
+            }
+            if (col)
+            {
+                update_site(&e, k, col);
+            }
+        }
+        c0 = c1;
+    }
+    engine_close(&e);
+
+    return 0;
+}
+
+int native_all_match(pbwt_t *b, const double minlen, match_report_t report)
+{
+    return native_sweep(b, minlen, report, 0);
+}
+
+int native_query_match(pbwt_t *b, const double minlen, match_report_t report)
+{
+    return native_sweep(b, minlen, report, 1);
+}
+
+int check_all_match(pbwt_t *b, const double minlen, match_report_t report)
+{
+    return check_sweep(b, minlen, report, pbwt_all_match, native_all_match);
+}
+
+int check_query_match(pbwt_t *b, const double minlen, match_report_t report)
+{
+    return check_sweep(b, minlen, report, pbwt_all_query_match, native_query_match);
+}
+
+int check_sweep(pbwt_t *b, const double minlen, match_report_t report, match_sweep_t ref,
+                match_sweep_t native)
+{
+    int v = 0;
+    size_t i = 0;
+    size_t j = 0;
+    size_t only_ref = 0;
+    size_t only_native = 0;
+    size_t edge = 0;
+    check_list_t got[2];
+    check_rec_t *order = NULL;
+
+    memset(got, 0, sizeof(got));
+    collect = &got[0];
+    v = (*ref)(b, minlen, check_collect);
+    collect = &got[1];
+    v = v < 0 ? v : (*native)(b, minlen, check_collect);
+    collect = NULL;
+    order = (check_rec_t *)malloc(got[0].n * sizeof(check_rec_t) + 1);
+    if (v < 0 || order == NULL)
+    {
+        free(got[0].rec);
+        free(got[1].rec);
+        free(order);
+        return -1;
+    }
+
+    /* Compare as sorted multisets, keeping libpbwt's order for output */
+    memcpy(order, got[0].rec, got[0].n * sizeof(check_rec_t));
+    qsort(got[0].rec, got[0].n, sizeof(check_rec_t), cmp_check_rec);
+    qsort(got[1].rec, got[1].n, sizeof(check_rec_t), cmp_check_rec);
+    while (i < got[0].n || j < got[1].n)
+    {
+        const int r = i == got[0].n ? 1 : j == got[1].n ? -1 : cmp_check_rec(got[0].rec + i, got[1].rec + j);
+        if (r != 0)
+        {
+            const check_rec_t *x = r < 0 ? got[0].rec + i : got[1].rec + j;
+            if (at_chr_edge(b, x, r > 0))
+            {
+                ++edge;
+            }
+            else
+            {
+                only_ref += r < 0;
+                only_native += r > 0;
+            }
+        }
+        i += r <= 0;
+        j += r >= 0;
+    }
+    if (only_ref || only_native)
+    {
+        fprintf(stderr, "pbwtutil [ERROR]: native engine differs from libpbwt: %zu of %zu matches only "
+                "in libpbwt, %zu of %zu only in native\n", only_ref, got[0].n, only_native, got[1].n);
+        v = -1;
+    }
+    else if (edge)
+    {
+        fprintf(stderr, "pbwtutil [WARNING]: %zu matches differ only where libpbwt crosses a "
+                "chromosome boundary\n", edge);
+    }
+
+    for (i = 0; v == 0 && i < got[0].n; ++i)
+    {
+        (*report)(b, order[i].first, order[i].second, order[i].begin, order[i].end);
+    }
+    free(got[0].rec);
+    free(got[1].rec);
+    free(order);
+
+    return v;
+}
+
+void check_collect(pbwt_t *b, const size_t first, const size_t second, const size_t begin, const size_t end)
+{
+    check_rec_t *r = NULL;
+
+    if (collect->n == collect->cap)
+    {
+        size_t cap = collect->cap ? 2 * collect->cap : 1024;
+        check_rec_t *rec = (check_rec_t *)realloc(collect->rec, cap * sizeof(check_rec_t));
+        if (rec == NULL)
+        {
+            fputs("pbwtutil [ERROR]: memory allocation failure\n", stderr);
+            exit(EXIT_FAILURE);
+        }
+        collect->rec = rec;
+        collect->cap = cap;
+    }
+    r = collect->rec + collect->n++;
+    r->first = (uint32_t)first;
+    r->second = (uint32_t)second;
+    r->begin = (uint32_t)begin;
+    r->end = (uint32_t)end;
+}
+
+int cmp_check_rec(const void *x, const void *y)
+{
+    const check_rec_t *a = (const check_rec_t *)x;
+    const check_rec_t *b = (const check_rec_t *)y;
+    const uint32_t alo = a->first < a->second ? a->first : a->second;
+    const uint32_t ahi = a->first < a->second ? a->second : a->first;
+    const uint32_t blo = b->first < b->second ? b->first : b->second;
+    const uint32_t bhi = b->first < b->second ? b->second : b->first;
+
+    /* Orientation of a pair is not significant */
+    if (a->end != b->end)
+    {
+        return a->end < b->end ? -1 : 1;
+    }
+    if (alo != blo)
+    {
+        return alo < blo ? -1 : 1;
+    }
+    if (ahi != bhi)
+    {
+        return ahi < bhi ? -1 : 1;
+    }
+    if (a->begin != b->begin)
+    {
+        return a->begin < b->begin ? -1 : 1;
+    }
+
+    return 0;
+}
+
+int at_chr_edge(const pbwt_t *b, const check_rec_t *r, const int native)
+{
+    /* libpbwt may carry a match across a chromosome boundary; native cuts
+     * it at the last site of one chromosome and restarts at the first site
+     * of the next. Only those two shapes are excused */
+    if (!native)
+    {
+        return strcmp(b->chr[r->begin], b->chr[r->end]) != 0;
+    }
+
+    return (r->begin > 0 && strcmp(b->chr[r->begin-1], b->chr[r->begin]) != 0) ||
+           (r->end + 1 < b->nsite && strcmp(b->chr[r->end], b->chr[r->end+1]) != 0);
+}
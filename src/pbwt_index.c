@@ -0,0 +1,338 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "pbwtutil.h"
+
+/* The .pbwt.idx sidecar holds what match and pileup otherwise rebuild
+ * from the haplotype metadata on every run: an open-addressing table of
+ * sample identifiers, each haplotype's region and per-region haplotype
+ * counts. Everything is addressed by offsets from the start of the file
+ * so it can be used straight from a read-only mapping. The size and
+ * modification time of the .pbwt are recorded so a stale sidecar is
+ * ignored rather than trusted. */
+
+#define SIDECAR_MAGIC "PBWTIDX1"
+
+typedef struct sidecar_hdr
+{
+    char magic[8];
+    uint64_t nsam;
+    uint64_t nreg;
+    uint64_t nslot;
+    uint64_t pbwt_size;
+    int64_t pbwt_mtime;
+    uint64_t slot_off;
+    uint64_t sid_off;
+    uint64_t hap_reg_off;
+    uint64_t reg_off;
+    uint64_t reg_count_off;
+    uint64_t str_off;
+    uint64_t str_len;
+} sidecar_hdr_t;
+
+char *sidecar_name(const char *);
+uint64_t hash_string(const char *);
+
+int pbwt_index(const cmd_t *c)
+{
+    int v = 0;
+    pbwt_t *b = NULL;
+
+    if (c == NULL)
+    {
+        return -1;
+    }
+
+    /* Only the metadata is needed, so the haplotypes stay compressed */
+    b = read_pbwt(c->instub, 0, NULL, 1);
+    if (b == NULL)
+    {
+        return -1;
+    }
+
+    v = sidecar_build(b, c->instub);
+    if (v < 0)
+    {
+        return -1;
+    }
+
+    /* Clean up allocated memory */
+    pbwt_destroy(b);
+
+    return 0;
+}
+
+int sidecar_build(const pbwt_t *b, const char *pbwtfile)
+{
+    int a = 0;
+    size_t i = 0;
+    uint64_t h = 0;
+    uint64_t nreg = 0;
+    uint64_t nslot = 1;
+    uint64_t str_len = 0;
+    uint32_t *slot = NULL;
+    uint64_t *sid_off = NULL;
+    uint32_t *hap_reg = NULL;
+    uint64_t *reg_off = NULL;
+    uint64_t *reg_count = NULL;
+    const char **reg_name = NULL;
+    const char zero[8] = {0};
+    char *idxfile = NULL;
+    khint_t k = 0;
+    khash_t(integer) *regs = NULL;
+    sidecar_hdr_t hdr;
+    struct stat st;
+    FILE *fp = NULL;
+
+    if (stat(pbwtfile, &st) != 0)
+    {
+        fprintf(stderr, "pbwtutil [ERROR]: cannot stat %s\n", pbwtfile);
+        return -1;
+    }
+
+    /* Table is kept at most half full */
+    while (nslot < 2 * (uint64_t)b->nsam)
+    {
+        nslot <<= 1;
+    }
+
+    slot = (uint32_t *)calloc(nslot, sizeof(uint32_t));
+    sid_off = (uint64_t *)malloc(b->nsam * sizeof(uint64_t));
+    hap_reg = (uint32_t *)malloc(b->nsam * sizeof(uint32_t));
+    reg_off = (uint64_t *)malloc(b->nsam * sizeof(uint64_t));
+    reg_count = (uint64_t *)calloc(b->nsam, sizeof(uint64_t));
+    reg_name = (const char **)malloc(b->nsam * sizeof(char *));
+    if (slot == NULL || sid_off == NULL || hap_reg == NULL || reg_off == NULL || reg_count == NULL ||
+        reg_name == NULL)
+    {
+        fputs("pbwtutil [ERROR]: memory allocation failure\n", stderr);
+        return -1;
+    }
+
+    /* Sample identifiers go first in the string pool. Slots hold the
+     * haplotype index plus one so zero marks an empty slot, and the
+     * first haplotype carrying an identifier wins */
+    for (i = 0; i < b->nsam; ++i)
+    {
+        sid_off[i] = str_len;
+        str_len += strlen(b->sid[i]) + 1;
+        for (h = hash_string(b->sid[i]) & (nslot - 1); slot[h]; h = (h + 1) & (nslot - 1))
+        {
+            if (strcmp(b->sid[slot[h]-1], b->sid[i]) == 0)
+            {
+                break;
+            }
+        }
+        if (slot[h] == 0)
+        {
+            slot[h] = (uint32_t)(i + 1);
+        }
+    }
+
+    /* Regions are numbered in order of first appearance */
+    regs = kh_init(integer);
+    for (i = 0; i < b->nsam; ++i)
+    {
+        k = kh_put(integer, regs, b->reg[i], &a);
+        if (a != 0)
+        {
+            kh_value(regs, k) = nreg;
+            reg_off[nreg] = str_len;
+            reg_name[nreg] = b->reg[i];
+            str_len += strlen(b->reg[i]) + 1;
+            ++nreg;
+        }
+        hap_reg[i] = (uint32_t)kh_value(regs, k);
+        reg_count[hap_reg[i]]++;
+    }
+    kh_destroy(integer, regs);
+
+    /* Lay out the sections on 8-byte boundaries */
+    memset(&hdr, 0, sizeof(sidecar_hdr_t));
+    memcpy(hdr.magic, SIDECAR_MAGIC, 8);
+    hdr.nsam = b->nsam;
+    hdr.nreg = nreg;
+    hdr.nslot = nslot;
+    hdr.pbwt_size = (uint64_t)st.st_size;
+    hdr.pbwt_mtime = (int64_t)st.st_mtime;
+    hdr.slot_off = ALIGN8(sizeof(sidecar_hdr_t));
+    hdr.sid_off = ALIGN8(hdr.slot_off + nslot * sizeof(uint32_t));
+    hdr.hap_reg_off = hdr.sid_off + b->nsam * sizeof(uint64_t);
+    hdr.reg_off = ALIGN8(hdr.hap_reg_off + b->nsam * sizeof(uint32_t));
+    hdr.reg_count_off = hdr.reg_off + nreg * sizeof(uint64_t);
+    hdr.str_off = hdr.reg_count_off + nreg * sizeof(uint64_t);
+    hdr.str_len = str_len;
+
+    idxfile = sidecar_name(pbwtfile);
+    if (idxfile == NULL)
+    {
+        fputs("pbwtutil [ERROR]: memory allocation failure\n", stderr);
+        return -1;
+    }
+    fp = fopen(idxfile, "wb");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "pbwtutil [ERROR]: cannot open %s for writing\n", idxfile);
+        return -1;
+    }
+
+    fwrite(&hdr, sizeof(sidecar_hdr_t), 1, fp);
+    fwrite(zero, 1, hdr.slot_off - sizeof(sidecar_hdr_t), fp);
+    fwrite(slot, sizeof(uint32_t), nslot, fp);
+    fwrite(zero, 1, hdr.sid_off - (hdr.slot_off + nslot * sizeof(uint32_t)), fp);
+    fwrite(sid_off, sizeof(uint64_t), b->nsam, fp);
+    fwrite(hap_reg, sizeof(uint32_t), b->nsam, fp);
+    fwrite(zero, 1, hdr.reg_off - (hdr.hap_reg_off + b->nsam * sizeof(uint32_t)), fp);
+    fwrite(reg_off, sizeof(uint64_t), nreg, fp);
+    fwrite(reg_count, sizeof(uint64_t), nreg, fp);
+    for (i = 0; i < b->nsam; ++i)
+    {
+        fwrite(b->sid[i], 1, strlen(b->sid[i]) + 1, fp);
+    }
+    for (i = 0; i < nreg; ++i)
+    {
+        fwrite(reg_name[i], 1, strlen(reg_name[i]) + 1, fp);
+    }
+
+    if (fclose(fp) != 0)
+    {
+        fprintf(stderr, "pbwtutil [ERROR]: error writing %s\n", idxfile);
+        return -1;
+    }
+
+    /* Clean up allocated memory */
+    free(idxfile);
+    free(slot);
+    free(sid_off);
+    free(hap_reg);
+    free(reg_off);
+    free(reg_count);
+    free(reg_name);
+
+    return 0;
+}
+
+sidecar_t *sidecar_open(const char *pbwtfile, const pbwt_t *b)
+{
+    int fd = -1;
+    char *idxfile = NULL;
+    const sidecar_hdr_t *hdr = NULL;
+    sidecar_t *s = NULL;
+    struct stat st;
+    struct stat ist;
+
+    /* The sidecar is optional: a missing one is not an error */
+    if (is_stdin(pbwtfile))
+    {
+        return NULL;
+    }
+    idxfile = sidecar_name(pbwtfile);
+    if (idxfile == NULL)
+    {
+        return NULL;
+    }
+    fd = open(idxfile, O_RDONLY);
+    free(idxfile);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    if (fstat(fd, &ist) != 0 || stat(pbwtfile, &st) != 0 || (size_t)ist.st_size < sizeof(sidecar_hdr_t))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    s = (sidecar_t *)calloc(1, sizeof(sidecar_t));
+    if (s == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+    s->size = (size_t)ist.st_size;
+    s->base = mmap(NULL, s->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (s->base == MAP_FAILED)
+    {
+        free(s);
+        return NULL;
+    }
+
+    hdr = (const sidecar_hdr_t *)s->base;
+    if (memcmp(hdr->magic, SIDECAR_MAGIC, 8) != 0 || hdr->nsam != b->nsam ||
+        hdr->pbwt_size != (uint64_t)st.st_size || hdr->pbwt_mtime != (int64_t)st.st_mtime ||
+        hdr->str_off + hdr->str_len > s->size)
+    {
+        fprintf(stderr, "pbwtutil [WARNING]: ignoring stale index for %s\n", pbwtfile);
+        sidecar_close(s);
+        return NULL;
+    }
+
+    s->nsam = hdr->nsam;
+    s->nreg = hdr->nreg;
+    s->nslot = hdr->nslot;
+    s->slot = (const uint32_t *)((const char *)s->base + hdr->slot_off);
+    s->sid_off = (const uint64_t *)((const char *)s->base + hdr->sid_off);
+    s->hap_reg = (const uint32_t *)((const char *)s->base + hdr->hap_reg_off);
+    s->reg_off = (const uint64_t *)((const char *)s->base + hdr->reg_off);
+    s->reg_count = (const uint64_t *)((const char *)s->base + hdr->reg_count_off);
+    s->str = (const char *)s->base + hdr->str_off;
+
+    return s;
+}
+
+int64_t sidecar_lookup(const sidecar_t *s, const char *sid)
+{
+    uint64_t h = 0;
+
+    for (h = hash_string(sid) & (s->nslot - 1); s->slot[h]; h = (h + 1) & (s->nslot - 1))
+    {
+        if (strcmp(s->str + s->sid_off[s->slot[h]-1], sid) == 0)
+        {
+            return (int64_t)s->slot[h] - 1;
+        }
+    }
+
+    return -1;
+}
+
+void sidecar_close(sidecar_t *s)
+{
+    if (s == NULL)
+    {
+        return;
+    }
+    munmap(s->base, s->size);
+    free(s);
+}
+
+char *sidecar_name(const char *pbwtfile)
+{
+    char *idxfile = NULL;
+
+    idxfile = (char *)malloc(strlen(pbwtfile) + 5);
+    if (idxfile)
+    {
+        sprintf(idxfile, "%s.idx", pbwtfile);
+    }
+
+    return idxfile;
+}
+
+uint64_t hash_string(const char *str)
+{
+    uint64_t h = 14695981039346656037ULL;
+
+    /* 64-bit FNV-1a */
+    while (*str)
+    {
+        h ^= (unsigned char)*str++;
+        h *= 1099511628211ULL;
+    }
+
+    return h;
+}
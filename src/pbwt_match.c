@@ -1,7 +1,17 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "pbwtutil.h"
 
+/* One line of the per-region summary */
+typedef struct reg_row
+{
+    const char *reg;
+    size_t count;
+} reg_row_t;
+
+int compare_reg_row(const void *, const void *);
+
 int pbwt_match(const cmd_t *c)
 {
     int v = 0;
@@ -13,6 +23,10 @@ int pbwt_match(const cmd_t *c)
     khash_t(integer) *sdict = NULL;
     khash_t(integer) *cdict = NULL;
     char **reglist = NULL;
+    reg_row_t *row = NULL;
+    sidecar_t *idx = NULL;
+    accum_t *acc = NULL;
+    out_t *fp = NULL;
     pbwt_t *b = NULL;
 
     if (c == NULL)
@@ -20,119 +34,176 @@ int pbwt_match(const cmd_t *c)
         return -1;
     }
 
-    /* Read in the pbwt file from disk */
-    b = pbwt_read(c->instub);
+    /* Read, uncompress and filter the pbwt data */
+    b = load_pbwt(c);
     if (b == NULL)
     {
-        fprintf(stderr, "pbwtutil [ERROR]: cannot read data from %s\n", c->instub);
         return -1;
     }
 
-    /* Uncompress the haplotype data */
-    v = pbwt_uncompress(b);
-    if (v < 0)
+    /* Resolve the query from the sidecar index when one is present,
+     * otherwise build the dictionaries from the haplotype metadata */
+    idx = c->vcf_file ? NULL : sidecar_open(c->instub, b);
+    if (idx)
     {
-        fputs("pbwtutil [ERROR]: error uncompressing haplotype data\n", stderr);
-        return -1;
+        int64_t h = sidecar_lookup(idx, c->query);
+        if (h < 0)
+        {
+            fprintf(stderr, "pbwtutil [ERROR]: cannot find haplotype with id %s\n", c->query);
+            return -1;
+        }
+        qid = (size_t)h;
+        b->is_query[qid] = TRUE;
     }
-
-    /* Make dictionary of sample identifiers and their indices */
-    sdict = pbwt_get_sampdict(b);
-    if (sdict == NULL)
+    else
     {
-        fputs("pbwtutil [ERROR]: cannot construct sample identifier dictionary\n", stderr);
-        return -1;
+        /* Make dictionary of sample identifiers and their indices */
+        sdict = pbwt_get_sampdict(b);
+        if (sdict == NULL)
+        {
+            fputs("pbwtutil [ERROR]: cannot construct sample identifier dictionary\n", stderr);
+            return -1;
+        }
+
+        cdict = pbwt_get_regcount(b);
+        if (cdict == NULL)
+        {
+            fputs("pbwtutil [ERROR]: cannot construct region count dictionary\n", stderr);
+            return -1;
+        }
+
+        /* Query user-input sample identifier */
+        k = kh_get(integer, sdict, c->query);
+
+        /* If sample ID is present, mark haplotype as query */
+        if (kh_exist(sdict, k) && k != kh_end(sdict))
+        {
+            qid = kh_value(sdict, k);
+            b->is_query[qid] = TRUE;
+        }
+        else
+        {
+            fprintf(stderr, "pbwtutil [ERROR]: cannot find haplotype with id %s\n", c->query);
+            return -1;
+        }
     }
 
-    cdict = pbwt_get_regcount(b);
-    if (cdict == NULL)
+    fp = open_output(c, NULL);
+    if (fp == NULL)
     {
-         fputs("pbwtutil [ERROR]: cannot construct region count dictionary\n", stderr);
         return -1;
     }
+    set_adjlist_stream(fp);
 
-    /* Query user-input sample identifier */
-    k = kh_get(integer, sdict, c->query);
-
-    /* If sample ID is present, mark haplotype as query */
-    if (kh_exist(sdict, k) && k != kh_end(sdict))
+    /* Find matches */
+    acc = accum_init(b, c, (c->top_k > 0 ? ACC_TOPK : c->match_all ? ACC_ADJLIST : ACC_REGION) |
+                     (c->segfile ? ACC_SEGMENT : 0), 0);
+    if (acc == NULL)
     {
-        qid = kh_value(sdict, k);
-        b->is_query[qid] = TRUE;
+        fputs("pbwtutil [ERROR]: memory allocation failure\n", stderr);
+        return -1;
     }
-    else
+    v = run_sweep(b, c, accumulate);
+    if (v < 0)
     {
-        fprintf(stderr, "pbwtutil [ERROR]: cannot find haplotype with id %s\n", c->query);
+        fputs("pbwtutil [ERROR]: error retrieving matches\n", stderr);
         return -1;
     }
 
-    /* Find matches */
-    if (c->set_match && c->match_all)
+    if (c->top_k > 0)
     {
-        if (c->print_sites)
-        {
-            v = pbwt_set_query_match(b, c->minlen, report_adjlist_with_sites);
-        }
-        else
+        /* Only the query's own heap is kept and reported */
+        if (print_top_k(fp, b, acc, qid, qid + 1, c->print_sites) < 0)
         {
-            v = pbwt_set_query_match(b, c->minlen, report_adjlist);
+            fputs("pbwtutil [ERROR]: error writing output\n", stderr);
+            out_close(fp);
+            return -1;
         }
     }
-    else if (c->set_match && !c->match_all)
-    {
-        v = pbwt_set_query_match(b, c->minlen, add_region);
-    }
-    else if (!c->set_match && c->match_all)
+    else if (!c->match_all)
     {
-        if (c->print_sites)
+        /* Region names and sizes come from the sidecar when present,
+         * otherwise from the haplotype metadata */
+        if (idx)
         {
-            v = pbwt_all_query_match(b, c->minlen, report_adjlist_with_sites);
+            nregs = idx->nreg;
+            row = (reg_row_t *)malloc(nregs * sizeof(reg_row_t));
+            for (i = 0; row && i < nregs; ++i)
+            {
+                row[i].reg = idx->str + idx->reg_off[i];
+                row[i].count = idx->reg_count[i];
+            }
         }
         else
         {
-            v = pbwt_all_query_match(b, c->minlen, report_adjlist);
+            reglist = pbwt_get_reglist(b, &nregs);
+            if (reglist == NULL)
+            {
+                fputs("pbwtutil [ERROR]: cannot retrieve reg list\n", stderr);
+                return -1;
+            }
+            row = (reg_row_t *)malloc(nregs * sizeof(reg_row_t));
+            for (i = 0; row && i < nregs; ++i)
+            {
+                kk = kh_get(integer, cdict, reglist[i]);
+                row[i].reg = reglist[i];
+                row[i].count = kh_value(cdict, kk);
+            }
         }
-    }
-    else
-    {
-        v = pbwt_all_query_match(b, c->minlen, add_region);
-    }
-
-    if (!c->match_all)
-    {
-        /* Get hash of regions */
-        reglist = pbwt_get_reglist(b, &nregs);
-        if (reglist == NULL)
+        if (row == NULL)
         {
-            fputs("pbwtutil [ERROR]: cannot retrieve reg list\n", stderr);
+            fputs("pbwtutil [ERROR]: memory allocation failure\n", stderr);
             return -1;
         }
 
-        /* Print region list to STDOUT */
+        /* Both sources list regions in their own order; print by name */
+        qsort(row, nregs, sizeof(reg_row_t), compare_reg_row);
         for (i = 0; i < nregs; ++i)
         {
-            k = kh_get(floats, b->reghash, reglist[i]);
-            kk = kh_get(integer, cdict, reglist[i]);
-            if (kh_exist(b->reghash, k) && k != kh_end(b->reghash))
+            k = kh_get(floats, b->reghash, row[i].reg);
+            if (k != kh_end(b->reghash) && kh_exist(b->reghash, k))
             {
-                size_t co = kh_value(cdict, kk);
                 double total = kh_value(b->reghash, k);
-                fprintf(stdout, "%s\t%s\t%s\t%s\t%1.5lf\t%1.5lf\n",
-                        c->instub, b->sid[qid], b->reg[qid], reglist[i], total, total / co);
+                out_printf(fp, "%s\t%s\t%s\t%s\t%1.5lf\t%1.5lf\n",
+                           c->instub, b->sid[qid], b->reg[qid], row[i].reg, total, total / row[i].count);
             }
             else
             {
-                fprintf(stdout, "%s\t%s\t%s\t%s\t0.00000\t0.00000\n",
-                        c->instub, b->sid[qid], b->reg[qid], reglist[i]);
+                out_printf(fp, "%s\t%s\t%s\t%s\t0.00000\t0.00000\n",
+                           c->instub, b->sid[qid], b->reg[qid], row[i].reg);
             }
         }
+        free(row);
         free(reglist);
     }
 
     /* Clean up allocated memory */
+    set_adjlist_stream(NULL);
+    if (out_close(fp) < 0)
+    {
+        fputs("pbwtutil [ERROR]: error writing output\n", stderr);
+        return -1;
+    }
+    if (accum_destroy(acc) < 0)
+    {
+        fprintf(stderr, "pbwtutil [ERROR]: error writing %s\n", c->segfile);
+        return -1;
+    }
     pbwt_destroy(b);
-    kh_destroy(integer, sdict);
-    kh_destroy(integer, cdict);
+    sidecar_close(idx);
+    if (sdict)
+    {
+        kh_destroy(integer, sdict);
+        kh_destroy(integer, cdict);
+    }
 
     return 0;
 }
+
+int compare_reg_row(const void *a, const void *b)
+{
+    const reg_row_t *x = (const reg_row_t *)a;
+    const reg_row_t *y = (const reg_row_t *)b;
+
+    return strcmp(x->reg, y->reg);
+}
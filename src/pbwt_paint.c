@@ -0,0 +1,399 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "pbwtutil.h"
+
+/* Haplotype painting: for every haplotype, how many matched sites in
+ * each window were copied from each region. Regions are numbered in
+ * order of first appearance so the counts form a dense
+ * nsam x windows x regions array of uint32, saturating at UINT32_MAX
+ * (reported as a warning) rather than wrapping. Matches from the sweep are
+ * batched; each worker owns a contiguous range of target haplotypes and
+ * applies the whole batch to its own rows only, so no locking is
+ * needed. The output file is:
+ *
+ *   header, region names and sample IDs (NUL-terminated), a window
+ *   table of first/last site and cM span, then the count array. */
+
+#define PAINT_MAGIC "PBWTPNT1"
+#define PAINT_BATCH (1 << 20)
+
+typedef struct paint_hdr
+{
+    char magic[8];
+    uint64_t nsam;
+    uint64_t nwin;
+    uint64_t nreg;
+    uint64_t str_len;
+    uint64_t win_off;
+    uint64_t data_off;
+} paint_hdr_t;
+
+typedef struct paint_win
+{
+    uint32_t first;
+    uint32_t last;
+    double cm_begin;
+    double cm_end;
+} paint_win_t;
+
+typedef struct paint_rec
+{
+    uint32_t first;
+    uint32_t second;
+    uint32_t begin;
+    uint32_t end;
+} paint_rec_t;
+
+typedef struct painter
+{
+    int nthreads;
+    int err;
+    int saturated;
+    size_t nsam;
+    size_t nwin;
+    size_t nreg;
+    size_t nbatch;
+    uint16_t *hap_reg;
+    uint32_t *win_of;
+    paint_win_t *win;
+    uint32_t *count;
+    paint_rec_t *batch;
+} painter_t;
+
+typedef struct paint_job
+{
+    size_t lo;
+    size_t hi;
+    int saturated;
+} paint_job_t;
+
+/* Painting state for the current sweep */
+static painter_t paint;
+
+void paint_match(pbwt_t *, const size_t, const size_t, const size_t, const size_t);
+int flush_batch(void);
+void *paint_worker(void *);
+int paint_span(const size_t, const size_t, const size_t, const size_t);
+size_t make_windows(const pbwt_t *, const double);
+int write_paint(const char *, const pbwt_t *, char **);
+
+int pbwt_paint(const cmd_t *c)
+{
+    int a = 0;
+    int v = 0;
+    size_t i = 0;
+    khint_t k = 0;
+    char **reg_name = NULL;
+    khash_t(integer) *regs = NULL;
+    pbwt_t *b = NULL;
+
+    if (c == NULL)
+    {
+        return -1;
+    }
+
+    /* Read, uncompress and filter the pbwt data */
+    b = load_pbwt(c);
+    if (b == NULL)
+    {
+        return -1;
+    }
+
+    memset(&paint, 0, sizeof(painter_t));
+    paint.nthreads = c->nthreads > 1 ? c->nthreads : 1;
+    paint.nsam = b->nsam;
+    paint.hap_reg = (uint16_t *)malloc(b->nsam * sizeof(uint16_t));
+    paint.win_of = (uint32_t *)malloc(b->nsite * sizeof(uint32_t));
+    paint.win = (paint_win_t *)malloc(b->nsite * sizeof(paint_win_t));
+    paint.batch = (paint_rec_t *)malloc(PAINT_BATCH * sizeof(paint_rec_t));
+    reg_name = (char **)malloc(b->nsam * sizeof(char *));
+    if (paint.hap_reg == NULL || paint.win_of == NULL || paint.win == NULL || paint.batch == NULL ||
+        reg_name == NULL)
+    {
+        fputs("pbwtutil [ERROR]: memory allocation failure\n", stderr);
+        return -1;
+    }
+
+    /* Small region IDs in order of first appearance */
+    regs = kh_init(integer);
+    for (i = 0; i < b->nsam; ++i)
+    {
+        k = kh_put(integer, regs, b->reg[i], &a);
+        if (a != 0)
+        {
+            if (paint.nreg == UINT16_MAX)
+            {
+                fputs("pbwtutil [ERROR]: too many regions to paint\n", stderr);
+                return -1;
+            }
+            kh_value(regs, k) = paint.nreg;
+            reg_name[paint.nreg++] = b->reg[i];
+        }
+        paint.hap_reg[i] = (uint16_t)kh_value(regs, k);
+    }
+    kh_destroy(integer, regs);
+
+    paint.nwin = make_windows(b, c->bin_cm);
+    paint.count = (uint32_t *)calloc(b->nsam * paint.nwin * paint.nreg, sizeof(uint32_t));
+    if (paint.count == NULL)
+    {
+        fprintf(stderr, "pbwtutil [ERROR]: cannot allocate %zu x %zu x %zu paint array; "
+                "try a larger --window-cm\n", b->nsam, paint.nwin, paint.nreg);
+        return -1;
+    }
+
+    /* Find matches, painting each batch as it fills */
+    v = run_sweep(b, c, paint_match);
+    if (v < 0)
+    {
+        fputs("pbwtutil [ERROR]: error retrieving matches\n", stderr);
+        return -1;
+    }
+    if (paint.err < 0 || flush_batch() < 0)
+    {
+        fputs("pbwtutil [ERROR]: cannot start worker thread\n", stderr);
+        return -1;
+    }
+    if (paint.saturated)
+    {
+        fprintf(stderr, "pbwtutil [WARNING]: some paint counts exceeded %u and were capped; "
+                "try a smaller --window-cm\n", UINT32_MAX);
+    }
+
+    v = write_paint(c->outfile, b, reg_name);
+    if (v < 0)
+    {
+        fprintf(stderr, "pbwtutil [ERROR]: error writing %s\n", c->outfile);
+        return -1;
+    }
+
+    /* Clean up allocated memory */
+    free(paint.hap_reg);
+    free(paint.win_of);
+    free(paint.win);
+    free(paint.batch);
+    free(paint.count);
+    free(reg_name);
+    pbwt_destroy(b);
+
+    return 0;
+}
+
+size_t make_windows(const pbwt_t *b, const double width)
+{
+    size_t j = 0;
+    size_t nwin = 0;
+    int64_t cur = 0;
+
+    /* One window per site, or per cM bin within a chromosome */
+    for (j = 0; j < b->nsite; ++j)
+    {
+        const int64_t k = width > 0.0 ? (int64_t)floor(b->cm[j] / width) : (int64_t)j;
+
+        if (j == 0 || k != cur || strcmp(b->chr[j], b->chr[j-1]) != 0)
+        {
+            paint.win[nwin].first = (uint32_t)j;
+            paint.win[nwin].cm_begin = b->cm[j];
+            ++nwin;
+            cur = k;
+        }
+        paint.win[nwin-1].last = (uint32_t)j;
+        paint.win[nwin-1].cm_end = b->cm[j];
+        paint.win_of[j] = (uint32_t)(nwin - 1);
+    }
+
+    return nwin;
+}
+
+void paint_match(pbwt_t *b, const size_t first, const size_t second, const size_t begin, const size_t end)
+{
+    paint_rec_t *r = NULL;
+
+    /* No exit from inside the sweep: remember the failure for pbwt_paint */
+    if (paint.err < 0)
+    {
+        return;
+    }
+    if (paint.nbatch == PAINT_BATCH && flush_batch() < 0)
+    {
+        paint.err = -1;
+        return;
+    }
+    r = paint.batch + paint.nbatch++;
+    r->first = (uint32_t)first;
+    r->second = (uint32_t)second;
+    r->begin = (uint32_t)begin;
+    r->end = (uint32_t)end;
+}
+
+int flush_batch(void)
+{
+    int i = 0;
+    int v = 0;
+    int nrun = 0;
+    int nt = paint.nthreads;
+    pthread_t *tid = NULL;
+    paint_job_t *job = NULL;
+
+    tid = (pthread_t *)malloc(nt * sizeof(pthread_t));
+    job = (paint_job_t *)malloc(nt * sizeof(paint_job_t));
+    if (tid == NULL || job == NULL)
+    {
+        free(tid);
+        free(job);
+        return -1;
+    }
+
+    for (i = 0; i < nt; ++i)
+    {
+        job[i].lo = paint.nsam * i / nt;
+        job[i].hi = paint.nsam * (i + 1) / nt;
+        job[i].saturated = 0;
+    }
+    for (i = 1; i < nt; ++i)
+    {
+        if (pthread_create(&tid[i], NULL, paint_worker, &job[i]) != 0)
+        {
+            v = -1;
+            break;
+        }
+    }
+    nrun = i;
+    if (v == 0)
+    {
+        paint_worker(&job[0]);
+    }
+    for (i = 1; i < nrun; ++i)
+    {
+        pthread_join(tid[i], NULL);
+    }
+    for (i = 0; i < nrun; ++i)
+    {
+        paint.saturated |= job[i].saturated;
+    }
+    paint.nbatch = 0;
+
+    free(tid);
+    free(job);
+
+    return v;
+}
+
+void *paint_worker(void *arg)
+{
+    size_t k = 0;
+    paint_job_t *m = (paint_job_t *)arg;
+
+    /* Each side of a match is painted with the other side's region */
+    for (k = 0; k < paint.nbatch; ++k)
+    {
+        const paint_rec_t *r = paint.batch + k;
+        if (r->first >= m->lo && r->first < m->hi)
+        {
+            m->saturated |= paint_span(r->first, paint.hap_reg[r->second], r->begin, r->end);
+        }
+        if (r->second >= m->lo && r->second < m->hi)
+        {
+            m->saturated |= paint_span(r->second, paint.hap_reg[r->first], r->begin, r->end);
+        }
+    }
+
+    return NULL;
+}
+
+int paint_span(const size_t hap, const size_t reg, const size_t begin, const size_t end)
+{
+    int saturated = 0;
+    size_t w = 0;
+    uint32_t *row = paint.count + hap * paint.nwin * paint.nreg + reg;
+
+    /* Windows covered by the match get their overlapping site count */
+    for (w = paint.win_of[begin]; w <= paint.win_of[end]; ++w)
+    {
+        const size_t lo = begin > paint.win[w].first ? begin : paint.win[w].first;
+        const size_t hi = end < paint.win[w].last ? end : paint.win[w].last;
+        const uint32_t n = (uint32_t)(hi - lo + 1);
+        if (row[w * paint.nreg] > UINT32_MAX - n)
+        {
+            row[w * paint.nreg] = UINT32_MAX;
+            saturated = 1;
+        }
+        else
+        {
+            row[w * paint.nreg] += n;
+        }
+    }
+
+    return saturated;
+}
+
+int write_paint(const char *outfile, const pbwt_t *b, char **reg_name)
+{
+    int v = 0;
+    size_t i = 0;
+    size_t len = 0;
+    size_t pad = 0;
+    const size_t ncount = paint.nsam * paint.nwin * paint.nreg;
+    const char zero[8] = {0};
+    paint_hdr_t hdr;
+    FILE *fp = NULL;
+
+    memset(&hdr, 0, sizeof(paint_hdr_t));
+    memcpy(hdr.magic, PAINT_MAGIC, 8);
+    hdr.nsam = paint.nsam;
+    hdr.nwin = paint.nwin;
+    hdr.nreg = paint.nreg;
+    for (i = 0; i < paint.nreg; ++i)
+    {
+        hdr.str_len += strlen(reg_name[i]) + 1;
+    }
+    for (i = 0; i < paint.nsam; ++i)
+    {
+        hdr.str_len += strlen(b->sid[i]) + 1;
+    }
+    hdr.win_off = ALIGN8(sizeof(paint_hdr_t) + hdr.str_len);
+    hdr.data_off = hdr.win_off + paint.nwin * sizeof(paint_win_t);
+
+    fp = fopen(outfile, "wb");
+    if (fp == NULL)
+    {
+        return -1;
+    }
+    if (fwrite(&hdr, sizeof(paint_hdr_t), 1, fp) != 1)
+    {
+        v = -1;
+    }
+    for (i = 0; i < paint.nreg && v == 0; ++i)
+    {
+        len = strlen(reg_name[i]) + 1;
+        if (fwrite(reg_name[i], 1, len, fp) != len)
+        {
+            v = -1;
+        }
+    }
+    for (i = 0; i < paint.nsam && v == 0; ++i)
+    {
+        len = strlen(b->sid[i]) + 1;
+        if (fwrite(b->sid[i], 1, len, fp) != len)
+        {
+            v = -1;
+        }
+    }
+    pad = hdr.win_off - (sizeof(paint_hdr_t) + hdr.str_len);
+    if (v == 0 && (fwrite(zero, 1, pad, fp) != pad ||
+                   fwrite(paint.win, sizeof(paint_win_t), paint.nwin, fp) != paint.nwin ||
+                   fwrite(paint.count, sizeof(uint32_t), ncount, fp) != ncount))
+    {
+        v = -1;
+    }
+
+    if (fclose(fp) != 0)
+    {
+        v = -1;
+    }
+
+    return v;
+}
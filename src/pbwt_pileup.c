@@ -10,6 +10,8 @@ int pbwt_pileup(const cmd_t *c)
     size_t qid = 0;
     khint_t k = 0;
     khash_t(integer) *sdict = NULL;
+    sidecar_t *idx = NULL;
+    out_t *fp = NULL;
     pbwt_t *b = NULL;
 
     if (c == NULL)
@@ -17,62 +19,95 @@ int pbwt_pileup(const cmd_t *c)
         return -1;
     }
 
-    /* Read in the pbwt file from disk */
-    b = pbwt_read(c->instub);
+    /* Read, uncompress and filter the pbwt data */
+    b = load_pbwt(c);
     if (b == NULL)
     {
-        fprintf(stderr, "pbwtutil [ERROR]: cannot read data from %s\n", c->instub);
         return -1;
     }
 
-    /* Uncompress the haplotype data */
-    v = pbwt_uncompress(b);
-    if (v < 0)
+    /* Resolve the query from the sidecar index when one is present */
+    idx = c->vcf_file ? NULL : sidecar_open(c->instub, b);
+    if (idx)
     {
-        fputs("pbwtutil [ERROR]: error uncompressing haplotype data\n", stderr);
-        return -1;
+        int64_t h = sidecar_lookup(idx, c->query);
+        if (h < 0)
+        {
+            fprintf(stderr, "pbwtutil [ERROR]: cannot find haplotype with id %s\n", c->query);
+            return -1;
+        }
+        qid = (size_t)h;
+        b->is_query[qid] = TRUE;
+        sidecar_close(idx);
     }
-
-    /* Make dictionary of sample identifiers and their indices */
-    sdict = pbwt_get_sampdict(b);
-    if (sdict == NULL)
+    else
     {
-        fputs("pbwtutil [ERROR]: cannot construct sample identifier dictionary\n", stderr);
-        return -1;
-    }
+        /* Make dictionary of sample identifiers and their indices */
+        sdict = pbwt_get_sampdict(b);
+        if (sdict == NULL)
+        {
+            fputs("pbwtutil [ERROR]: cannot construct sample identifier dictionary\n", stderr);
+            return -1;
+        }
+
+        /* Query user-input sample identifier */
+        k = kh_get(integer, sdict, c->query);
 
-    /* Query user-input sample identifier */
-    k = kh_get(integer, sdict, c->query);
+        /* If sample ID is present, mark haplotype as query */
+        if (kh_exist(sdict, k) && k != kh_end(sdict))
+        {
+            qid = kh_value(sdict, k);
+            b->is_query[qid] = TRUE;
+        }
+        else
+        {
+            fprintf(stderr, "pbwtutil [ERROR]: cannot find haplotype with id %s\n", c->query);
+            return -1;
+        }
+        kh_destroy(integer, sdict);
+    }
 
-    /* If sample ID is present, mark haplotype as query */
-    if (kh_exist(sdict, k) && k != kh_end(sdict))
+    /* Run-length tracks replace the fixed windows */
+    if (c->bedgraph || c->trackfile)
     {
-        qid = kh_value(sdict, k);
-        b->is_query[qid] = TRUE;
+        v = pileup_tracks(b, c);
+        pbwt_destroy(b);
+        return v;
     }
-    else
+
+    v = run_sweep(b, c, add_interval);
+    if (v < 0)
     {
-        fprintf(stderr, "pbwtutil [ERROR]: cannot find haplotype with id %s\n", c->query);
+        fputs("pbwtutil [ERROR]: error retrieving matches\n", stderr);
         return -1;
     }
-
-    v = pbwt_all_query_match(b, c->minlen, add_interval);
     if (b->intree == NULL)
     {
     	puts("Problem with reporting to interval tree");
     	return -1;
     }
 
+    fp = open_output(c, NULL);
+    if (fp == NULL)
+    {
+        return -1;
+    }
+
     for (i = 0; i < b->nsite - 10; i += 10)
     {
         size_t start_pos = i;
         size_t end_pos = i + 10;
         size_t c = 0;
         match_count(b, b->intree, &c, start_pos, end_pos);
-        printf("%zu\t%zu\t%zu\n", start_pos, end_pos, c);
+        out_printf(fp, "%zu\t%zu\t%zu\n", start_pos, end_pos, c);
+    }
+
+    if (out_close(fp) < 0)
+    {
+        fputs("pbwtutil [ERROR]: error writing output\n", stderr);
+        return -1;
     }
 
-	kh_destroy(integer, sdict);
     pbwt_destroy(b);
 
 	return 0;
@@ -15,22 +15,10 @@ int pbwt_summary(const cmd_t *c)
         return -1;
     }
 
-    /* Read PBWT file into memory */
-    b = pbwt_read(c->instub);
+    /* Read PBWT file into memory, noting the compressed size */
+    b = read_pbwt(c->instub, 1, &orig_size, c->nthreads);
     if (b == NULL)
     {
-        fprintf(stderr, "pbwtutil [ERROR]: cannot read data from %s\n", c->instub);
-        return -1;
-    }
-
-    /* Get size of compressed haplotype data */
-    orig_size = b->datasize;
-
-    /* Uncompress haplotype data */
-    v = pbwt_uncompress(b);
-    if (v < 0)
-    {
-        fputs("pbwtutil [ERROR]: error uncompressing haplotype data\n", stderr);
         return -1;
     }
 
@@ -2,12 +2,13 @@
 #include <stdlib.h>
 #include "pbwtutil.h"
 
-int pbwt_print(const pbwt_t *, const int);
-int print_sites(const pbwt_t *);
+int pbwt_print(out_t *, const pbwt_t *, const int);
+int print_sites(out_t *, const pbwt_t *);
 
 int pbwt_view(const cmd_t *c)
 {
     int v = 0;
+    out_t *fp = NULL;
     pbwt_t *b = NULL;
 
     if (c == NULL)
@@ -15,28 +16,37 @@ int pbwt_view(const cmd_t *c)
         return -1;
     }
 
+    /* Segment files are read by seeking through their index */
+    if (c->only_segments)
+    {
+        return seg_view(c);
+    }
+
+    /* Pileup tracks are range-queried the same way */
+    if (c->only_track)
+    {
+        return track_view(c);
+    }
+
     /* Read PBWT file data into memory */
-    b = pbwt_read(c->instub);
+    b = read_panel(c->instub, c->nthreads);
     if (b == NULL)
     {
-        fprintf(stderr, "pbwtutil [ERROR]: cannot read data from %s\n", c->instub);
         return -1;
     }
 
-    /* Uncompress haplotype data */
-    v = pbwt_uncompress(b);
-    if (v < 0)
+    /*ppa = pbwt_build(b); */
+
+    fp = open_output(c, NULL);
+    if (fp == NULL)
     {
-        fputs("pbwtutil [ERROR]: error uncompressing haplotype data\n", stderr);
         return -1;
     }
 
-    /*ppa = pbwt_build(b); */
-
     /* Print the PBWT data structure */
     if (c->only_sites)
     {
-        v = print_sites(b);
+        v = print_sites(fp, b);
         if (v < 0)
         {
             return -1;
@@ -44,20 +54,26 @@ int pbwt_view(const cmd_t *c)
     }
     else
     {
-        v = pbwt_print(b, c->nohaps);
+        v = pbwt_print(fp, b, c->nohaps);
         if (v < 0)
         {
             return -1;
         }
     }
 
+    if (out_close(fp) < 0)
+    {
+        fputs("pbwtutil [ERROR]: error writing output\n", stderr);
+        return -1;
+    }
+
     /* Clean up allocated memory */
     pbwt_destroy(b);
 
     return 0;
 }
 
-int pbwt_print(const pbwt_t *b, const int nohaps)
+int pbwt_print(out_t *fp, const pbwt_t *b, const int nohaps)
 {
     /* Check if pointer is NULL */
     if (b == NULL)
@@ -66,7 +82,6 @@ int pbwt_print(const pbwt_t *b, const int nohaps)
     }
 
     size_t i = 0;
-    size_t j = 0;
 
     for (i = 0; i < b->nsam; ++i)
     {
@@ -75,11 +90,11 @@ int pbwt_print(const pbwt_t *b, const int nohaps)
         {
             if (nohaps)
             {
-                printf("%.20s", b->sid[i]);
+                out_printf(fp, "%.20s", b->sid[i]);
             }
             else
             {
-                printf("%20.20s", b->sid[i]);
+                out_printf(fp, "%20.20s", b->sid[i]);
             }
         }
         else
@@ -93,36 +108,33 @@ int pbwt_print(const pbwt_t *b, const int nohaps)
         {
             if (nohaps)
             {
-                printf("\t%.30s", b->reg[i]);
+                out_printf(fp, "\t%.30s", b->reg[i]);
             }
             else
             {
-                printf("\t%30.30s", b->reg[i]);
+                out_printf(fp, "\t%30.30s", b->reg[i]);
             }
         }
 
         /* Print binary haplotype array for haplotype i */
         if (nohaps == 0)
         {
-            putchar('\t');
-            for (j = 0; j < b->nsite; ++j)
-            {
-                putchar((char)(b->data[TWODCORD(i, b->nsite, j)]));
-            }
+            out_write(fp, "\t", 1);
+            out_write(fp, b->data + TWODCORD(i, b->nsite, 0), b->nsite);
         }
-        putchar('\n');
+        out_write(fp, "\n", 1);
     }
 
     return 0;
 }
 
-int print_sites(const pbwt_t *b)
+int print_sites(out_t *fp, const pbwt_t *b)
 {
     size_t i = 0;
 
     for (i = 0; i < b->nsite; ++i)
     {
-        printf("%s\t%s\t%lf\n", b->chr[i], b->rsid[i], b->cm[i]);
+        out_printf(fp, "%s\t%s\t%lf\n", b->chr[i], b->rsid[i], b->cm[i]);
     }
 
     return 0;
@@ -1,13 +1,56 @@
 #ifndef PBWTUTIL_H
 #define PBWTUTIL_H
 
+#include <stdio.h>
+#include <stdint.h>
+#include <htslib/bgzf.h>
 #include <htslib/khash.h>
 #include <htslib/vcf.h>
 #include <pbwt.h>
 
 /* Define mode mappings */
 
-enum Mode {COANCESTRY, CONVERT, MATCH, PILEUP, SUMMARY, VIEW};
+enum Mode {BOUNDARIES, COANCESTRY, CONVERT, INDEX, INDEX_MATCHES, MATCH, PAINT, PILEUP, RECOMPRESS, SUMMARY, VIEW};
+
+enum Codec {CODEC_LEGACY, CODEC_ZLIB, CODEC_ZSTD};
+enum Engine {ENGINE_LIBPBWT, ENGINE_NATIVE, ENGINE_CHECK};
+
+
+/* Outputs the fused match accumulator can update */
+
+#define ACC_ADJLIST 0x01
+#define ACC_COUNT   0x02
+#define ACC_LENGTH  0x04
+#define ACC_REGION  0x08
+#define ACC_SEGMENT 0x10
+#define ACC_COMPONENT 0x20
+#define ACC_TOPK    0x40
+#define ACC_SAMPLE  0x80
+
+
+/* Register count of the per-sample partner sketch is 2^HLL_BITS */
+
+#define HLL_BITS 8
+
+
+/* Running match length per haplotype pair, keyed on both indices */
+
+KHASH_MAP_INIT_INT64(pairlen, double)
+
+
+/* Index into a packed lower-triangular symmetric matrix */
+
+#define PACKED(i, j) ((i) >= (j) ? (i) * ((i) + 1) / 2 + (j) : (j) * ((j) + 1) / 2 + (i))
+
+
+/* Round a binary file offset up to the next multiple of 8 bytes */
+
+#define ALIGN8(x) (((x) + 7) & ~(uint64_t)7)
+
+
+/* A PBWT file argument of "-" is standard input */
+
+#define is_stdin(f) ((f)[0] == '-' && (f)[1] == '\0')
 
 
 /* Define data structures */
@@ -22,47 +65,264 @@ typedef struct cmdl
     int match_all;
     int print_sites;
     int only_sites;
+    int only_segments;
+    int only_track;
+    int bedgraph;
+    int cm_coords;
     int count_only;
+    int out_length;
     int reg_count;
     int adjlist;
     int out_diploid;
     int set_match;
+    int nthreads;
+    int pca;
+    int components;
+    int top_k;
+    int per_sample;
+    int codec;
+    int engine;
     double minlen;
+    double min_maf;
+    double thin_cm;
+    double comp_min;
+    double merge_gap;
+    double bin_cm;
+    size_t nbins;
+    double *minlen_bins;
+    char *sites_file;
+    char *exclude_sites;
+    char *samples_file;
+    char *ref_file;
     char *popmap;
+    char *vcf_file;
+    char *save_file;
     char *outfile;
+    char *segfile;
+    char *trackfile;
+    char *export_fmt;
     char *query;
     char *instub;
     int (*mode_func)(const struct cmdl *);
 } cmd_t;
 
+/* Match callback and sweep signatures shared with libpbwt */
+typedef void (*match_report_t)(pbwt_t *, const size_t, const size_t, const size_t, const size_t);
+
+typedef int (*match_sweep_t)(pbwt_t *, const double, match_report_t);
+
+/* Text output stream, optionally BGZF-compressed */
+typedef struct out
+{
+    FILE *fp;
+    BGZF *bgzf;
+    char *buf;
+    size_t len;
+    int err;
+} out_t;
+
+/* Segment as buffered by the writer; on disk the first haplotype is
+ * implied by the index and only the rest is stored */
+typedef struct seg_rec
+{
+    uint32_t first;
+    uint32_t second;
+    uint32_t begin;
+    uint32_t end;
+} seg_rec_t;
+
+typedef struct seg_writer
+{
+    BGZF *fp;
+    FILE *idx;
+    size_t nsam;
+    size_t nrec;
+    int err;
+    seg_rec_t *buf;
+    int tmpfd;
+    char *tmpname;
+    size_t nrun;
+    uint64_t *run_len;
+} seg_writer_t;
+
+/* Read-only view of a mapped .pbwt.idx sidecar */
+typedef struct sidecar
+{
+    void *base;
+    size_t size;
+    uint64_t nsam;
+    uint64_t nreg;
+    uint64_t nslot;
+    const uint32_t *slot;
+    const uint64_t *sid_off;
+    const uint32_t *hap_reg;
+    const uint64_t *reg_off;
+    const uint64_t *reg_count;
+    const char *str;
+} sidecar_t;
+
+/* One retained match in a unit's top-K heap */
+typedef struct topk_rec
+{
+    uint32_t self;
+    uint32_t other;
+    uint32_t begin;
+    uint32_t end;
+    double length;
+} topk_rec_t;
+
+typedef struct accum
+{
+    int flags;
+    int shift;
+    size_t n;
+    size_t nrow;
+    size_t ncol;
+    size_t col0;
+    size_t ncell;
+    size_t nbin;
+    const double *bin_lo;
+    size_t *row_of;
+    size_t *count;
+    double *length;
+    size_t *parent;
+    size_t *csize;
+    double comp_min;
+    khash_t(pairlen) *pending;
+    size_t pending_cap;
+    size_t topk;
+    size_t topk_lo;
+    size_t topk_hi;
+    size_t *topk_n;
+    topk_rec_t *topk_heap;
+    double *samp_length;
+    size_t *samp_count;
+    uint8_t *hll;
+    match_report_t report;
+    seg_writer_t *seg;
+} accum_t;
+
 
 /* Function prototypes */
 
 extern cmd_t *parse_args(int argc, char *argv[]);
 
+extern int pbwt_boundaries(const cmd_t *);
+
 extern int pbwt_coancestry(const cmd_t *);
 
 extern int pbwt_convert_plink(const cmd_t *);
 
 extern int pbwt_convert_vcf(const cmd_t *);
 
+extern int pbwt_export_vcf(const cmd_t *);
+
+extern int pbwt_index(const cmd_t *);
+
+extern int pbwt_index_matches(const cmd_t *);
+
 extern int pbwt_match(const cmd_t *);
 
+extern int pbwt_paint(const cmd_t *);
+
 extern int pbwt_pileup(const cmd_t *);
 
 extern int pbwt_summary(const cmd_t *);
 
 extern int pbwt_view(const cmd_t *);
 
-extern void add_interval(pbwt_t *, const size_t, const size_t, const size_t, const size_t);
+extern pbwt_t *load_pbwt(const cmd_t *);
 
-extern  void report_adjlist(pbwt_t *, const size_t, const size_t, const size_t, const size_t);
+extern pbwt_t *load_pbwt_ref(const cmd_t *, size_t *);
 
-extern void report_adjlist_with_sites(pbwt_t *, const size_t, const size_t, const size_t, const size_t);
+extern pbwt_t *read_pbwt(const char *, const int, size_t *, const int);
+
+extern pbwt_t *read_panel(const char *, const int);
+
+extern int codec_id(const char *);
 
-extern void add_coancestry(pbwt_t *, const size_t, const size_t, const size_t, const size_t);
+extern int block_probe(const char *);
 
-extern void add_nmatch(pbwt_t *, const size_t, const size_t, const size_t, const size_t);
+extern int block_write(const char *, const pbwt_t *, const int, const int);
+
+extern pbwt_t *block_read(const char *, const int, size_t *, const int);
+
+extern int pbwt_recompress(const cmd_t *);
+
+extern khash_t(integer) *read_id_list(const char *);
+
+extern void free_id_list(khash_t(integer) *);
+
+extern pbwt_t *import_plink_bed(const char *, const int, const int);
+
+extern int sidecar_build(const pbwt_t *, const char *);
+
+extern sidecar_t *sidecar_open(const char *, const pbwt_t *);
+
+extern int64_t sidecar_lookup(const sidecar_t *, const char *);
+
+extern void sidecar_close(sidecar_t *);
+
+extern accum_t *accum_init(const pbwt_t *, const cmd_t *, const int, const size_t);
+
+extern int accum_destroy(accum_t *);
+
+extern match_sweep_t get_sweep(const cmd_t *);
+
+extern int engine_id(const char *);
+
+extern match_sweep_t engine_sweep(const cmd_t *, const int);
+
+extern size_t find_root(size_t *, size_t);
+
+extern int run_sweep(pbwt_t *, const cmd_t *, match_report_t);
+
+extern int sweep_matches(pbwt_t *, const cmd_t *, const double, match_report_t);
+
+extern void accumulate(pbwt_t *, const size_t, const size_t, const size_t, const size_t);
+
+extern void topk_add(accum_t *, const size_t, const size_t, const size_t, const size_t, const size_t,
+                     const double);
+
+extern void sample_add(accum_t *, const size_t, const size_t, const double);
+
+extern int print_per_sample(out_t *, const pbwt_t *, const accum_t *);
+
+extern int print_top_k(out_t *, const pbwt_t *, accum_t *, const size_t, const size_t, const int);
+
+extern int print_matrix(out_t *, const accum_t *, const int, const size_t, const int);
+
+extern int coancestry_pca(const pbwt_t *, const accum_t *, const cmd_t *);
+
+extern void set_adjlist_stream(out_t *);
+
+extern out_t *out_open(const char *, const int);
+
+extern out_t *open_output(const cmd_t *, const char *);
+
+extern int out_printf(out_t *, const char *, ...);
+
+extern int out_write(out_t *, const void *, const size_t);
+
+extern int out_close(out_t *);
+
+extern seg_writer_t *seg_open(const char *, const pbwt_t *);
+
+extern void seg_add(seg_writer_t *, const size_t, const size_t, const size_t, const size_t);
+
+extern int seg_close(seg_writer_t *);
+
+extern int seg_view(const cmd_t *);
+
+extern int pileup_tracks(pbwt_t *, const cmd_t *);
+
+extern int track_view(const cmd_t *);
+
+extern void add_interval(pbwt_t *, const size_t, const size_t, const size_t, const size_t);
+
+extern void report_adjlist(pbwt_t *, const size_t, const size_t, const size_t, const size_t);
+
+extern void report_adjlist_with_sites(pbwt_t *, const size_t, const size_t, const size_t, const size_t);
 
 extern void add_region(pbwt_t *, const size_t, const size_t, const size_t, const size_t);
 
@@ -0,0 +1,452 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "pbwtutil.h"
+
+/* Top eigenpairs of the double-centred coancestry matrix by randomized
+ * subspace iteration. The packed matrix is only ever touched through
+ * multithreaded products with a thin n x l block, so no copy of it is
+ * made; the small l x l projection is diagonalised with Jacobi. */
+
+#define PCA_OVERSAMPLE 10
+#define PCA_POWER_ITER 4
+#define JACOBI_SWEEPS 100
+#define JACOBI_TOL 1e-12
+
+typedef struct matvec_job
+{
+    const double *a;
+    const double *x;
+    double *y;
+    size_t n;
+    size_t l;
+    size_t lo;
+    size_t hi;
+} matvec_job_t;
+
+void *matvec_worker(void *);
+int sym_matmul(const double *, const double *, double *, const size_t, const size_t, const int);
+void centre_columns(double *, const size_t, const size_t);
+void orthonormalize(double *, const size_t, const size_t);
+void jacobi_eigen(double *, double *, double *, const size_t);
+double gaussian(uint64_t *);
+
+int coancestry_pca(const pbwt_t *b, const accum_t *acc, const cmd_t *c)
+{
+    size_t i = 0;
+    size_t j = 0;
+    size_t k = 0;
+    size_t r = 0;
+    size_t *order = NULL;
+    const size_t n = acc->n;
+    const size_t npc = (size_t)c->pca < n ? (size_t)c->pca : n;
+    const size_t l = npc + PCA_OVERSAMPLE < n ? npc + PCA_OVERSAMPLE : n;
+    uint64_t seed = 0x9e3779b97f4a7c15ULL;
+    double *q = NULL;
+    double *z = NULL;
+    double *t = NULL;
+    double *w = NULL;
+    double *v = NULL;
+    out_t *fp = NULL;
+
+    q = (double *)malloc(n * l * sizeof(double));
+    z = (double *)malloc(n * l * sizeof(double));
+    t = (double *)malloc(l * l * sizeof(double));
+    w = (double *)malloc(l * sizeof(double));
+    v = (double *)malloc(l * l * sizeof(double));
+    order = (size_t *)malloc(l * sizeof(size_t));
+    if (q == NULL || z == NULL || t == NULL || w == NULL || v == NULL || order == NULL)
+    {
+        fputs("pbwtutil [ERROR]: memory allocation failure\n", stderr);
+        return -1;
+    }
+
+    /* Fixed seed so repeated runs give the same loadings */
+    for (i = 0; i < n * l; ++i)
+    {
+        q[i] = gaussian(&seed);
+    }
+
+    /* Range finder: Q = orth((CAC)^p G) with C the centring projector */
+    for (r = 0; r <= PCA_POWER_ITER; ++r)
+    {
+        centre_columns(q, n, l);
+        if (sym_matmul(acc->length, q, z, n, l, c->nthreads) < 0)
+        {
+            return -1;
+        }
+        centre_columns(z, n, l);
+        orthonormalize(z, n, l);
+        memcpy(q, z, n * l * sizeof(double));
+    }
+
+    /* T = Q' CAC Q */
+    centre_columns(q, n, l);
+    if (sym_matmul(acc->length, q, z, n, l, c->nthreads) < 0)
+    {
+        return -1;
+    }
+    centre_columns(z, n, l);
+    for (j = 0; j < l; ++j)
+    {
+        for (k = 0; k < l; ++k)
+        {
+            double s = 0.0;
+            for (i = 0; i < n; ++i)
+            {
+                s += q[i*l+j] * z[i*l+k];
+            }
+            t[j*l+k] = s;
+        }
+    }
+    jacobi_eigen(t, w, v, l);
+
+    /* Largest eigenvalues first */
+    for (j = 0; j < l; ++j)
+    {
+        order[j] = j;
+    }
+    for (j = 1; j < l; ++j)
+    {
+        size_t o = order[j];
+        for (k = j; k > 0 && w[order[k-1]] < w[o]; --k)
+        {
+            order[k] = order[k-1];
+        }
+        order[k] = o;
+    }
+
+    fp = open_output(c, "eigenval");
+    if (fp == NULL)
+    {
+        return -1;
+    }
+    for (j = 0; j < npc; ++j)
+    {
+        out_printf(fp, "%.6g\n", w[order[j]]);
+    }
+    if (out_close(fp) < 0)
+    {
+        fputs("pbwtutil [ERROR]: error writing eigenvalues\n", stderr);
+        return -1;
+    }
+
+    /* Loadings are Q times the leading eigenvectors of T */
+    fp = open_output(c, "eigenvec");
+    if (fp == NULL)
+    {
+        return -1;
+    }
+    for (i = 0; i < n; ++i)
+    {
+        out_printf(fp, "%s", b->sid[i << acc->shift]);
+        for (j = 0; j < npc; ++j)
+        {
+            double s = 0.0;
+            for (k = 0; k < l; ++k)
+            {
+                s += q[i*l+k] * v[k*l+order[j]];
+            }
+            out_printf(fp, "\t%.6g", s);
+        }
+        out_printf(fp, "\n");
+    }
+    if (out_close(fp) < 0)
+    {
+        fputs("pbwtutil [ERROR]: error writing loadings\n", stderr);
+        return -1;
+    }
+
+    /* Clean up allocated memory */
+    free(q);
+    free(z);
+    free(t);
+    free(w);
+    free(v);
+    free(order);
+
+    return 0;
+}
+
+int sym_matmul(const double *a, const double *x, double *y, const size_t n, const size_t l,
+               const int nthreads)
+{
+    int i = 0;
+    int v = 0;
+    int nrun = 0;
+    int nt = nthreads > 1 ? nthreads : 1;
+    pthread_t *tid = NULL;
+    matvec_job_t *job = NULL;
+
+    tid = (pthread_t *)malloc(nt * sizeof(pthread_t));
+    job = (matvec_job_t *)malloc(nt * sizeof(matvec_job_t));
+    if (tid == NULL || job == NULL)
+    {
+        fputs("pbwtutil [ERROR]: memory allocation failure\n", stderr);
+        return -1;
+    }
+
+    /* Every row costs the same, so equal row ranges balance */
+    for (i = 0; i < nt; ++i)
+    {
+        job[i].a = a;
+        job[i].x = x;
+        job[i].y = y;
+        job[i].n = n;
+        job[i].l = l;
+        job[i].lo = n * i / nt;
+        job[i].hi = n * (i + 1) / nt;
+    }
+    for (i = 1; i < nt; ++i)
+    {
+        if (pthread_create(&tid[i], NULL, matvec_worker, &job[i]) != 0)
+        {
+            fputs("pbwtutil [ERROR]: cannot start worker thread\n", stderr);
+            v = -1;
+            break;
+        }
+    }
+    nrun = i;
+    if (v == 0)
+    {
+        matvec_worker(&job[0]);
+    }
+    for (i = 1; i < nrun; ++i)
+    {
+        pthread_join(tid[i], NULL);
+    }
+
+    free(tid);
+    free(job);
+
+    return v;
+}
+
+void *matvec_worker(void *arg)
+{
+    size_t i = 0;
+    size_t j = 0;
+    size_t k = 0;
+    const matvec_job_t *m = (const matvec_job_t *)arg;
+    const size_t l = m->l;
+
+    for (i = m->lo; i < m->hi; ++i)
+    {
+        double *restrict yi = m->y + i * l;
+        const double *restrict row = m->a + i * (i + 1) / 2;
+
+        memset(yi, 0, l * sizeof(double));
+
+        /* Lower triangle of row i is contiguous in packed storage */
+        for (j = 0; j <= i; ++j)
+        {
+            const double aij = row[j];
+            const double *restrict xj = m->x + j * l;
+            if (aij != 0.0)
+            {
+                for (k = 0; k < l; ++k)
+                {
+                    yi[k] += aij * xj[k];
+                }
+            }
+        }
+
+        /* The rest of the row is read down column i */
+        for (j = i + 1; j < m->n; ++j)
+        {
+            const double aij = m->a[j * (j + 1) / 2 + i];
+            const double *restrict xj = m->x + j * l;
+            if (aij != 0.0)
+            {
+                for (k = 0; k < l; ++k)
+                {
+                    yi[k] += aij * xj[k];
+                }
+            }
+        }
+    }
+
+    return NULL;
+}
+
+void centre_columns(double *x, const size_t n, const size_t l)
+{
+    size_t i = 0;
+    size_t k = 0;
+    double *mean = NULL;
+
+    mean = (double *)calloc(l, sizeof(double));
+    if (mean == NULL)
+    {
+        return;
+    }
+    for (i = 0; i < n; ++i)
+    {
+        for (k = 0; k < l; ++k)
+        {
+            mean[k] += x[i*l+k];
+        }
+    }
+    for (k = 0; k < l; ++k)
+    {
+        mean[k] /= n;
+    }
+    for (i = 0; i < n; ++i)
+    {
+        for (k = 0; k < l; ++k)
+        {
+            x[i*l+k] -= mean[k];
+        }
+    }
+    free(mean);
+}
+
+void orthonormalize(double *x, const size_t n, const size_t l)
+{
+    int pass = 0;
+    size_t i = 0;
+    size_t j = 0;
+    size_t k = 0;
+
+    /* Modified Gram-Schmidt, run twice for orthogonality to working
+     * precision */
+    for (pass = 0; pass < 2; ++pass)
+    {
+        for (k = 0; k < l; ++k)
+        {
+            double norm = 0.0;
+            double norm0 = 0.0;
+            for (i = 0; i < n; ++i)
+            {
+                norm0 += x[i*l+k] * x[i*l+k];
+            }
+            for (j = 0; j < k; ++j)
+            {
+                double d = 0.0;
+                for (i = 0; i < n; ++i)
+                {
+                    d += x[i*l+j] * x[i*l+k];
+                }
+                for (i = 0; i < n; ++i)
+                {
+                    x[i*l+k] -= d * x[i*l+j];
+                }
+            }
+            for (i = 0; i < n; ++i)
+            {
+                norm += x[i*l+k] * x[i*l+k];
+            }
+            /* A column that was all but cancelled is dependent on the
+             * earlier ones; rounding noise must not become a new direction */
+            norm = norm > 1e-20 * norm0 ? sqrt(norm) : 0.0;
+            for (i = 0; i < n; ++i)
+            {
+                x[i*l+k] = norm > 0.0 ? x[i*l+k] / norm : 0.0;
+            }
+        }
+    }
+}
+
+void jacobi_eigen(double *a, double *w, double *v, const size_t l)
+{
+    int sweep = 0;
+    size_t i = 0;
+    size_t p = 0;
+    size_t r = 0;
+    double tol = 0.0;
+
+    for (p = 0; p < l; ++p)
+    {
+        for (r = 0; r < l; ++r)
+        {
+            v[p*l+r] = p == r ? 1.0 : 0.0;
+            tol += a[p*l+r] * a[p*l+r];
+        }
+    }
+
+    /* Rotations keep the Frobenius norm, so stop once the off-diagonal
+     * part is negligible next to it whatever the matrix scale */
+    tol *= JACOBI_TOL * JACOBI_TOL;
+
+    /* Cyclic Jacobi rotations until the off-diagonal vanishes */
+    for (sweep = 0; sweep < JACOBI_SWEEPS; ++sweep)
+    {
+        double off = 0.0;
+        for (p = 0; p < l; ++p)
+        {
+            for (r = p + 1; r < l; ++r)
+            {
+                off += a[p*l+r] * a[p*l+r];
+            }
+        }
+        if (off <= tol)
+        {
+            break;
+        }
+
+        for (p = 0; p < l; ++p)
+        {
+            for (r = p + 1; r < l; ++r)
+            {
+                double theta, tn, cs, sn;
+                if (fabs(a[p*l+r]) < 1e-300)
+                {
+                    continue;
+                }
+                theta = (a[r*l+r] - a[p*l+p]) / (2.0 * a[p*l+r]);
+                tn = (theta >= 0.0 ? 1.0 : -1.0) / (fabs(theta) + sqrt(theta * theta + 1.0));
+                cs = 1.0 / sqrt(tn * tn + 1.0);
+                sn = tn * cs;
+                for (i = 0; i < l; ++i)
+                {
+                    double aip = a[i*l+p];
+                    double air = a[i*l+r];
+                    a[i*l+p] = cs * aip - sn * air;
+                    a[i*l+r] = sn * aip + cs * air;
+                }
+                for (i = 0; i < l; ++i)
+                {
+                    double api = a[p*l+i];
+                    double ari = a[r*l+i];
+                    a[p*l+i] = cs * api - sn * ari;
+                    a[r*l+i] = sn * api + cs * ari;
+                }
+                for (i = 0; i < l; ++i)
+                {
+                    double vip = v[i*l+p];
+                    double vir = v[i*l+r];
+                    v[i*l+p] = cs * vip - sn * vir;
+                    v[i*l+r] = sn * vip + cs * vir;
+                }
+            }
+        }
+    }
+
+    for (p = 0; p < l; ++p)
+    {
+        w[p] = a[p*l+p];
+    }
+}
+
+double gaussian(uint64_t *s)
+{
+    double u1 = 0.0;
+    double u2 = 0.0;
+
+    /* xorshift64* feeding Box-Muller */
+    do
+    {
+        *s ^= *s >> 12;
+        *s ^= *s << 25;
+        *s ^= *s >> 27;
+        u1 = (double)((*s * 0x2545f4914f6cdd1dULL) >> 11) / 9007199254740992.0;
+    } while (u1 <= 0.0);
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    u2 = (double)((*s * 0x2545f4914f6cdd1dULL) >> 11) / 9007199254740992.0;
+
+    return sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+}
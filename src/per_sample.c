@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "pbwtutil.h"
+
+/* Per-sample sharing summary in memory linear in the panel: each unit
+ * (haplotype, or individual with --diploid) keeps its total shared cM,
+ * its match count and a HyperLogLog sketch of the units it matched.
+ * The sketch has 2^HLL_BITS one-byte registers, giving a relative error
+ * of about 1.04 / sqrt(256) = 6.5%; below a few hundred partners the
+ * linear-counting correction makes it close to exact. */
+
+#define HLL_REGS (1 << HLL_BITS)
+
+uint64_t mix_unit(uint64_t);
+double hll_estimate(const uint8_t *);
+
+void sample_add(accum_t *a, const size_t unit, const size_t other, const double length)
+{
+    uint8_t *reg = a->hll + unit * HLL_REGS;
+    const uint64_t h = mix_unit((uint64_t)other);
+    const size_t r = (size_t)(h >> (64 - HLL_BITS));
+    const uint64_t rest = h << HLL_BITS | (uint64_t)1 << (HLL_BITS - 1);
+    const uint8_t rank = (uint8_t)(__builtin_clzll(rest) + 1);
+
+    a->samp_length[unit] += length;
+    a->samp_count[unit]++;
+
+    /* A unit matching itself is not a partner */
+    if (other != unit && rank > reg[r])
+    {
+        reg[r] = rank;
+    }
+}
+
+uint64_t mix_unit(uint64_t x)
+{
+    /* splitmix64 finaliser: consecutive indices land far apart */
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+
+    return x ^ (x >> 31);
+}
+
+double hll_estimate(const uint8_t *reg)
+{
+    size_t r = 0;
+    size_t zeros = 0;
+    double sum = 0.0;
+    double est = 0.0;
+    const double m = (double)HLL_REGS;
+
+    for (r = 0; r < HLL_REGS; ++r)
+    {
+        sum += ldexp(1.0, -(int)reg[r]);
+        zeros += reg[r] == 0;
+    }
+    est = 0.7213 / (1.0 + 1.079 / m) * m * m / sum;
+
+    /* Small cardinalities are counted from the empty registers */
+    if (est <= 2.5 * m && zeros > 0)
+    {
+        est = m * log(m / (double)zeros);
+    }
+
+    return est;
+}
+
+int print_per_sample(out_t *fp, const pbwt_t *b, const accum_t *a)
+{
+    int v = 0;
+    size_t u = 0;
+
+    for (u = 0; u < a->n; ++u)
+    {
+        /* In a dense block only rows were accumulated */
+        if (a->row_of && a->row_of[u] == 0)
+        {
+            continue;
+        }
+        if (out_printf(fp, "%s\t%1.4lf\t%zu\t%.0lf\n", b->sid[u << a->shift], a->samp_length[u],
+                       a->samp_count[u], hll_estimate(a->hll + u * HLL_REGS)) < 0)
+        {
+            v = -1;
+        }
+    }
+
+    return v;
+}
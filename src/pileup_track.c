@@ -0,0 +1,353 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pbwtutil.h"
+
+/* Pileup depth as run-length tracks. Depth is built with a difference
+ * array over sites, so each match costs two updates, and consecutive
+ * sites with the same depth on a chromosome collapse into one run.
+ * Coordinates are site ordinals on the chromosome (0-based, end
+ * exclusive) or cM, where a run ends at the next site's position so
+ * adjacent runs share a boundary; the last run of a chromosome ends at
+ * its last site. Runs of zero depth are omitted.
+ *
+ * Binary tracks hold a chromosome table and fixed-width records sorted
+ * by position, so a range is found by binary search. */
+
+#define TRACK_MAGIC "PBWTTRK2"
+
+typedef struct track_hdr
+{
+    char magic[8];
+    uint64_t nchr;
+    uint64_t nrec;
+    uint64_t rec_off;
+} track_hdr_t;
+
+typedef struct track_chr
+{
+    uint64_t first;
+    uint64_t nrec;
+} track_chr_t;
+
+typedef struct track_rec
+{
+    uint32_t begin;
+    uint32_t end;
+    uint32_t depth;
+    double cm_begin;
+    double cm_end;
+} track_rec_t;
+
+/* Depth differences for the current sweep */
+static int64_t *depth_diff = NULL;
+
+void add_depth(pbwt_t *, const size_t, const size_t, const size_t, const size_t);
+int write_track(const char *, const pbwt_t *, const track_rec_t *, const size_t, const size_t *,
+                const track_chr_t *, const size_t);
+int parse_region(const char *, char **, uint32_t *, uint32_t *);
+
+int pileup_tracks(pbwt_t *b, const cmd_t *c)
+{
+    int v = 0;
+    size_t j = 0;
+    size_t ord = 0;
+    size_t run = 0;
+    size_t nrec = 0;
+    size_t nchr = 0;
+    int64_t depth = 0;
+    size_t *chr_site = NULL;
+    track_chr_t *chr = NULL;
+    track_rec_t *rec = NULL;
+    out_t *fp = NULL;
+
+    depth_diff = (int64_t *)calloc(b->nsite + 1, sizeof(int64_t));
+    rec = (track_rec_t *)calloc(b->nsite, sizeof(track_rec_t));
+    chr = (track_chr_t *)malloc(b->nsite * sizeof(track_chr_t));
+    chr_site = (size_t *)malloc(b->nsite * sizeof(size_t));
+    if (depth_diff == NULL || rec == NULL || chr == NULL || chr_site == NULL)
+    {
+        fputs("pbwtutil [ERROR]: memory allocation failure\n", stderr);
+        return -1;
+    }
+
+    v = run_sweep(b, c, add_depth);
+    if (v < 0)
+    {
+        fputs("pbwtutil [ERROR]: error retrieving matches\n", stderr);
+        return -1;
+    }
+
+    /* Prefix sums give depth per site; a run closes when depth or
+     * chromosome changes */
+    for (j = 0; j <= b->nsite; ++j)
+    {
+        const int new_chr = j == b->nsite || j == 0 || strcmp(b->chr[j], b->chr[j-1]) != 0;
+        const int64_t d = j < b->nsite ? depth + depth_diff[j] : -1;
+
+        if (j > 0 && (new_chr || d != depth))
+        {
+            if (depth > 0)
+            {
+                rec[nrec].begin = (uint32_t)(ord - (j - run));
+                rec[nrec].end = (uint32_t)ord;
+                rec[nrec].depth = (uint32_t)depth;
+                rec[nrec].cm_begin = b->cm[run];
+                rec[nrec].cm_end = new_chr ? b->cm[j-1] : b->cm[j];
+                ++nrec;
+            }
+            run = j;
+        }
+        if (j == b->nsite)
+        {
+            break;
+        }
+        if (new_chr)
+        {
+            if (nchr > 0)
+            {
+                chr[nchr-1].nrec = nrec - chr[nchr-1].first;
+            }
+            chr[nchr].first = nrec;
+            chr_site[nchr] = j;
+            ++nchr;
+            ord = 0;
+        }
+        depth = d;
+        ++ord;
+    }
+    if (nchr > 0)
+    {
+        chr[nchr-1].nrec = nrec - chr[nchr-1].first;
+    }
+    free(depth_diff);
+    depth_diff = NULL;
+
+    if (c->bedgraph)
+    {
+        size_t k = 0;
+        size_t r = 0;
+
+        fp = open_output(c, NULL);
+        if (fp == NULL)
+        {
+            return -1;
+        }
+        for (k = 0; k < nchr; ++k)
+        {
+            const char *name = b->chr[chr_site[k]];
+            for (r = chr[k].first; r < chr[k].first + chr[k].nrec; ++r)
+            {
+                if (c->cm_coords)
+                {
+                    out_printf(fp, "%s\t%.6f\t%.6f\t%u\n", name, rec[r].cm_begin,
+                               rec[r].cm_end, rec[r].depth);
+                }
+                else
+                {
+                    out_printf(fp, "%s\t%u\t%u\t%u\n", name, rec[r].begin, rec[r].end, rec[r].depth);
+                }
+            }
+        }
+        if (out_close(fp) < 0)
+        {
+            fputs("pbwtutil [ERROR]: error writing bedGraph output\n", stderr);
+            return -1;
+        }
+    }
+
+    if (c->trackfile)
+    {
+        v = write_track(c->trackfile, b, rec, nrec, chr_site, chr, nchr);
+        if (v < 0)
+        {
+            fprintf(stderr, "pbwtutil [ERROR]: error writing track %s\n", c->trackfile);
+            return -1;
+        }
+    }
+
+    /* Clean up allocated memory */
+    free(rec);
+    free(chr);
+    free(chr_site);
+
+    return 0;
+}
+
+void add_depth(pbwt_t *b, const size_t first, const size_t second, const size_t begin, const size_t end)
+{
+    depth_diff[begin]++;
+    depth_diff[end+1]--;
+}
+
+int write_track(const char *outfile, const pbwt_t *b, const track_rec_t *rec, const size_t nrec,
+                const size_t *chr_site, const track_chr_t *chr, const size_t nchr)
+{
+    size_t k = 0;
+    track_hdr_t hdr;
+    FILE *fp = NULL;
+
+    fp = fopen(outfile, "wb");
+    if (fp == NULL)
+    {
+        return -1;
+    }
+
+    memset(&hdr, 0, sizeof(track_hdr_t));
+    memcpy(hdr.magic, TRACK_MAGIC, 8);
+    hdr.nchr = nchr;
+    hdr.nrec = nrec;
+    hdr.rec_off = sizeof(track_hdr_t) + nchr * sizeof(track_chr_t);
+    for (k = 0; k < nchr; ++k)
+    {
+        hdr.rec_off += strlen(b->chr[chr_site[k]]) + 1;
+    }
+
+    fwrite(&hdr, sizeof(track_hdr_t), 1, fp);
+    fwrite(chr, sizeof(track_chr_t), nchr, fp);
+    for (k = 0; k < nchr; ++k)
+    {
+        fwrite(b->chr[chr_site[k]], 1, strlen(b->chr[chr_site[k]]) + 1, fp);
+    }
+    fwrite(rec, sizeof(track_rec_t), nrec, fp);
+
+    return fclose(fp) == 0 ? 0 : -1;
+}
+
+int track_view(const cmd_t *c)
+{
+    size_t k = 0;
+    size_t len = 0;
+    uint32_t from = 0;
+    uint32_t to = UINT32_MAX;
+    uint64_t lo = 0;
+    uint64_t hi = 0;
+    char name[1024];
+    char *region = NULL;
+    track_hdr_t hdr;
+    track_chr_t ent;
+    track_rec_t r;
+    out_t *out = NULL;
+    FILE *fp = NULL;
+
+    if (parse_region(c->query, &region, &from, &to) < 0)
+    {
+        fprintf(stderr, "pbwtutil [ERROR]: cannot parse region %s\n", c->query);
+        return -1;
+    }
+
+    fp = fopen(c->instub, "rb");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "pbwtutil [ERROR]: cannot read data from %s\n", c->instub);
+        return -1;
+    }
+    if (fread(&hdr, sizeof(track_hdr_t), 1, fp) != 1 || memcmp(hdr.magic, TRACK_MAGIC, 8) != 0)
+    {
+        fprintf(stderr, "pbwtutil [ERROR]: %s is not a pileup track\n", c->instub);
+        return -1;
+    }
+
+    /* Chromosome names follow the table in the same order */
+    if (fseek(fp, (long)(sizeof(track_hdr_t) + hdr.nchr * sizeof(track_chr_t)), SEEK_SET) != 0)
+    {
+        return -1;
+    }
+    for (k = 0; k < hdr.nchr; ++k)
+    {
+        int ch = 0;
+        len = 0;
+        while ((ch = fgetc(fp)) > 0 && len < sizeof(name) - 1)
+        {
+            name[len++] = (char)ch;
+        }
+        name[len] = '\0';
+        if (strcmp(name, region) == 0)
+        {
+            break;
+        }
+    }
+    if (k == hdr.nchr)
+    {
+        fprintf(stderr, "pbwtutil [ERROR]: chromosome %s not in track\n", region);
+        return -1;
+    }
+    fseek(fp, (long)(sizeof(track_hdr_t) + k * sizeof(track_chr_t)), SEEK_SET);
+    if (fread(&ent, sizeof(track_chr_t), 1, fp) != 1)
+    {
+        return -1;
+    }
+
+    /* First run ending after the start of the range */
+    lo = ent.first;
+    hi = ent.first + ent.nrec;
+    while (lo < hi)
+    {
+        uint64_t mid = lo + (hi - lo) / 2;
+        fseek(fp, (long)(hdr.rec_off + mid * sizeof(track_rec_t)), SEEK_SET);
+        if (fread(&r, sizeof(track_rec_t), 1, fp) != 1)
+        {
+            return -1;
+        }
+        if (r.end <= from)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    out = open_output(c, NULL);
+    if (out == NULL)
+    {
+        return -1;
+    }
+    fseek(fp, (long)(hdr.rec_off + lo * sizeof(track_rec_t)), SEEK_SET);
+    for (; lo < ent.first + ent.nrec; ++lo)
+    {
+        if (fread(&r, sizeof(track_rec_t), 1, fp) != 1 || r.begin >= to)
+        {
+            break;
+        }
+        out_printf(out, "%s\t%u\t%u\t%u\n", region, r.begin, r.end, r.depth);
+    }
+    if (out_close(out) < 0)
+    {
+        fputs("pbwtutil [ERROR]: error writing output\n", stderr);
+        fclose(fp);
+        free(region);
+        return -1;
+    }
+
+    /* Clean up allocated memory */
+    fclose(fp);
+    free(region);
+
+    return 0;
+}
+
+int parse_region(const char *str, char **chr, uint32_t *from, uint32_t *to)
+{
+    unsigned long a = 0;
+    unsigned long z = 0;
+    const char *colon = NULL;
+
+    /* Either CHR or CHR:FROM-TO in site ordinals */
+    colon = strrchr(str, ':');
+    if (colon == NULL)
+    {
+        *chr = strdup(str);
+        return 0;
+    }
+    if (sscanf(colon + 1, "%lu-%lu", &a, &z) != 2 || z <= a)
+    {
+        return -1;
+    }
+    *chr = strndup(str, (size_t)(colon - str));
+    *from = (uint32_t)a;
+    *to = (uint32_t)z;
+
+    return 0;
+}
@@ -0,0 +1,540 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "pbwtutil.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+/* PLINK .bed files are SNP-major: each SNP holds ceil(nind/4) bytes with
+ * two bits per individual (00 hom A1, 01 missing, 10 het, 11 hom A2).
+ * Haplotype rows are written as '1' where the haplotype carries A1, with
+ * heterozygotes placed on the first haplotype and missing calls as '0'.
+ * Blocks of SNPs are read with pread and transposed in 16-SNP tiles by
+ * a kernel picked at runtime for the host CPU. */
+
+#define BED_HEADER 3
+#define BED_BLOCK_BYTES (16 << 20)
+
+typedef void (*bed_kernel_t)(const unsigned char *, const size_t, const size_t, const size_t,
+                             unsigned char *, const size_t, const size_t);
+
+typedef struct bed_job
+{
+    int fd;
+    size_t bps;
+    size_t nind;
+    size_t first;
+    size_t last;
+    size_t block;
+    bed_kernel_t kernel;
+    pbwt_t *b;
+    int status;
+} bed_job_t;
+
+int read_fam(pbwt_t *, const char *, const int);
+int read_bim(pbwt_t *, const char *);
+size_t count_lines(const char *);
+void *bed_worker(void *);
+bed_kernel_t select_kernel(void);
+void transpose_scalar(const unsigned char *, const size_t, const size_t, const size_t,
+                      unsigned char *, const size_t, const size_t);
+void transpose_range(const unsigned char *, const size_t, const size_t, const size_t,
+                     const size_t, const size_t, unsigned char *, const size_t, const size_t);
+
+pbwt_t *import_plink_bed(const char *instub, const int has_reg, const int nthreads)
+{
+    int fd = 0;
+    int t = 0;
+    int nt = 0;
+    int nrun = 0;
+    int v = 0;
+    size_t nind = 0;
+    size_t nsnp = 0;
+    size_t per = 0;
+    size_t block = 0;
+    unsigned char magic[BED_HEADER];
+    char *infile = NULL;
+    bed_job_t *jobs = NULL;
+    pthread_t *tid = NULL;
+    pbwt_t *b = NULL;
+
+    infile = (char *)malloc(strlen(instub) + 5);
+    if (infile == NULL)
+    {
+        return NULL;
+    }
+
+    /* Dimensions come from the .fam and .bim files */
+    sprintf(infile, "%s.fam", instub);
+    nind = count_lines(infile);
+    sprintf(infile, "%s.bim", instub);
+    nsnp = count_lines(infile);
+    if (nind == 0 || nsnp == 0)
+    {
+        fprintf(stderr, "pbwtutil [ERROR]: cannot read .fam/.bim files for %s\n", instub);
+        free(infile);
+        return NULL;
+    }
+
+    b = pbwt_init(nsnp, 2 * nind);
+    if (b == NULL)
+    {
+        free(infile);
+        return NULL;
+    }
+
+    if (read_fam(b, instub, has_reg) < 0 || read_bim(b, instub) < 0)
+    {
+        free(infile);
+        pbwt_destroy(b);
+        return NULL;
+    }
+
+    /* Check the SNP-major .bed magic number */
+    sprintf(infile, "%s.bed", instub);
+    fd = open(infile, O_RDONLY);
+    free(infile);
+    if (fd < 0 || read(fd, magic, BED_HEADER) != BED_HEADER ||
+        magic[0] != 0x6c || magic[1] != 0x1b || magic[2] != 0x01)
+    {
+        fputs("pbwtutil [ERROR]: input is not a SNP-major PLINK .bed file\n", stderr);
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        pbwt_destroy(b);
+        return NULL;
+    }
+
+    /* Split whole 16-SNP tiles across threads */
+    nt = nthreads > 1 ? nthreads : 1;
+    jobs = (bed_job_t *)calloc(nt, sizeof(bed_job_t));
+    tid = (pthread_t *)malloc(nt * sizeof(pthread_t));
+    if (jobs == NULL || tid == NULL)
+    {
+        close(fd);
+        pbwt_destroy(b);
+        return NULL;
+    }
+    per = ((nsnp + nt - 1) / nt + 15) & ~(size_t)15;
+    block = (BED_BLOCK_BYTES / ((nind + 3) / 4)) & ~(size_t)15;
+    if (block < 16)
+    {
+        block = 16;
+    }
+
+    for (t = 0; t < nt; ++t)
+    {
+        jobs[t].fd = fd;
+        jobs[t].bps = (nind + 3) / 4;
+        jobs[t].nind = nind;
+        jobs[t].first = t * per < nsnp ? t * per : nsnp;
+        jobs[t].last = (t + 1) * per < nsnp ? (t + 1) * per : nsnp;
+        jobs[t].block = block;
+        jobs[t].kernel = select_kernel();
+        jobs[t].b = b;
+        if (pthread_create(&tid[t], NULL, bed_worker, &jobs[t]) != 0)
+        {
+            fputs("pbwtutil [ERROR]: cannot start worker thread\n", stderr);
+            v = -1;
+            break;
+        }
+    }
+    nrun = t;
+
+    /* Every started worker writes into b, so all are joined before it goes */
+    for (t = 0; t < nrun; ++t)
+    {
+        pthread_join(tid[t], NULL);
+        if (jobs[t].status < 0 && v == 0)
+        {
+            fputs("pbwtutil [ERROR]: error reading PLINK .bed file\n", stderr);
+            v = -1;
+        }
+    }
+    if (v < 0)
+    {
+        pbwt_destroy(b);
+        b = NULL;
+    }
+
+    /* Clean up allocated memory */
+    close(fd);
+    free(jobs);
+    free(tid);
+
+    return b;
+}
+
+void *bed_worker(void *arg)
+{
+    size_t s = 0;
+    size_t n = 0;
+    unsigned char *buf = NULL;
+    bed_job_t *job = (bed_job_t *)arg;
+
+    buf = (unsigned char *)malloc(job->block * job->bps);
+    if (buf == NULL)
+    {
+        job->status = -1;
+        return NULL;
+    }
+
+    for (s = job->first; s < job->last; s += n)
+    {
+        n = job->last - s < job->block ? job->last - s : job->block;
+        if (pread(job->fd, buf, n * job->bps, BED_HEADER + (off_t)(s * job->bps)) != (ssize_t)(n * job->bps))
+        {
+            job->status = -1;
+            break;
+        }
+        (*job->kernel)(buf, job->bps, n, job->nind, job->b->data, job->b->nsite, s);
+    }
+
+    free(buf);
+
+    return NULL;
+}
+
+void transpose_range(const unsigned char *bed, const size_t bps, const size_t s0, const size_t s1,
+                     const size_t i0, const size_t i1, unsigned char *data, const size_t nsite, const size_t j0)
+{
+    size_t s = 0;
+    size_t i = 0;
+
+    for (i = i0; i < i1; ++i)
+    {
+        unsigned char *h0 = data + TWODCORD(2 * i, nsite, j0);
+        unsigned char *h1 = data + TWODCORD(2 * i + 1, nsite, j0);
+        for (s = s0; s < s1; ++s)
+        {
+            unsigned char code = (bed[s * bps + i / 4] >> (2 * (i % 4))) & 3;
+            h0[s] = '0' + !(code & 1);
+            h1[s] = '0' + (code == 0);
+        }
+    }
+}
+
+void transpose_scalar(const unsigned char *bed, const size_t bps, const size_t nsnp, const size_t nind,
+                      unsigned char *data, const size_t nsite, const size_t j0)
+{
+    size_t s = 0;
+
+    /* Work in 16-SNP strips so each haplotype row is written contiguously */
+    for (s = 0; s < nsnp; s += 16)
+    {
+        transpose_range(bed, bps, s, s + 16 < nsnp ? s + 16 : nsnp, 0, nind, data, nsite, j0);
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+
+/* In-register 16x16 byte transpose: four rounds of pairing row k with
+ * row k+8 leave column k in register k */
+#define TRANSPOSE16(T, x, UNPACKLO, UNPACKHI)                      \
+    do                                                             \
+    {                                                              \
+        T y_[16];                                                  \
+        int st_ = 0;                                               \
+        int k_ = 0;                                                \
+        for (st_ = 0; st_ < 4; ++st_)                              \
+        {                                                          \
+            for (k_ = 0; k_ < 8; ++k_)                             \
+            {                                                      \
+                y_[2 * k_] = UNPACKLO(x[k_], x[k_ + 8]);           \
+                y_[2 * k_ + 1] = UNPACKHI(x[k_], x[k_ + 8]);       \
+            }                                                      \
+            memcpy(x, y_, sizeof(y_));                             \
+        }                                                          \
+    } while (0)
+
+__attribute__((target("ssse3")))
+void transpose_ssse3(const unsigned char *bed, const size_t bps, const size_t nsnp, const size_t nind,
+                     unsigned char *data, const size_t nsite, const size_t j0)
+{
+    size_t s = 0;
+    size_t i = 0;
+    int k = 0;
+    uint32_t w = 0;
+    const size_t ns = nsnp & ~(size_t)15;
+    const size_t ni = nind & ~(size_t)15;
+    const __m128i expand = _mm_setr_epi8(0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3);
+    const __m128i lowbit = _mm_set1_epi32(0x40100401);
+    const __m128i highbit = _mm_set1_epi32((int)0x80200802);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    const __m128i ascii = _mm_set1_epi8('0');
+    __m128i h0[16];
+    __m128i h1[16];
+
+    for (s = 0; s < ns; s += 16)
+    {
+        for (i = 0; i < ni; i += 16)
+        {
+            /* Expand four .bed bytes into one allele byte per individual */
+            for (k = 0; k < 16; ++k)
+            {
+                memcpy(&w, bed + (s + k) * bps + i / 4, sizeof(uint32_t));
+                __m128i rep = _mm_shuffle_epi8(_mm_cvtsi32_si128((int)w), expand);
+                __m128i l = _mm_cmpeq_epi8(_mm_and_si128(rep, lowbit), zero);
+                __m128i h = _mm_cmpeq_epi8(_mm_and_si128(rep, highbit), zero);
+                h0[k] = _mm_add_epi8(ascii, _mm_and_si128(l, one));
+                h1[k] = _mm_add_epi8(ascii, _mm_and_si128(_mm_and_si128(l, h), one));
+            }
+
+            TRANSPOSE16(__m128i, h0, _mm_unpacklo_epi8, _mm_unpackhi_epi8);
+            TRANSPOSE16(__m128i, h1, _mm_unpacklo_epi8, _mm_unpackhi_epi8);
+
+            for (k = 0; k < 16; ++k)
+            {
+                _mm_storeu_si128((__m128i *)(data + TWODCORD(2 * (i + k), nsite, j0 + s)), h0[k]);
+                _mm_storeu_si128((__m128i *)(data + TWODCORD(2 * (i + k) + 1, nsite, j0 + s)), h1[k]);
+            }
+        }
+    }
+
+    /* Ragged edges */
+    transpose_range(bed, bps, 0, ns, ni, nind, data, nsite, j0);
+    transpose_range(bed, bps, ns, nsnp, 0, nind, data, nsite, j0);
+}
+
+__attribute__((target("avx2")))
+void transpose_avx2(const unsigned char *bed, const size_t bps, const size_t nsnp, const size_t nind,
+                    unsigned char *data, const size_t nsite, const size_t j0)
+{
+    size_t s = 0;
+    size_t i = 0;
+    int k = 0;
+    uint32_t w0 = 0;
+    uint32_t w1 = 0;
+    const size_t ns = nsnp & ~(size_t)15;
+    const size_t ni = nind & ~(size_t)31;
+    const __m256i expand = _mm256_setr_epi8(0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                            0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3);
+    const __m256i lowbit = _mm256_set1_epi32(0x40100401);
+    const __m256i highbit = _mm256_set1_epi32((int)0x80200802);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi8(1);
+    const __m256i ascii = _mm256_set1_epi8('0');
+    __m256i h0[16];
+    __m256i h1[16];
+
+    /* Each 128-bit lane handles its own 16 individuals */
+    for (s = 0; s < ns; s += 16)
+    {
+        for (i = 0; i < ni; i += 32)
+        {
+            for (k = 0; k < 16; ++k)
+            {
+                const unsigned char *row = bed + (s + k) * bps + i / 4;
+                memcpy(&w0, row, sizeof(uint32_t));
+                memcpy(&w1, row + 4, sizeof(uint32_t));
+                __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_cvtsi32_si128((int)w0)),
+                                                    _mm_cvtsi32_si128((int)w1), 1);
+                __m256i rep = _mm256_shuffle_epi8(v, expand);
+                __m256i l = _mm256_cmpeq_epi8(_mm256_and_si256(rep, lowbit), zero);
+                __m256i h = _mm256_cmpeq_epi8(_mm256_and_si256(rep, highbit), zero);
+                h0[k] = _mm256_add_epi8(ascii, _mm256_and_si256(l, one));
+                h1[k] = _mm256_add_epi8(ascii, _mm256_and_si256(_mm256_and_si256(l, h), one));
+            }
+
+            TRANSPOSE16(__m256i, h0, _mm256_unpacklo_epi8, _mm256_unpackhi_epi8);
+            TRANSPOSE16(__m256i, h1, _mm256_unpacklo_epi8, _mm256_unpackhi_epi8);
+
+            for (k = 0; k < 16; ++k)
+            {
+                _mm_storeu_si128((__m128i *)(data + TWODCORD(2 * (i + k), nsite, j0 + s)),
+                                 _mm256_castsi256_si128(h0[k]));
+                _mm_storeu_si128((__m128i *)(data + TWODCORD(2 * (i + k) + 1, nsite, j0 + s)),
+                                 _mm256_castsi256_si128(h1[k]));
+                _mm_storeu_si128((__m128i *)(data + TWODCORD(2 * (i + 16 + k), nsite, j0 + s)),
+                                 _mm256_extracti128_si256(h0[k], 1));
+                _mm_storeu_si128((__m128i *)(data + TWODCORD(2 * (i + 16 + k) + 1, nsite, j0 + s)),
+                                 _mm256_extracti128_si256(h1[k], 1));
+            }
+        }
+    }
+
+    /* Ragged edges */
+    transpose_range(bed, bps, 0, ns, ni, nind, data, nsite, j0);
+    transpose_range(bed, bps, ns, nsnp, 0, nind, data, nsite, j0);
+}
+
+#endif
+
+bed_kernel_t select_kernel(void)
+{
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return transpose_avx2;
+    }
+    if (__builtin_cpu_supports("ssse3"))
+    {
+        return transpose_ssse3;
+    }
+#endif
+    return transpose_scalar;
+}
+
+int read_fam(pbwt_t *b, const char *instub, const int has_reg)
+{
+    size_t i = 0;
+    char fid[1024];
+    char iid[1024];
+    char line[4096];
+    char *infile = NULL;
+    FILE *fin = NULL;
+    FILE *freg = NULL;
+
+    infile = (char *)malloc(strlen(instub) + 5);
+    if (infile == NULL)
+    {
+        return -1;
+    }
+
+    sprintf(infile, "%s.fam", instub);
+    fin = fopen(infile, "r");
+    if (has_reg)
+    {
+        sprintf(infile, "%s.reg", instub);
+        freg = fopen(infile, "r");
+        if (freg == NULL)
+        {
+            fprintf(stderr, "pbwtutil [ERROR]: cannot open %s\n", infile);
+        }
+    }
+    free(infile);
+    if (fin == NULL || (has_reg && freg == NULL))
+    {
+        if (fin)
+        {
+            fclose(fin);
+        }
+        if (freg)
+        {
+            fclose(freg);
+        }
+        return -1;
+    }
+
+    /* Both haplotypes of an individual share its identifier; the region
+     * is the last field of the matching .reg line or else the family ID */
+    for (i = 0; i < b->nsam / 2; ++i)
+    {
+        if (fscanf(fin, "%1023s %1023s%*[^\n]", fid, iid) != 2)
+        {
+            fclose(fin);
+            if (freg)
+            {
+                fclose(freg);
+            }
+            return -1;
+        }
+        if (freg)
+        {
+            char *tok = NULL;
+            char *last = NULL;
+            if (fgets(line, sizeof(line), freg) == NULL)
+            {
+                fputs("pbwtutil [ERROR]: .reg file is shorter than .fam file\n", stderr);
+                fclose(fin);
+                fclose(freg);
+                return -1;
+            }
+            for (tok = strtok(line, " \t\r\n"); tok; tok = strtok(NULL, " \t\r\n"))
+            {
+                last = tok;
+            }
+            strcpy(fid, last ? last : "NA");
+        }
+        b->sid[2 * i] = strdup(iid);
+        b->sid[2 * i + 1] = strdup(iid);
+        b->reg[2 * i] = strdup(fid);
+        b->reg[2 * i + 1] = strdup(fid);
+    }
+
+    fclose(fin);
+    if (freg)
+    {
+        fclose(freg);
+    }
+
+    return 0;
+}
+
+int read_bim(pbwt_t *b, const char *instub)
+{
+    size_t j = 0;
+    double cm = 0.0;
+    char chr[256];
+    char rsid[1024];
+    char *infile = NULL;
+    FILE *fin = NULL;
+
+    infile = (char *)malloc(strlen(instub) + 5);
+    if (infile == NULL)
+    {
+        return -1;
+    }
+    sprintf(infile, "%s.bim", instub);
+    fin = fopen(infile, "r");
+    free(infile);
+    if (fin == NULL)
+    {
+        return -1;
+    }
+
+    for (j = 0; j < b->nsite; ++j)
+    {
+        if (fscanf(fin, "%255s %1023s %lf%*[^\n]", chr, rsid, &cm) != 3)
+        {
+            fclose(fin);
+            return -1;
+        }
+        b->chr[j] = strdup(chr);
+        b->rsid[j] = strdup(rsid);
+        b->cm[j] = cm;
+    }
+
+    fclose(fin);
+
+    return 0;
+}
+
+size_t count_lines(const char *infile)
+{
+    int ch = 0;
+    int last = '\n';
+    size_t n = 0;
+    FILE *fin = NULL;
+
+    fin = fopen(infile, "r");
+    if (fin == NULL)
+    {
+        return 0;
+    }
+    while ((ch = getc(fin)) != EOF)
+    {
+        if (ch == '\n')
+        {
+            ++n;
+        }
+        last = ch;
+    }
+    if (last != '\n')
+    {
+        ++n;
+    }
+    fclose(fin);
+
+    return n;
+}
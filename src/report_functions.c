@@ -3,69 +3,29 @@
 #include <string.h>
 #include "pbwtutil.h"
 
-void report_adjlist(pbwt_t *b, const size_t first, const size_t second, const size_t begin, const size_t end)
-{
-    printf("%s\t%s\t%1.4lf\t%s\t%s\n", b->sid[first], b->sid[second],
-           b->cm[end] - b->cm[begin], b->reg[first], b->reg[second]);
-}
+/* Destination of adjacency list reports */
+static out_t *adjout = NULL;
 
-void report_adjlist_with_sites(pbwt_t *b, const size_t first, const size_t second, const size_t begin, const size_t end)
+void set_adjlist_stream(out_t *o)
 {
-    printf("%s\t%s\t%1.4lf\t%s\t%s\t%zu\t%zu\n", b->sid[first], b->sid[second],
-            b->cm[end] - b->cm[begin], b->reg[first], b->reg[second], begin, end);
+    adjout = o;
 }
 
-void add_interval(pbwt_t *b, const size_t first, const size_t second, const size_t begin, const size_t end)
+void report_adjlist(pbwt_t *b, const size_t first, const size_t second, const size_t begin, const size_t end)
 {
-    b->intree = match_insert(b->intree, first, second, begin, end);
+    out_printf(adjout, "%s\t%s\t%1.4lf\t%s\t%s\n", b->sid[first], b->sid[second],
+               b->cm[end] - b->cm[begin], b->reg[first], b->reg[second]);
 }
 
-
-void add_nmatch(pbwt_t *b, const size_t first, const size_t second, const size_t begin, const size_t end)
+void report_adjlist_with_sites(pbwt_t *b, const size_t first, const size_t second, const size_t begin, const size_t end)
 {
-	if (b->nmatrix == NULL)
-	{
-		b->nmatrix = (size_t **)malloc(b->nsam * sizeof(size_t *));
-		if (b->nmatrix == NULL)
-		{
-			return;
-		}
-		size_t i = 0;
-		for (i = 0; i < b->nsam; ++i)
-		{
-			b->nmatrix[i] = (size_t *)calloc(b->nsam, sizeof(size_t));
-			if (b->nmatrix[i] == NULL)
-			{
-				return;
-			}
-		}
-	}
-	b->nmatrix[first][second]++;
-	b->nmatrix[second][first]++;
+    out_printf(adjout, "%s\t%s\t%1.4lf\t%s\t%s\t%zu\t%zu\n", b->sid[first], b->sid[second],
+               b->cm[end] - b->cm[begin], b->reg[first], b->reg[second], begin, end);
 }
 
-void add_coancestry(pbwt_t *b, const size_t first, const size_t second, const size_t begin, const size_t end)
+void add_interval(pbwt_t *b, const size_t first, const size_t second, const size_t begin, const size_t end)
 {
-	if (b->cmatrix == NULL)
-	{
-		b->cmatrix = (double **)malloc(b->nsam * sizeof(double*));
-		if (b->cmatrix == NULL)
-		{
-			return;
-		}
-		size_t i = 0;
-		for (i = 0; i < b->nsam; i++)
-		{
-			b->cmatrix[i] = (double *)calloc(b->nsam, sizeof(double));
-			if (b->cmatrix[i] == NULL)
-			{
-				return;
-			}
-		}
-	}
-	double length = b->cm[end] - b->cm[begin];
-	b->cmatrix[first][second] += length;
-	b->cmatrix[second][first] = b->cmatrix[first][second];
+    b->intree = match_insert(b->intree, first, second, begin, end);
 }
 
 void add_region(pbwt_t *b, const size_t first, const size_t second, const size_t begin, const size_t end)
@@ -0,0 +1,697 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "pbwtutil.h"
+
+/* Segment files are BGZF streams of fixed-width records sorted by first
+ * haplotype. Every segment is stored under both of its haplotypes so a
+ * lookup by either one is a single seek; the first haplotype is implied
+ * by the .sidx table and the cM length by the genetic map in the header,
+ * so a record on disk is just the other haplotype and the start and end
+ * site. The writer sorts records in buffer-sized runs, spills full runs
+ * to a temporary file and merges them in seg_close into one stream. The
+ * .sidx holds nsam + 1 entries giving the virtual offset and ordinal of
+ * each haplotype's first record. The stream stays single-threaded:
+ * bgzf_tell() only gives a valid virtual offset when blocks are
+ * compressed in order. */
+
+#define SEG_MAGIC "PBWTSEG2"
+#define SIDX_MAGIC "PBWTSIX2"
+#define SEG_BUFSIZE (1 << 22)
+#define SEG_RUNBUF 4096
+
+/* On-disk record; the first haplotype comes from the index */
+typedef struct seg_disk
+{
+    uint32_t second;
+    uint32_t begin;
+    uint32_t end;
+} seg_disk_t;
+
+typedef struct sidx_ent
+{
+    uint64_t voff;
+    uint64_t rec;
+} sidx_ent_t;
+
+/* Read cursor over one sorted run during the merge */
+typedef struct seg_run
+{
+    uint64_t off;
+    uint64_t left;
+    size_t pos;
+    size_t n;
+    seg_rec_t *buf;
+} seg_run_t;
+
+int seg_spill(seg_writer_t *);
+int seg_merge(seg_writer_t *);
+int seg_refill(const int, seg_run_t *);
+void seg_sift(seg_run_t *, size_t *, const size_t, size_t);
+int seg_emit(seg_writer_t *, const seg_rec_t *, sidx_ent_t *, uint64_t *, seg_disk_t *, size_t *, uint64_t *);
+int seg_drain(seg_writer_t *, seg_disk_t *, size_t *);
+int compare_seg(const void *, const void *);
+int print_hap_segments(BGZF *, FILE *, out_t *, char **, char **, const double *, const uint32_t);
+
+seg_writer_t *seg_open(const char *outfile, const pbwt_t *b)
+{
+    size_t i = 0;
+    uint32_t nsam = 0;
+    uint32_t nsite = 0;
+    char *idxfile = NULL;
+    seg_writer_t *w = NULL;
+
+    w = (seg_writer_t *)calloc(1, sizeof(seg_writer_t));
+    if (w == NULL)
+    {
+        return NULL;
+    }
+    w->tmpfd = -1;
+    w->nsam = b->nsam;
+
+    w->buf = (seg_rec_t *)malloc(SEG_BUFSIZE * sizeof(seg_rec_t));
+    w->tmpname = (char *)malloc(strlen(outfile) + 5);
+    if (w->buf == NULL || w->tmpname == NULL)
+    {
+        free(w->buf);
+        free(w->tmpname);
+        free(w);
+        return NULL;
+    }
+    sprintf(w->tmpname, "%s.tmp", outfile);
+
+    w->fp = bgzf_open(outfile, "w");
+    if (w->fp == NULL)
+    {
+        fprintf(stderr, "pbwtutil [ERROR]: cannot open %s for writing\n", outfile);
+        free(w->tmpname);
+        free(w->buf);
+        free(w);
+        return NULL;
+    }
+
+    idxfile = (char *)malloc(strlen(outfile) + 6);
+    if (idxfile == NULL)
+    {
+        bgzf_close(w->fp);
+        free(w->tmpname);
+        free(w->buf);
+        free(w);
+        return NULL;
+    }
+    sprintf(idxfile, "%s.sidx", outfile);
+    w->idx = fopen(idxfile, "wb");
+    if (w->idx == NULL)
+    {
+        fprintf(stderr, "pbwtutil [ERROR]: cannot open %s for writing\n", idxfile);
+        bgzf_close(w->fp);
+        free(idxfile);
+        free(w->tmpname);
+        free(w->buf);
+        free(w);
+        return NULL;
+    }
+    free(idxfile);
+
+    /* Header carries the sample metadata and genetic map so the file is
+     * self-contained */
+    nsam = (uint32_t)b->nsam;
+    nsite = (uint32_t)b->nsite;
+    if (bgzf_write(w->fp, SEG_MAGIC, 8) < 0 ||
+        bgzf_write(w->fp, &nsam, sizeof(uint32_t)) < 0 ||
+        bgzf_write(w->fp, &nsite, sizeof(uint32_t)) < 0)
+    {
+        w->err = -1;
+    }
+    for (i = 0; i < b->nsam; ++i)
+    {
+        if (bgzf_write(w->fp, b->sid[i], strlen(b->sid[i]) + 1) < 0 ||
+            bgzf_write(w->fp, b->reg[i], strlen(b->reg[i]) + 1) < 0)
+        {
+            w->err = -1;
+        }
+    }
+    if (bgzf_write(w->fp, b->cm, b->nsite * sizeof(double)) < 0)
+    {
+        w->err = -1;
+    }
+
+    if (fwrite(SIDX_MAGIC, 1, 8, w->idx) != 8 || fwrite(&nsam, sizeof(uint32_t), 1, w->idx) != 1)
+    {
+        w->err = -1;
+    }
+
+    if (w->err < 0)
+    {
+        fprintf(stderr, "pbwtutil [ERROR]: cannot write header of %s\n", outfile);
+        seg_close(w);
+        return NULL;
+    }
+
+    return w;
+}
+
+void seg_add(seg_writer_t *w, const size_t first, const size_t second, const size_t begin,
+             const size_t end)
+{
+    seg_rec_t *r = NULL;
+
+    /* Called from the match callback: a failed spill is kept for seg_close */
+    if (w->nrec + 2 > SEG_BUFSIZE && seg_spill(w) < 0)
+    {
+        w->err = -1;
+        w->nrec = 0;
+    }
+
+    r = w->buf + w->nrec;
+    r[0].first = (uint32_t)first;
+    r[0].second = (uint32_t)second;
+    r[0].begin = (uint32_t)begin;
+    r[0].end = (uint32_t)end;
+    r[1] = r[0];
+    r[1].first = (uint32_t)second;
+    r[1].second = (uint32_t)first;
+    w->nrec += 2;
+}
+
+int seg_close(seg_writer_t *w)
+{
+    int v = 0;
+
+    if (w == NULL)
+    {
+        return 0;
+    }
+
+    v = w->err;
+    if (v == 0 && seg_merge(w) < 0)
+    {
+        v = -1;
+    }
+    if (bgzf_close(w->fp) < 0)
+    {
+        v = -1;
+    }
+    if (fclose(w->idx) != 0)
+    {
+        v = -1;
+    }
+    if (w->tmpfd >= 0)
+    {
+        close(w->tmpfd);
+        unlink(w->tmpname);
+    }
+    free(w->run_len);
+    free(w->tmpname);
+    free(w->buf);
+    free(w);
+
+    return v;
+}
+
+/* Sort the buffer and append it to the temporary file as one run */
+int seg_spill(seg_writer_t *w)
+{
+    size_t done = 0;
+    size_t size = w->nrec * sizeof(seg_rec_t);
+    uint64_t *run_len = NULL;
+    const char *p = (const char *)w->buf;
+
+    if (w->nrec == 0)
+    {
+        return 0;
+    }
+
+    if (w->tmpfd < 0)
+    {
+        w->tmpfd = open(w->tmpname, O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (w->tmpfd < 0)
+        {
+            return -1;
+        }
+    }
+
+    run_len = (uint64_t *)realloc(w->run_len, (w->nrun + 1) * sizeof(uint64_t));
+    if (run_len == NULL)
+    {
+        return -1;
+    }
+    w->run_len = run_len;
+
+    qsort(w->buf, w->nrec, sizeof(seg_rec_t), compare_seg);
+    while (done < size)
+    {
+        ssize_t n = write(w->tmpfd, p + done, size - done);
+        if (n <= 0)
+        {
+            return -1;
+        }
+        done += (size_t)n;
+    }
+
+    w->run_len[w->nrun++] = w->nrec;
+    w->nrec = 0;
+
+    return 0;
+}
+
+/* Merge all runs into the BGZF stream and write the offset table */
+int seg_merge(seg_writer_t *w)
+{
+    int v = 0;
+    size_t i = 0;
+    size_t nrun = 0;
+    size_t nheap = 0;
+    size_t nout = 0;
+    uint64_t hap = 0;
+    uint64_t nwritten = 0;
+    uint64_t off = 0;
+    size_t *heap = NULL;
+    seg_run_t *run = NULL;
+    seg_disk_t *out = NULL;
+    sidx_ent_t *ent = NULL;
+
+    /* Once anything was spilled the tail goes to disk too; otherwise the
+     * buffer is the only run and is merged straight from memory */
+    if (w->nrun > 0 && seg_spill(w) < 0)
+    {
+        return -1;
+    }
+    nrun = w->nrun > 0 ? w->nrun : 1;
+
+    run = (seg_run_t *)calloc(nrun, sizeof(seg_run_t));
+    heap = (size_t *)malloc(nrun * sizeof(size_t));
+    out = (seg_disk_t *)malloc(SEG_RUNBUF * sizeof(seg_disk_t));
+    ent = (sidx_ent_t *)malloc((w->nsam + 1) * sizeof(sidx_ent_t));
+    if (run == NULL || heap == NULL || out == NULL || ent == NULL)
+    {
+        v = -1;
+        goto done;
+    }
+
+    if (w->nrun == 0)
+    {
+        qsort(w->buf, w->nrec, sizeof(seg_rec_t), compare_seg);
+        run[0].buf = w->buf;
+        run[0].n = w->nrec;
+        if (w->nrec > 0)
+        {
+            heap[nheap++] = 0;
+        }
+    }
+    else
+    {
+        /* Reuse the record buffer for the per-run read buffers */
+        for (i = 0; i < nrun && v == 0; ++i)
+        {
+            run[i].off = off;
+            run[i].left = w->run_len[i];
+            off += w->run_len[i];
+            if (i < SEG_BUFSIZE / SEG_RUNBUF)
+            {
+                run[i].buf = w->buf + i * SEG_RUNBUF;
+            }
+            else
+            {
+                run[i].buf = (seg_rec_t *)malloc(SEG_RUNBUF * sizeof(seg_rec_t));
+                if (run[i].buf == NULL)
+                {
+                    v = -1;
+                    break;
+                }
+            }
+            if (seg_refill(w->tmpfd, &run[i]) < 0)
+            {
+                v = -1;
+            }
+            else if (run[i].n > 0)
+            {
+                heap[nheap++] = i;
+            }
+        }
+        if (v < 0)
+        {
+            goto done;
+        }
+    }
+
+    for (i = nheap / 2; i-- > 0; )
+    {
+        seg_sift(run, heap, nheap, i);
+    }
+
+    while (nheap > 0)
+    {
+        seg_run_t *r = run + heap[0];
+
+        if (seg_emit(w, r->buf + r->pos, ent, &hap, out, &nout, &nwritten) < 0)
+        {
+            v = -1;
+            goto done;
+        }
+        if (++r->pos == r->n)
+        {
+            if (r->left > 0 && seg_refill(w->tmpfd, r) < 0)
+            {
+                v = -1;
+                goto done;
+            }
+            if (r->pos == r->n)
+            {
+                heap[0] = heap[--nheap];
+            }
+        }
+        seg_sift(run, heap, nheap, 0);
+    }
+
+    /* Haplotypes past the last record start at the end of the stream */
+    if (seg_drain(w, out, &nout) < 0)
+    {
+        v = -1;
+        goto done;
+    }
+    for (; hap <= w->nsam; ++hap)
+    {
+        ent[hap].voff = (uint64_t)bgzf_tell(w->fp);
+        ent[hap].rec = nwritten;
+    }
+    if (fwrite(ent, sizeof(sidx_ent_t), w->nsam + 1, w->idx) != w->nsam + 1)
+    {
+        v = -1;
+    }
+
+done:
+    if (run != NULL && w->nrun > SEG_BUFSIZE / SEG_RUNBUF)
+    {
+        for (i = SEG_BUFSIZE / SEG_RUNBUF; i < nrun; ++i)
+        {
+            free(run[i].buf);
+        }
+    }
+    free(run);
+    free(heap);
+    free(out);
+    free(ent);
+
+    return v;
+}
+
+int seg_refill(const int fd, seg_run_t *r)
+{
+    size_t done = 0;
+    size_t size = 0;
+    char *p = (char *)r->buf;
+
+    r->n = r->left < SEG_RUNBUF ? (size_t)r->left : SEG_RUNBUF;
+    r->pos = 0;
+    size = r->n * sizeof(seg_rec_t);
+    while (done < size)
+    {
+        ssize_t n = pread(fd, p + done, size - done, (off_t)(r->off * sizeof(seg_rec_t) + done));
+        if (n <= 0)
+        {
+            return -1;
+        }
+        done += (size_t)n;
+    }
+    r->off += r->n;
+    r->left -= r->n;
+
+    return 0;
+}
+
+/* Restore the min-heap of runs below position i */
+void seg_sift(seg_run_t *run, size_t *heap, const size_t nheap, size_t i)
+{
+    while (1)
+    {
+        size_t min = i;
+        size_t l = 2 * i + 1;
+        size_t r = l + 1;
+        size_t t = 0;
+
+        if (l < nheap && compare_seg(run[heap[l]].buf + run[heap[l]].pos,
+                                     run[heap[min]].buf + run[heap[min]].pos) < 0)
+        {
+            min = l;
+        }
+        if (r < nheap && compare_seg(run[heap[r]].buf + run[heap[r]].pos,
+                                     run[heap[min]].buf + run[heap[min]].pos) < 0)
+        {
+            min = r;
+        }
+        if (min == i)
+        {
+            break;
+        }
+        t = heap[i];
+        heap[i] = heap[min];
+        heap[min] = t;
+        i = min;
+    }
+}
+
+/* Queue one record; a new first haplotype drains the queue so bgzf_tell()
+ * points at its first record */
+int seg_emit(seg_writer_t *w, const seg_rec_t *r, sidx_ent_t *ent, uint64_t *hap,
+             seg_disk_t *out, size_t *nout, uint64_t *nwritten)
+{
+    if (*hap <= r->first)
+    {
+        if (seg_drain(w, out, nout) < 0)
+        {
+            return -1;
+        }
+        for (; *hap <= r->first; ++*hap)
+        {
+            ent[*hap].voff = (uint64_t)bgzf_tell(w->fp);
+            ent[*hap].rec = *nwritten;
+        }
+    }
+
+    out[*nout].second = r->second;
+    out[*nout].begin = r->begin;
+    out[*nout].end = r->end;
+    ++*nwritten;
+    if (++*nout == SEG_RUNBUF)
+    {
+        return seg_drain(w, out, nout);
+    }
+
+    return 0;
+}
+
+int seg_drain(seg_writer_t *w, seg_disk_t *out, size_t *nout)
+{
+    if (*nout > 0 && bgzf_write(w->fp, out, *nout * sizeof(seg_disk_t)) < 0)
+    {
+        return -1;
+    }
+    *nout = 0;
+
+    return 0;
+}
+
+int compare_seg(const void *a, const void *b)
+{
+    const seg_rec_t *x = (const seg_rec_t *)a;
+    const seg_rec_t *y = (const seg_rec_t *)b;
+
+    if (x->first != y->first)
+    {
+        return x->first < y->first ? -1 : 1;
+    }
+    if (x->begin != y->begin)
+    {
+        return x->begin < y->begin ? -1 : 1;
+    }
+    return (x->second > y->second) - (x->second < y->second);
+}
+
+int seg_view(const cmd_t *c)
+{
+    int v = 0;
+    size_t i = 0;
+    size_t nfound = 0;
+    uint32_t nsam = 0;
+    uint32_t nsite = 0;
+    uint32_t nidx = 0;
+    char magic[8];
+    char *idxfile = NULL;
+    char **sid = NULL;
+    char **reg = NULL;
+    double *cm = NULL;
+    size_t len = 0;
+    size_t maxlen = 256;
+    char *str = NULL;
+    BGZF *fp = NULL;
+    FILE *idx = NULL;
+    out_t *out = NULL;
+
+    fp = bgzf_open(c->instub, "r");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "pbwtutil [ERROR]: cannot read data from %s\n", c->instub);
+        return -1;
+    }
+
+    if (bgzf_read(fp, magic, 8) != 8 || memcmp(magic, SEG_MAGIC, 8) != 0)
+    {
+        fprintf(stderr, "pbwtutil [ERROR]: %s is not a segment file\n", c->instub);
+        return -1;
+    }
+    if (bgzf_read(fp, &nsam, sizeof(uint32_t)) != sizeof(uint32_t) ||
+        bgzf_read(fp, &nsite, sizeof(uint32_t)) != sizeof(uint32_t))
+    {
+        fprintf(stderr, "pbwtutil [ERROR]: truncated header in %s\n", c->instub);
+        return -1;
+    }
+
+    /* Read sample metadata and the genetic map from the header */
+    sid = (char **)malloc(nsam * sizeof(char *));
+    reg = (char **)malloc(nsam * sizeof(char *));
+    cm = (double *)malloc(nsite * sizeof(double));
+    if (sid == NULL || reg == NULL || cm == NULL)
+    {
+        fputs("pbwtutil [ERROR]: memory allocation failure\n", stderr);
+        return -1;
+    }
+    str = (char *)malloc(maxlen);
+    for (i = 0; i < 2 * (size_t)nsam; ++i)
+    {
+        len = 0;
+        do
+        {
+            if (len == maxlen)
+            {
+                maxlen *= 2;
+                str = (char *)realloc(str, maxlen);
+            }
+            if (bgzf_read(fp, str + len, 1) != 1)
+            {
+                fprintf(stderr, "pbwtutil [ERROR]: truncated header in %s\n", c->instub);
+                return -1;
+            }
+        } while (str[len++] != '\0');
+        if (i % 2 == 0)
+        {
+            sid[i/2] = strdup(str);
+        }
+        else
+        {
+            reg[i/2] = strdup(str);
+        }
+    }
+    free(str);
+    if (bgzf_read(fp, cm, nsite * sizeof(double)) != (ssize_t)(nsite * sizeof(double)))
+    {
+        fprintf(stderr, "pbwtutil [ERROR]: truncated header in %s\n", c->instub);
+        return -1;
+    }
+
+    idxfile = (char *)malloc(strlen(c->instub) + 6);
+    if (idxfile == NULL)
+    {
+        fputs("pbwtutil [ERROR]: memory allocation failure\n", stderr);
+        return -1;
+    }
+    sprintf(idxfile, "%s.sidx", c->instub);
+    idx = fopen(idxfile, "rb");
+    if (idx == NULL)
+    {
+        fprintf(stderr, "pbwtutil [ERROR]: cannot read segment index %s\n", idxfile);
+        return -1;
+    }
+    if (fread(magic, 1, 8, idx) != 8 || memcmp(magic, SIDX_MAGIC, 8) != 0 ||
+        fread(&nidx, sizeof(uint32_t), 1, idx) != 1 || nidx != nsam)
+    {
+        fprintf(stderr, "pbwtutil [ERROR]: %s is not a segment index\n", idxfile);
+        return -1;
+    }
+    free(idxfile);
+
+    out = open_output(c, NULL);
+    if (out == NULL)
+    {
+        return -1;
+    }
+
+    /* Print segments of every haplotype carrying the query identifier */
+    for (i = 0; i < nsam; ++i)
+    {
+        if (strcmp(sid[i], c->query) == 0)
+        {
+            v = print_hap_segments(fp, idx, out, sid, reg, cm, (uint32_t)i);
+            if (v < 0)
+            {
+                fputs("pbwtutil [ERROR]: error reading segment file\n", stderr);
+                out_close(out);
+                return -1;
+            }
+            ++nfound;
+        }
+    }
+
+    if (out_close(out) < 0)
+    {
+        fputs("pbwtutil [ERROR]: error writing output\n", stderr);
+        return -1;
+    }
+
+    if (nfound == 0)
+    {
+        fprintf(stderr, "pbwtutil [ERROR]: cannot find haplotype with id %s\n", c->query);
+        return -1;
+    }
+
+    /* Clean up allocated memory */
+    for (i = 0; i < nsam; ++i)
+    {
+        free(sid[i]);
+        free(reg[i]);
+    }
+    free(sid);
+    free(reg);
+    free(cm);
+    fclose(idx);
+    bgzf_close(fp);
+
+    return 0;
+}
+
+int print_hap_segments(BGZF *fp, FILE *idx, out_t *out, char **sid, char **reg,
+                       const double *cm, const uint32_t hap)
+{
+    uint64_t k = 0;
+    seg_disk_t r;
+    sidx_ent_t e[2];
+
+    /* Entries hap and hap + 1 bound this haplotype's records */
+    if (fseek(idx, (long)(8 + sizeof(uint32_t) + hap * sizeof(sidx_ent_t)), SEEK_SET) != 0 ||
+        fread(e, sizeof(sidx_ent_t), 2, idx) != 2)
+    {
+        return -1;
+    }
+    if (e[1].rec == e[0].rec)
+    {
+        return 0;
+    }
+    if (bgzf_seek(fp, (int64_t)e[0].voff, SEEK_SET) < 0)
+    {
+        return -1;
+    }
+
+    for (k = e[0].rec; k < e[1].rec; ++k)
+    {
+        if (bgzf_read(fp, &r, sizeof(seg_disk_t)) != sizeof(seg_disk_t))
+        {
+            return -1;
+        }
+        out_printf(out, "%s\t%s\t%1.4lf\t%s\t%s\t%u\t%u\n", sid[hap], sid[r.second],
+                   cm[r.end] - cm[r.begin], reg[hap], reg[r.second], r.begin, r.end);
+    }
+
+    return 0;
+}
@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pbwtutil.h"
+
+/* Each unit (haplotype, or individual with --diploid) keeps its K
+ * longest matches in a min-heap of fixed size, so the shortest retained
+ * match is always at the root and is the one displaced. Memory is
+ * n x K records however many matches the sweep reports, or K per query
+ * unit in match mode, where units outside [topk_lo, topk_hi) are
+ * skipped. At the end each
+ * heap is sorted in place, longest first, by repeatedly popping the
+ * root. */
+
+void sift_down(topk_rec_t *, const size_t, size_t);
+
+void topk_add(accum_t *a, const size_t unit, const size_t self, const size_t other, const size_t begin,
+              const size_t end, const double length)
+{
+    topk_rec_t *h = NULL;
+    size_t n = 0;
+    size_t u = 0;
+
+    if (unit < a->topk_lo || unit >= a->topk_hi)
+    {
+        return;
+    }
+    h = a->topk_heap + (unit - a->topk_lo) * a->topk;
+    n = a->topk_n[unit - a->topk_lo];
+
+    if (n == a->topk)
+    {
+        /* Ties keep the match seen first */
+        if (length <= h[0].length)
+        {
+            return;
+        }
+        h[0].self = (uint32_t)self;
+        h[0].other = (uint32_t)other;
+        h[0].begin = (uint32_t)begin;
+        h[0].end = (uint32_t)end;
+        h[0].length = length;
+        sift_down(h, n, 0);
+        return;
+    }
+
+    /* Heap not yet full: sift the new record up */
+    u = n;
+    while (u > 0 && h[(u-1)/2].length > length)
+    {
+        h[u] = h[(u-1)/2];
+        u = (u - 1) / 2;
+    }
+    h[u].self = (uint32_t)self;
+    h[u].other = (uint32_t)other;
+    h[u].begin = (uint32_t)begin;
+    h[u].end = (uint32_t)end;
+    h[u].length = length;
+    a->topk_n[unit - a->topk_lo] = n + 1;
+}
+
+void sift_down(topk_rec_t *h, const size_t n, size_t u)
+{
+    const topk_rec_t x = h[u];
+
+    while (2 * u + 1 < n)
+    {
+        size_t c = 2 * u + 1;
+        if (c + 1 < n && h[c+1].length < h[c].length)
+        {
+            ++c;
+        }
+        if (h[c].length >= x.length)
+        {
+            break;
+        }
+        h[u] = h[c];
+        u = c;
+    }
+    h[u] = x;
+}
+
+int print_top_k(out_t *fp, const pbwt_t *b, accum_t *a, const size_t lo, const size_t hi,
+                const int print_sites)
+{
+    int v = 0;
+    size_t u = 0;
+    size_t r = 0;
+
+    for (u = lo; u < hi; ++u)
+    {
+        topk_rec_t *h = a->topk_heap + (u - a->topk_lo) * a->topk;
+        size_t n = a->topk_n[u - a->topk_lo];
+
+        /* Popping the minimum to the back leaves the longest first */
+        while (n > 1)
+        {
+            const topk_rec_t t = h[0];
+            h[0] = h[n-1];
+            h[n-1] = t;
+            sift_down(h, --n, 0);
+        }
+
+        for (r = 0; r < a->topk_n[u - a->topk_lo]; ++r)
+        {
+            const topk_rec_t *m = h + r;
+            if (print_sites)
+            {
+                if (out_printf(fp, "%s\t%s\t%1.4lf\t%s\t%s\t%u\t%u\n", b->sid[m->self], b->sid[m->other],
+                               m->length, b->reg[m->self], b->reg[m->other], m->begin, m->end) < 0)
+                {
+                    v = -1;
+                }
+            }
+            else
+            {
+                if (out_printf(fp, "%s\t%s\t%1.4lf\t%s\t%s\n", b->sid[m->self], b->sid[m->other],
+                               m->length, b->reg[m->self], b->reg[m->other]) < 0)
+                {
+                    v = -1;
+                }
+            }
+        }
+    }
+
+    return v;
+}